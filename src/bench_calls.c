@@ -0,0 +1,95 @@
+/*
+ * Compares the call throughput of one-shot call pad connections (a connection per call) with calls
+ * pipelined over a single persistent connection, keeping up to a window of calls in flight.
+ * Every variant makes as many calls as it can for a fixed time.
+ * Needs a running controller, `make bench-calls` starts one without cars, so that every call gets the
+ * same (UNAVAILABLE) answer and queues growing during the run do not skew the later variants.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "shared.h"
+#include "histogram.h"
+#include "call_client.h"
+
+#define BENCH_NS 2000000000ULL     // How long every variant runs
+#define MAX_WINDOW 64
+#define BENCH_FLOORS 10
+
+static void report(const char *name, int binary, uint64_t elapsed_ns, size_t calls) {
+    char label[64];
+    snprintf(label, sizeof(label), "%s (%s)", name, binary ? "binary" : "text");
+    printf("%-28s %10.0f calls/s\n", label, calls / (elapsed_ns / 1e9));
+}
+
+static void random_call(floor_t *source_floor, floor_t *destination_floor) {
+    *source_floor = 1 + rand() % BENCH_FLOORS;
+    *destination_floor = 1 + (*source_floor + rand() % (BENCH_FLOORS - 1)) % BENCH_FLOORS;
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed, is the controller running?\n", what);
+    exit(EXIT_FAILURE);
+}
+
+static void bench_one_shot(int binary) {
+    size_t calls = 0;
+    uint64_t start = now_ns();
+    for (; now_ns() - start < BENCH_NS; calls++) {
+        floor_t source_floor, destination_floor;
+        call_reply_t reply;
+        random_call(&source_floor, &destination_floor);
+        if (cc_call(binary, source_floor, destination_floor, &reply) != 0) {
+            fail("cc_call()");
+        }
+    }
+    report("one-shot", binary, now_ns() - start, calls);
+}
+
+static void bench_pipelined(int binary, size_t window) {
+    call_client_t client;
+    if (cc_connect(&client, binary) == -1) {
+        fail("cc_connect()");
+    }
+
+    size_t sent = 0;
+    size_t received = 0;
+    uint64_t start = now_ns();
+    while (received < sent || now_ns() - start < BENCH_NS) {
+        // Top up the window until the time is up, then wait for one reply
+        while (sent - received < window && now_ns() - start < BENCH_NS) {
+            floor_t source_floor, destination_floor;
+            uint32_t request_id;
+            random_call(&source_floor, &destination_floor);
+            if (cc_send_call(&client, source_floor, destination_floor, &request_id) == -1) {
+                fail("cc_send_call()");
+            }
+            sent++;
+        }
+        if (received == sent) {
+            break;
+        }
+        call_reply_t reply;
+        if (cc_receive_reply(&client, &reply) == -1) {
+            fail("cc_receive_reply()");
+        }
+        received++;
+    }
+    uint64_t elapsed = now_ns() - start;
+    cc_close(&client);
+
+    char name[32];
+    snprintf(name, sizeof(name), "pipelined, window %zu", window);
+    report(name, binary, elapsed, received);
+}
+
+int main(void) {
+    srand(1);
+    for (int binary = 0; binary <= 1; binary++) {
+        bench_one_shot(binary);
+        bench_pipelined(binary, 1);
+        bench_pipelined(binary, MAX_WINDOW);
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Measures the round trip of a STATUS message answered with a FLOOR message over a loopback TCP connection,
+ * the exchange between a car and the controller, before and after the framed sends of the transport layer.
+ * "split" sends the length prefix and the message with two writes, like send_message() used to; with Nagle's
+ * algorithm on, the message then waits for the peer's delayed ACK of the prefix. "gather" sends both with one
+ * write (send_frame()), "corked" sends two frames with one write (frame_batch_send()).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "shared.h"
+#include "histogram.h"
+
+#define DEFAULT_ROUND_TRIPS 100
+#define MAX_FRAMES 2
+
+static const char *ping_msgs[MAX_FRAMES] = { "STATUS Between 12 40", "STATUS Closed 12 40" };
+static const char *pong_msg = "FLOOR 40";
+
+typedef enum { SEND_SPLIT, SEND_GATHER, SEND_CORKED } send_mode;
+
+/**
+ * A variant of the exchange.
+ */
+typedef struct pingpong_variant {
+    const char *name;
+    send_mode mode;
+    int nodelay;                // 1 if both ends set TCP_NODELAY
+    int frames;                 // Frames per ping, the pong is a single frame
+} pingpong_variant_t;
+
+static const pingpong_variant_t variants[] = {
+    { "split, Nagle", SEND_SPLIT, 0, 1 },
+    { "split, TCP_NODELAY", SEND_SPLIT, 1, 1 },
+    { "gather, Nagle", SEND_GATHER, 0, 1 },
+    { "gather, TCP_NODELAY", SEND_GATHER, 1, 1 },
+    { "2 frames gather, TCP_NODELAY", SEND_GATHER, 1, 2 },
+    { "2 frames corked, TCP_NODELAY", SEND_CORKED, 1, 2 },
+};
+
+/**
+ * The end of the connection answering the pings.
+ */
+typedef struct ponger {
+    int fd;
+    const pingpong_variant_t *variant;
+    size_t round_trips;
+} ponger_t;
+
+static int send_split(int fd, const char *msg) {
+    uint32_t len = htonl(strlen(msg));
+    if (send_looped(fd, &len, sizeof(len)) == -1) {
+        return -1;
+    }
+    return send_looped(fd, msg, strlen(msg));
+}
+
+/**
+ * Sends count messages the variant's way.
+ */
+static int send_msgs(int fd, send_mode mode, const char **msgs, int count) {
+    if (mode == SEND_CORKED) {
+        frame_batch_t batch;
+        frame_batch_init(&batch);
+        for (int i = 0; i < count; i++) {
+            frame_batch_add(&batch, msgs[i], strlen(msgs[i]));
+        }
+        return frame_batch_send(&batch, fd);
+    }
+    for (int i = 0; i < count; i++) {
+        int result = mode == SEND_SPLIT ? send_split(fd, msgs[i]) : send_message(fd, msgs[i]);
+        if (result == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int receive_msgs(int fd, int count) {
+    for (int i = 0; i < count; i++) {
+        char *msg = receive_msg(fd);
+        if (msg == NULL) {
+            return -1;
+        }
+        free(msg);
+    }
+    return 0;
+}
+
+static void * pong(void *arg) {
+    ponger_t *ponger = arg;
+    const pingpong_variant_t *variant = ponger->variant;
+    for (size_t i = 0; i < ponger->round_trips; i++) {
+        if (receive_msgs(ponger->fd, variant->frames) == -1
+            || send_msgs(ponger->fd, variant->mode == SEND_CORKED ? SEND_GATHER : variant->mode, &pong_msg, 1) == -1) {
+            perror("pong");
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Connects a pair of loopback TCP sockets through a listener on an ephemeral port.
+ */
+static void connect_pair(int fds[2]) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listenfd == -1 || bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenfd, 1) == -1
+        || getsockname(listenfd, (struct sockaddr *) &addr, &addr_len) == -1) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] == -1 || connect(fds[0], (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || (fds[1] = accept(listenfd, NULL, NULL)) == -1) {
+        perror("connect()/accept()");
+        exit(EXIT_FAILURE);
+    }
+    close(listenfd);
+}
+
+static void bench_variant(const pingpong_variant_t *variant, size_t round_trips) {
+    int fds[2];
+    connect_pair(fds);
+    if (variant->nodelay && (set_low_latency(fds[0]) == -1 || set_low_latency(fds[1]) == -1)) {
+        exit(EXIT_FAILURE);
+    }
+
+    ponger_t ponger = { .fd = fds[1], .variant = variant, .round_trips = round_trips };
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, pong, &ponger) != 0) {
+        perror("pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+
+    histogram_t *rtt = malloc(sizeof(histogram_t));
+    if (rtt == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    hist_init(rtt);
+    for (size_t i = 0; i < round_trips; i++) {
+        uint64_t start = now_ns();
+        if (send_msgs(fds[0], variant->mode, ping_msgs, variant->frames) == -1 || receive_msgs(fds[0], 1) == -1) {
+            perror("ping");
+            exit(EXIT_FAILURE);
+        }
+        hist_record(rtt, now_ns() - start);
+    }
+    pthread_join(thread_id, NULL);
+
+    printf("%-30s RTT (us): mean %8.1f, p50 %8.1f, p99 %8.1f, max %8.1f\n", variant->name,
+        hist_mean(rtt) / 1000.0, hist_percentile(rtt, 50.0) / 1000.0, hist_percentile(rtt, 99.0) / 1000.0,
+        hist_max(rtt) / 1000.0);
+    fflush(stdout);
+    free(rtt);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char **argv) {
+    size_t round_trips = DEFAULT_ROUND_TRIPS;
+    if (argc > 2 || (argc == 2 && (round_trips = strtoul(argv[1], NULL, 10)) == 0)) {
+        fprintf(stderr, "Usage: %s [round trips per variant]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        bench_variant(&variants[i], round_trips);
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ * Compares the cost of the text and binary protocols for the hottest message, STATUS.
+ * Encoding and decoding are measured in memory, the round trip sends and receives every
+ * message through a local socket pair using the same functions as the car and the controller.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "shared.h"
+#include "protocol.h"
+#include "histogram.h"
+
+#define ITERATIONS 1000000
+#define ROUND_TRIPS 200000
+
+static volatile int sink; // Keeps the compiler from optimizing the measured work away
+
+static void report(const char *name, uint64_t elapsed_ns, size_t iterations) {
+    printf("%-24s %8.1f ns/op\n", name, (double) elapsed_ns / iterations);
+}
+
+static void bench_text(int fds[2]) {
+    char msg[23];
+    char *tokens[4];
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        snprintf(msg, sizeof(msg), "STATUS %s %s %s", "Between", i % 2 ? "12" : "B3", "40");
+        sink += msg[8];
+    }
+    report("text encode", now_ns() - start, ITERATIONS);
+
+    start = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        strcpy(msg, "STATUS Between 12 40");
+        tokenize_message(msg, tokens, 4);
+        sink += strncmp(tokens[0], "STATUS", MAX_STATUS_LENGTH) == 0 && status_from_string(tokens[1]) == STATUS_BETWEEN;
+        sink += floor_parse(tokens[2]) + floor_parse(tokens[3]);
+    }
+    report("text decode", now_ns() - start, ITERATIONS);
+
+    start = now_ns();
+    for (size_t i = 0; i < ROUND_TRIPS; i++) {
+        snprintf(msg, sizeof(msg), "STATUS %s %s %s", "Between", "12", "40");
+        send_message(fds[0], msg);
+        char *received = receive_msg(fds[1]);
+        tokenize_message(received, tokens, 4);
+        sink += status_from_string(tokens[1]) + floor_parse(tokens[2]) + floor_parse(tokens[3]);
+        free(received);
+    }
+    report("text round trip", now_ns() - start, ROUND_TRIPS);
+}
+
+static void bench_binary(int fds[2]) {
+    uint8_t buf[PROTO_RECORD_SIZE];
+    proto_record rec = { .type = PROTO_STATUS, .status = STATUS_BETWEEN, .floor = 12, .other_floor = 40 };
+    proto_record decoded;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        rec.floor = i % 2 ? 12 : -3;
+        proto_encode(&rec, buf);
+        sink += buf[5];
+    }
+    report("binary encode", now_ns() - start, ITERATIONS);
+
+    proto_encode(&rec, buf);
+    start = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        proto_decode((const char *) buf, sizeof(buf), &decoded);
+        sink += decoded.type == PROTO_STATUS && decoded.status == STATUS_BETWEEN;
+        sink += decoded.floor + decoded.other_floor;
+    }
+    report("binary decode", now_ns() - start, ITERATIONS);
+
+    start = now_ns();
+    for (size_t i = 0; i < ROUND_TRIPS; i++) {
+        send_record(fds[0], &rec);
+        uint32_t len;
+        char *received = receive_frame(fds[1], &len);
+        proto_decode(received, len, &decoded);
+        sink += decoded.status + decoded.floor + decoded.other_floor;
+        free(received);
+    }
+    report("binary round trip", now_ns() - start, ROUND_TRIPS);
+}
+
+int main(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair()");
+        exit(EXIT_FAILURE);
+    }
+
+    bench_text(fds);
+    bench_binary(fds);
+
+    close(fds[0]);
+    close(fds[1]);
+}
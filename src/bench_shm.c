@@ -0,0 +1,149 @@
+/*
+ * Measures reads of a car's shared memory by many concurrent readers while a writer changes it the way the car
+ * does: holding the mutex for a while, then waiting on the condition variable. "mutex" readers lock the mutex for
+ * their copy like the consumers used to, "seqlock" readers take a snapshot with shm_snapshot().
+ * The writer always sets both floors to the same value, so a snapshot with differing floors would be torn.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "shared.h"
+#include "histogram.h"
+
+#define DEFAULT_DURATION_MS 500
+#define WRITER_HOLD_NS 20000    // How long the writer holds the mutex per change
+#define WRITER_WAIT_NS 80000    // How long the writer waits on the condition variable between changes
+
+static const int reader_counts[] = { 1, 4, 16 };
+
+typedef enum { READ_MUTEX, READ_SEQLOCK } read_mode;
+
+static car_shared_mem shm;
+static atomic_int stop;
+
+/**
+ * A reader thread and what it measured.
+ */
+typedef struct reader {
+    pthread_t thread_id;
+    read_mode mode;
+    histogram_t latency;
+    uint64_t torn;              // Snapshots with differing floors
+} reader_t;
+
+static void spin_for(uint64_t ns) {
+    uint64_t end = now_ns() + ns;
+    while (now_ns() < end) {
+        // Busy, like the car checking and changing its state
+    }
+}
+
+static void * writer(void *arg) {
+    (void) arg;
+    floor_t floor = 1;
+    shm_lock(&shm);
+    while (!atomic_load(&stop)) {
+        floor = floor % MAX_FLOOR + 1;
+        // The floors change apart from each other, a reader copying in between sees them differ
+        shm_set_current_floor(&shm, floor);
+        spin_for(WRITER_HOLD_NS / 2);
+        shm_set_destination_floor(&shm, floor);
+        shm_set_status(&shm, floor % 2 == 0 ? STATUS_BETWEEN : STATUS_CLOSED);
+        spin_for(WRITER_HOLD_NS / 2);
+        pthread_cond_broadcast(&shm.cond);
+
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += WRITER_WAIT_NS;
+        if (timeout.tv_nsec >= 1000000000L) {
+            timeout.tv_sec += 1;
+            timeout.tv_nsec -= 1000000000L;
+        }
+        shm_timedwait(&shm, &timeout);
+    }
+    shm_unlock(&shm);
+    return NULL;
+}
+
+static void * read_loop(void *arg) {
+    reader_t *reader = arg;
+    car_snapshot_t snapshot;
+    while (!atomic_load(&stop)) {
+        uint64_t start = now_ns();
+        if (reader->mode == READ_MUTEX) {
+            pthread_mutex_lock(&shm.mutex);
+            snapshot.current_floor = shm.state.current_floor;
+            snapshot.destination_floor = shm.state.destination_floor;
+            snapshot.status = shm.state.status;
+            pthread_mutex_unlock(&shm.mutex);
+        } else {
+            shm_snapshot(&shm, &snapshot);
+        }
+        hist_record(&reader->latency, now_ns() - start);
+        if (snapshot.current_floor != snapshot.destination_floor) {
+            reader->torn++;
+        }
+    }
+    return NULL;
+}
+
+static void bench_variant(read_mode mode, int readers, unsigned duration_ms) {
+    shm_init(&shm, 1);
+    atomic_store(&stop, 0);
+
+    reader_t *threads = calloc(readers, sizeof(reader_t));
+    histogram_t *latency = malloc(sizeof(histogram_t));
+    if (threads == NULL || latency == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    hist_init(latency);
+
+    pthread_t writer_id;
+    if (pthread_create(&writer_id, NULL, writer, NULL) != 0) {
+        perror("pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < readers; i++) {
+        threads[i].mode = mode;
+        hist_init(&threads[i].latency);
+        if (pthread_create(&threads[i].thread_id, NULL, read_loop, &threads[i]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, 1);
+
+    uint64_t torn = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+        hist_merge(latency, &threads[i].latency);
+        torn += threads[i].torn;
+    }
+    pthread_join(writer_id, NULL);
+
+    printf("%-8s %2d readers: %8.0f reads/s, latency (us): mean %7.2f, p50 %7.2f, p99 %7.2f, max %8.1f, torn %lu\n",
+        mode == READ_MUTEX ? "mutex" : "seqlock", readers, hist_count(latency) * 1000.0 / duration_ms,
+        hist_mean(latency) / 1000.0, hist_percentile(latency, 50.0) / 1000.0, hist_percentile(latency, 99.0) / 1000.0,
+        hist_max(latency) / 1000.0, (unsigned long) torn);
+    fflush(stdout);
+    free(latency);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    unsigned duration_ms = DEFAULT_DURATION_MS;
+    if (argc > 2 || (argc == 2 && (duration_ms = strtoul(argv[1], NULL, 10)) == 0)) {
+        fprintf(stderr, "Usage: %s [milliseconds per variant]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < sizeof(reader_counts) / sizeof(reader_counts[0]); i++) {
+        bench_variant(READ_MUTEX, reader_counts[i], duration_ms);
+        bench_variant(READ_SEQLOCK, reader_counts[i], duration_ms);
+    }
+}
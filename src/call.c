@@ -1,91 +1,99 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <arpa/inet.h>
-#include <unistd.h>
 #include "shared.h"
+#include "call_client.h"
 
-int get_car_name(const char *response, const char **car_name) {
-    const char *prefix = "CAR ";
-    size_t prefix_len = strlen(prefix);
-
-    // Response does not include car name
-    if (strncmp(response, prefix, prefix_len) != 0) {
-        return 0;
+void print_reply(const call_reply_t *reply) {
+    if (reply->result == CALL_ASSIGNED) {
+        printf("Car %s is arriving.\n", reply->car_name);
+    } else {
+        printf("Sorry, no car is available to take this request.\n");
     }
-
-    *car_name = response + prefix_len;
-
-    return 1;
 }
 
-int main(int argc, char **argv) {
-    // Check if exactly 2 arguments are passed
-    if (argc != 3) {
-        printf("Usage: %s {source floor} {destination floor}\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-    // Check if the floor numbers are valid
-    if (!is_valid_floor(argv[1]) || !is_valid_floor(argv[2])) {
-        printf("Invalid floor(s) specified.\n");
-        exit(EXIT_FAILURE);
-    }
-    // Check if the floor numbers differ
-    if (strcmp(argv[1], argv[2]) == 0) {
-        printf("You are already on that floor!\n");
+/**
+ * Sends all calls over one connection without waiting for the replies, then prints the replies as they arrive.
+ */
+void pipeline_calls(const floor_t *floors, size_t ncalls) {
+    call_client_t client;
+    if (cc_connect(&client, 0) == -1) {
+        fprintf(stderr, "Unable to connect to elevator system.\n");
         exit(EXIT_FAILURE);
     }
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("socket()");
-        exit(EXIT_FAILURE);
+    // Request ids are handed out sequentially starting from 1 -> the id is the index of the call plus one
+    for (size_t i = 0; i < ncalls; i++) {
+        uint32_t request_id;
+        if (cc_send_call(&client, floors[2 * i], floors[2 * i + 1], &request_id) == -1) {
+            fprintf(stderr, "Failed to send request to elevator system.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(3000);
-    const char *ipaddress = "127.0.0.1";
-    if (inet_pton(AF_INET, ipaddress, &addr.sin_addr) != 1) {
-        fprintf(stderr, "inet_pton(%s)\n", ipaddress);
-        exit(EXIT_FAILURE);
+    for (size_t i = 0; i < ncalls; i++) {
+        call_reply_t reply;
+        if (cc_receive_reply(&client, &reply) == -1 || reply.request_id == 0 || reply.request_id > ncalls) {
+            fprintf(stderr, "Failed to receive response from elevator system.\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t call = reply.request_id - 1;
+        printf("%s -> %s: ", floor_name(floors[2 * call]), floor_name(floors[2 * call + 1]));
+        print_reply(&reply);
     }
 
-    if (connect(sockfd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
-        fprintf(stderr, "Unable to connect to elevator system.\n");
-        exit(EXIT_FAILURE);
-    }
+    cc_close(&client);
+}
 
-    char msg[13] = {0};
-    snprintf(msg, sizeof(msg), "CALL %s %s", argv[1], argv[2]);
-    
-    if (send_message(sockfd, msg) == -1) {
-        fprintf(stderr, "Failed to send request to elevator system.\n");
+int main(int argc, char **argv) {
+    // Check if pairs of floors are passed
+    if (argc < 3 || argc % 2 != 1) {
+        printf("Usage: %s {source floor} {destination floor} [{source floor} {destination floor} ...]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    char *response = receive_msg(sockfd);
-
-    if (response == NULL) {
-        fprintf(stderr, "Failed to receive response from elevator system.\n");
+    size_t ncalls = (argc - 1) / 2;
+    floor_t *floors = malloc((argc - 1) * sizeof(floor_t));
+    if (floors == NULL) {
+        perror("malloc()");
         exit(EXIT_FAILURE);
     }
+    for (int i = 1; i < argc; i += 2) {
+        floors[i - 1] = floor_parse(argv[i]);
+        floors[i] = floor_parse(argv[i + 1]);
+        // Check if the floor numbers are valid
+        if (floors[i - 1] == NO_FLOOR || floors[i] == NO_FLOOR) {
+            printf("Invalid floor(s) specified.\n");
+            exit(EXIT_FAILURE);
+        }
+        // Check if the floor numbers differ
+        if (floors[i - 1] == floors[i]) {
+            printf("You are already on that floor!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    const char *car_name = NULL;
-    if (get_car_name(response, &car_name)) {
-        printf("Car %s is arriving.\n", car_name);
-    } else {
-        printf("Sorry, no car is available to take this request.\n");
+    // Several calls -> send them all over one connection
+    if (ncalls > 1) {
+        pipeline_calls(floors, ncalls);
+        free(floors);
+        return 0;
     }
-    free(response);
 
-    if (shutdown(sockfd, SHUT_RDWR) == -1) {
-        perror("shutdown()");
+    call_reply_t reply;
+    switch (cc_call(0, floors[0], floors[1], &reply)) {
+    case 0:
+        break;
+    case CC_CONNECT_FAILED:
+        fprintf(stderr, "Unable to connect to elevator system.\n");
         exit(EXIT_FAILURE);
-    }
-    if (close(sockfd) == -1) {
-        perror("close()");
+    case CC_SEND_FAILED:
+        fprintf(stderr, "Failed to send request to elevator system.\n");
+        exit(EXIT_FAILURE);
+    default:
+        fprintf(stderr, "Failed to receive response from elevator system.\n");
         exit(EXIT_FAILURE);
     }
+    print_reply(&reply);
+    free(floors);
 }
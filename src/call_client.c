@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "shared.h"
+#include "protocol.h"
+#include "call_client.h"
+
+int cc_connect( call_client_t *client, int binary ) {
+    client->binary = binary;
+    client->next_id = 1;
+
+    const char *endpoints = getenv(CONTROLLERS_ENV);
+    // Pipelined calls are small and latency bound, the connection does not wait to coalesce them
+    client->fd = connect_controller(endpoints != NULL ? endpoints : DEFAULT_CONTROLLERS);
+    return client->fd == -1 ? -1 : 0;
+}
+
+void cc_close( call_client_t *client ) {
+    if (shutdown(client->fd, SHUT_RDWR) == -1) {
+        perror("shutdown()");
+    }
+    if (close(client->fd) == -1) {
+        perror("close()");
+    }
+    client->fd = -1;
+}
+
+static int cc_send( call_client_t *client, floor_t source_floor, floor_t destination_floor, const uint32_t *request_id ) {
+    if (client->binary) {
+        uint8_t frame[sizeof(uint32_t) + PROTO_RECORD_SIZE + PROTO_REQUEST_ID_SIZE];
+        uint32_t len = PROTO_RECORD_SIZE;
+        proto_record rec = { .type = PROTO_CALL, .floor = source_floor, .other_floor = destination_floor };
+        proto_encode(&rec, frame + sizeof(len));
+        if (request_id != NULL) {
+            uint32_t id = htonl(*request_id);
+            memcpy(frame + sizeof(len) + PROTO_RECORD_SIZE, &id, sizeof(id));
+            len += PROTO_REQUEST_ID_SIZE;
+        }
+        uint32_t nlen = htonl(len);
+        memcpy(frame, &nlen, sizeof(nlen));
+        return send_looped(client->fd, frame, sizeof(nlen) + len);
+    }
+
+    char msg[32] = {0};
+    int n = snprintf(msg, sizeof(msg), "CALL %s %s", floor_name(source_floor), floor_name(destination_floor));
+    if (request_id != NULL) {
+        snprintf(msg + n, sizeof(msg) - n, " %u", *request_id);
+    }
+    return send_message(client->fd, msg);
+}
+
+/**
+ * Parses a (text or binary) reply to a call. Returns 0 on success, -1 if the reply is malformed.
+ */
+static int cc_parse_reply( char *msg, uint32_t len, int tagged, call_reply_t *reply ) {
+    memset(reply, 0, sizeof(*reply));
+
+    proto_record rec;
+    if (proto_decode(msg, len, &rec) == 0) {
+        uint32_t offset = PROTO_RECORD_SIZE;
+        if (tagged) {
+            if (proto_request_id(msg, len, &reply->request_id) == -1) {
+                return -1;
+            }
+            offset += PROTO_REQUEST_ID_SIZE;
+        }
+        if (rec.type == PROTO_CAR) {
+            uint32_t name_len = len - offset < MAX_CAR_NAME_LENGTH ? len - offset : MAX_CAR_NAME_LENGTH;
+            memcpy(reply->car_name, msg + offset, name_len);
+            reply->result = CALL_ASSIGNED;
+            return 0;
+        }
+        reply->result = rec.type == PROTO_UNAVAILABLE ? CALL_UNAVAILABLE : CALL_INVALID;
+        return 0;
+    }
+
+    char *tokens[3];
+    tokenize_message(msg, tokens, 3);
+    if (tokens[0] == NULL) {
+        return -1;
+    }
+    // CAR {name} [{id}], UNAVAILABLE [{id}] or INVALID [{id}]
+    int assigned = strcmp(tokens[0], "CAR") == 0;
+    const char *id = tokens[assigned ? 2 : 1];
+    if (assigned) {
+        if (tokens[1] == NULL) {
+            return -1;
+        }
+        strncpy(reply->car_name, tokens[1], MAX_CAR_NAME_LENGTH);
+        reply->result = CALL_ASSIGNED;
+    } else {
+        reply->result = strcmp(tokens[0], "UNAVAILABLE") == 0 ? CALL_UNAVAILABLE : CALL_INVALID;
+    }
+    if (tagged) {
+        if (id == NULL) {
+            return -1;
+        }
+        reply->request_id = strtoul(id, NULL, 10);
+    }
+    return 0;
+}
+
+int cc_call( int binary, floor_t source_floor, floor_t destination_floor, call_reply_t *reply ) {
+    call_client_t client;
+    if (cc_connect(&client, binary) == -1) {
+        return CC_CONNECT_FAILED;
+    }
+    if (cc_send(&client, source_floor, destination_floor, NULL) == -1) {
+        cc_close(&client);
+        return CC_SEND_FAILED;
+    }
+
+    uint32_t len;
+    char *msg = receive_frame(client.fd, &len);
+    int result = msg != NULL && cc_parse_reply(msg, len, 0, reply) == 0 ? 0 : CC_RECEIVE_FAILED;
+    free(msg);
+    cc_close(&client);
+    return result;
+}
+
+int cc_send_call( call_client_t *client, floor_t source_floor, floor_t destination_floor, uint32_t *request_id ) {
+    *request_id = client->next_id++;
+    return cc_send(client, source_floor, destination_floor, request_id);
+}
+
+int cc_receive_reply( call_client_t *client, call_reply_t *reply ) {
+    uint32_t len;
+    char *msg = receive_frame(client->fd, &len);
+    if (msg == NULL) {
+        return -1;
+    }
+    int result = cc_parse_reply(msg, len, 1, reply);
+    free(msg);
+    return result;
+}
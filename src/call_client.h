@@ -0,0 +1,78 @@
+#ifndef CALL_CLIENT_H
+#define CALL_CLIENT_H
+
+#include <stdint.h>
+#include "shared.h"
+
+typedef enum {
+    CALL_ASSIGNED,      // A car was assigned to the call
+    CALL_UNAVAILABLE,   // No car can take the call
+    CALL_INVALID        // The controller did not understand the call
+} call_result;
+
+/**
+ * The step a one-shot call failed at.
+ */
+typedef enum {
+    CC_CONNECT_FAILED = -1,     // No controller could be reached
+    CC_SEND_FAILED = -2,        // The call could not be sent
+    CC_RECEIVE_FAILED = -3      // The connection broke before the reply arrived
+} cc_error;
+
+/**
+ * The controller's reply to a call.
+ */
+typedef struct call_reply {
+    /// What happened to the call
+    call_result result;
+
+    /// The request id of the call, 0 for one-shot calls
+    uint32_t request_id;
+
+    /// The name of the assigned car, empty unless result is CALL_ASSIGNED
+    char car_name[MAX_CAR_NAME_LENGTH + 1];
+} call_reply_t;
+
+/**
+ * A call pad's connection to the controller.
+ * A one-shot call (cc_call) uses a connection of its own. A connection opened with cc_connect stays open
+ * and pipelines any number of tagged calls (cc_send_call), whose replies are collected with
+ * cc_receive_reply in the order the controller assigns them.
+ */
+typedef struct call_client {
+    /// The socket connected to the controller
+    int fd;
+
+    /// 1 if calls are sent in the binary protocol, else 0
+    int binary;
+
+    /// The request id of the next tagged call
+    uint32_t next_id;
+} call_client_t;
+
+/**
+ * Connects to the first reachable controller of $ELEVATOR_CONTROLLERS, or of DEFAULT_CONTROLLERS if it is not set.
+ * Returns 0 on success, -1 otherwise.
+ */
+int cc_connect( call_client_t *client, int binary );
+
+void cc_close( call_client_t *client );
+
+/**
+ * Makes a one-shot call on a fresh connection and waits for the reply. The connection is closed afterwards.
+ * Returns 0 on success, otherwise the cc_error of the step that failed.
+ */
+int cc_call( int binary, floor_t source_floor, floor_t destination_floor, call_reply_t *reply );
+
+/**
+ * Sends a tagged call without waiting for its reply and stores its request id.
+ * Returns 0 on success, -1 otherwise.
+ */
+int cc_send_call( call_client_t *client, floor_t source_floor, floor_t destination_floor, uint32_t *request_id );
+
+/**
+ * Waits for the next reply to a tagged call. Returns 0 on success, -1 if the connection broke.
+ */
+int cc_receive_reply( call_client_t *client, call_reply_t *reply );
+
+#endif
@@ -10,23 +10,41 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include "shared.h"
+#include "protocol.h"
+#include "histogram.h"
 
 #define MILLISECOND 1000 // 1ms
+#define MAX_RECONNECT_INTERVAL 50 // Retry connecting at least every 50ms, a standby controller takes over within that
+#define REPORTED_FIELDS (SHM_DIRTY_STATUS | SHM_DIRTY_CURRENT_FLOOR | SHM_DIRTY_DESTINATION_FLOOR) // The fields of a STATUS message
 
 static volatile int keep_running = 1;
+static histogram_t timer_lateness; // How late the door and movement steps ended, in nanoseconds
 
 typedef struct {
     char *name;
     char *lowest_floor;
     char *highest_floor;
+    floor_t lowest; // lowest_floor and highest_floor as numbers
+    floor_t highest;
     int delay;
+    const char *controllers; // Comma separated host:port endpoints of the controllers, tried in order
     int sockfd; // Controller socket
+    volatile int connection_lost; // 1 once the controller closed the connection, else 0
     int should_connect; // 1 if the car should connect to the controller, else 0
+    volatile int binary; // 1 once the controller accepted the binary protocol, else 0
+    unsigned long messages_received; // Messages received from the controllers
+    char share_name[MAX_CAR_NAME_LENGTH]; // Name of the shared memory object, /car{name}
     car_shared_mem *shm;
+    int connect_threads; // controller_connect threads still running, guarded by the shared memory's mutex
 } car_data;
 
 void handle_sigint(int dummy) {
@@ -58,30 +76,7 @@ car_shared_mem * create_shared_memory(const char *share_name, const char *init_f
 
     close(fd);
 
-    // Initialize mutex and condition variable
-    pthread_mutexattr_t mutex_attr;
-    pthread_mutexattr_init(&mutex_attr);
-    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shm->mutex, &mutex_attr);
-    pthread_mutexattr_destroy(&mutex_attr);
-
-    pthread_condattr_t cond_attr;
-    pthread_condattr_init(&cond_attr);
-    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
-    pthread_cond_init(&shm->cond, &cond_attr);
-    pthread_condattr_destroy(&cond_attr);
-
-    // Initialize other fields
-    strcpy(shm->current_floor, init_floor);
-    strcpy(shm->destination_floor, init_floor);
-    strcpy(shm->status, "Closed");
-    shm->open_button = 0;
-    shm->close_button = 0;
-    shm->door_obstruction = 0;
-    shm->overload = 0;
-    shm->emergency_stop = 0;
-    shm->individual_service_mode = 0;
-    shm->emergency_mode = 0;
+    shm_init(shm, floor_parse(init_floor));
 
     return shm;
 }
@@ -114,88 +109,221 @@ struct timespec get_timeout(int delay) {
     return timeout;
 }
 
+int is_within_bounds(car_data *car_info, floor_t floor) {
+    return car_info->lowest <= floor && floor <= car_info->highest && floor != NO_FLOOR;
+}
+
+/**
+ * Returns 1 if the state can be sent to the controller, 0 if a v1 writer left an invalid status or floor.
+ */
+int is_reportable(int status, floor_t current_floor, floor_t destination_floor) {
+    return status >= 0 && status < STATUS_COUNT && floor_is_valid(current_floor) && floor_is_valid(destination_floor);
+}
+
+/**
+ * Records how late a step due at the CLOCK_REALTIME deadline ended.
+ */
+void record_lateness(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t late = (int64_t) (now.tv_sec - deadline->tv_sec) * 1000000000 + (now.tv_nsec - deadline->tv_nsec);
+    hist_record(&timer_lateness, late > 0 ? late : 0);
+}
+
+/**
+ * Waits for a change of the shared memory until the timeout, the shared memory's mutex must be held.
+ * Returns 1 once the step timed out, 0 if the wait was woken up before.
+ */
+int wait_step(car_data *car_info, const struct timespec *timeout) {
+    if (shm_timedwait(car_info->shm, timeout) != ETIMEDOUT) {
+        return 0;
+    }
+    record_lateness(timeout);
+    return 1;
+}
+
+/**
+ * Sends a message without arguments to the controller in the negotiated protocol.
+ */
+void send_notice(car_data *car_info, proto_type type, const char *text) {
+    if (car_info->binary) {
+        proto_record rec = { .type = type };
+        send_record(car_info->sockfd, &rec);
+    } else {
+        send_message(car_info->sockfd, text);
+    }
+}
+
 void * controller_send(void *arg) {
     car_data *car_info = (car_data *) arg;
-    // Send: CAR {name} {lowest floor} {highest floor}
-    // CAR (3) + space (1) + CAR NAME (255) + space (1) + lowest floor (3) + space (1) + highest floor (3) + null terminator (1)
-    char initial_msg[268] = {0};
-    snprintf(initial_msg, 268, "CAR %s %s %s", car_info->name, car_info->lowest_floor, car_info->highest_floor);
+    // Send: CAR {name} {lowest floor} {highest floor} BINARY
+    // CAR (3) + space (1) + CAR NAME (255) + space (1) + lowest floor (3) + space (1) + highest floor (3) + space (1) + BINARY (6) + null terminator (1)
+    char initial_msg[275] = {0};
+    snprintf(initial_msg, sizeof(initial_msg), "CAR %s %s %s %s", car_info->name, car_info->lowest_floor, car_info->highest_floor, PROTO_OFFER);
 
-    if (send_message(car_info->sockfd, initial_msg)) {
-        perror("129: send_message()");
-        pthread_exit(NULL);
-    }
+    // The CAR message is corked with the first STATUS, the controller gets both in one segment
+    frame_batch_t batch;
+    frame_batch_init(&batch);
+    frame_batch_add(&batch, initial_msg, strlen(initial_msg));
 
-    char last_status[8] = {0};
-    char last_curr_floor[4] = {0};
-    char last_dest_floor[4] = {0};
+    // Nothing was sent yet, the first STATUS goes out right away
+    uint32_t seen_changes = 0;
+    unsigned dirty = SHM_DIRTY_ALL;
 
     // STATUS (6) + space (1) + status (7) + space (1) + current_floor (3) + space (1) + destination_floor (3) + null terminator (1)
     char status_msg[23] = {0};
+    uint8_t status_record[PROTO_RECORD_SIZE];
 
     while (car_info->should_connect && keep_running) {
         struct timespec timeout = get_timeout(car_info->delay);
 
-        pthread_mutex_lock(&car_info->shm->mutex);
-        // Wait for changes in the shared memory or timeout
-        while (strcmp(last_status, car_info->shm->status) == 0
-            && strcmp(last_curr_floor, car_info->shm->current_floor) == 0
-            && strcmp(last_dest_floor, car_info->shm->destination_floor) == 0) {
-            int ret = pthread_cond_timedwait(&car_info->shm->cond, &car_info->shm->mutex, &timeout);
+        shm_lock(car_info->shm);
+        // Wait for a change of the reported fields or timeout, changes of the buttons and modes are not reported
+        dirty |= shm_changed_since(car_info->shm, &seen_changes);
+        while (!car_info->connection_lost && (dirty & REPORTED_FIELDS) == 0) {
+            int ret = shm_timedwait(car_info->shm, &timeout);
+            dirty |= shm_changed_since(car_info->shm, &seen_changes);
 
             // Break if timed out
             if (ret == ETIMEDOUT) {
                 break;
             }
         }
+        // The controller is gone -> stop the thread so that the connection is re-established
+        if (car_info->connection_lost) {
+            shm_unlock(car_info->shm);
+            pthread_exit(NULL);
+        }
         // Check if the thread should stop
         if (!car_info->should_connect || !keep_running) {
-            pthread_mutex_unlock(&car_info->shm->mutex);
+            shm_unlock(car_info->shm);
             break;
         }
 
-        // Copy the current values to last values
-        strcpy(last_status, car_info->shm->status);
-        strcpy(last_curr_floor, car_info->shm->current_floor);
-        strcpy(last_dest_floor, car_info->shm->destination_floor);
-        pthread_mutex_unlock(&car_info->shm->mutex);
+        // Timed out without a change -> nothing to send, the controller knows the state already
+        if ((dirty & REPORTED_FIELDS) == 0) {
+            shm_unlock(car_info->shm);
+            continue;
+        }
+
+        // Copy the values to send
+        int last_status = car_info->shm->state.status;
+        floor_t last_curr_floor = car_info->shm->state.current_floor;
+        floor_t last_dest_floor = car_info->shm->state.destination_floor;
+        dirty = 0;
+        shm_unlock(car_info->shm);
+
+        // A state corrupted by a v1 writer is not reported, the safety system takes care of it
+        if (!is_reportable(last_status, last_curr_floor, last_dest_floor)) {
+            continue;
+        }
 
+        // The controller accepted the binary protocol -> send a STATUS record
+        if (car_info->binary) {
+            proto_record rec = {
+                .type = PROTO_STATUS,
+                .status = last_status,
+                .floor = last_curr_floor,
+                .other_floor = last_dest_floor
+            };
+            proto_encode(&rec, status_record);
+            frame_batch_add(&batch, status_record, sizeof(status_record));
+        }
         // Send: STATUS {status} {current floor} {destination floor}
-        sprintf(status_msg, "STATUS %s %s %s", car_info->shm->status, car_info->shm->current_floor, car_info->shm->destination_floor);
-        
+        else {
+            sprintf(status_msg, "STATUS %s %s %s", status_to_string(last_status), floor_name(last_curr_floor),
+                floor_name(last_dest_floor));
+            frame_batch_add(&batch, status_msg, strlen(status_msg));
+        }
+
         // Sending the status message failed -> stop the thread
-        if (send_message(car_info->sockfd, status_msg) == -1) {
+        if (frame_batch_send(&batch, car_info->sockfd) == -1) {
             perror("175: send_message()");
             pthread_exit(NULL);
         }
     }
 
-    pthread_mutex_lock(&car_info->shm->mutex);
+    // A CAR message still corked goes out ahead of the notice
+    if (batch.count > 0) {
+        frame_batch_send(&batch, car_info->sockfd);
+    }
+
+    // Read without the mutex, so that the car is not held up while the notice is sent
+    car_snapshot_t snapshot;
+    shm_snapshot(car_info->shm, &snapshot);
 
-    if (car_info->shm->individual_service_mode == 1) {
-        send_message(car_info->sockfd, "INDIVIDUAL SERVICE");
+    if (snapshot.individual_service_mode == 1) {
+        send_notice(car_info, PROTO_SERVICE, "INDIVIDUAL SERVICE");
     }
-    else if (car_info->shm->emergency_mode == 1) {
-        send_message(car_info->sockfd, "EMERGENCY");
+    else if (snapshot.emergency_mode == 1) {
+        send_notice(car_info, PROTO_EMERGENCY, "EMERGENCY");
     }
 
-    pthread_mutex_unlock(&car_info->shm->mutex);
-
     pthread_exit(NULL);
 }
 
-void cleanup_mutex_unlock(void *arg) {
-    pthread_mutex_unlock((pthread_mutex_t *) arg);
+void cleanup_shm_unlock(void *arg) {
+    shm_unlock((car_shared_mem *) arg);
+}
+
+/**
+ * Handles a FLOOR command from the controller.
+ */
+void go_to_floor(car_data *car_info, floor_t floor) {
+    // Not a floor at all -> ignore it, a floor outside the car's range is reset when the car starts moving
+    if (!floor_is_valid(floor)) {
+        return;
+    }
+    shm_lock(car_info->shm);
+    // Push the cleanup handler in case the thread gets canceled
+    pthread_cleanup_push(cleanup_shm_unlock, car_info->shm);
+
+    // The destination floor is the same as the current floor -> open the doors
+    if (car_info->shm->state.current_floor == floor) {
+        car_info->shm->open_button = 1;
+    }
+    // Set the destination floor to the desired floor
+    else {
+        shm_set_destination_floor(car_info->shm, floor);
+    }
+
+    shm_broadcast(car_info->shm);
+    // Pop the cleanup handler and execute it
+    pthread_cleanup_pop(1);
+}
+
+void cleanup_msg_buffer(void *arg) {
+    msg_buffer_destroy((msg_buffer_t *) arg);
 }
 
 void * controller_receive(void *arg) {
     car_data *car_info = (car_data *) arg;
+    // Reused for every message of the connection, freed when the thread ends or is canceled
+    msg_buffer_t buf;
+    msg_buffer_init(&buf);
+    pthread_cleanup_push(cleanup_msg_buffer, &buf);
 
     while (keep_running) {
-        char *msg = receive_msg(car_info->sockfd);
-        // Receiving the message failed -> try again
+        uint32_t len;
+        char *msg = receive_buffered(car_info->sockfd, &buf, &len);
+        // The connection broke -> wake up the sending thread, which reconnects
         if (msg == NULL) {
-            perror("receive_msg()");
+            shm_lock(car_info->shm);
+            car_info->connection_lost = 1;
+            pthread_cond_broadcast(&car_info->shm->cond);
+            shm_unlock(car_info->shm);
+            break;
+        }
+
+        proto_record rec;
+        if (proto_decode(msg, len, &rec) == 0) {
+            if (rec.type == PROTO_ACCEPT) {
+                car_info->binary = 1;
+            }
+            else if (rec.type == PROTO_FLOOR) {
+                go_to_floor(car_info, rec.floor);
+            }
+            car_info->messages_received++;
             continue;
         }
 
@@ -203,49 +331,24 @@ void * controller_receive(void *arg) {
         tokenize_message(msg, tokens, 4);
 
         // Check if the message is in valid format: FLOOR {floor}, else ignore it
-        if (strncmp(tokens[0], "FLOOR", 5) == 0) {
-            pthread_mutex_lock(&car_info->shm->mutex);
-            // Push the cleanup handler in case the thread gets canceled
-            pthread_cleanup_push(cleanup_mutex_unlock, &car_info->shm->mutex);
-
-            // The destination floor is the same as the current floor -> open the doors
-            if (strcmp(car_info->shm->current_floor, tokens[1]) == 0) {
-                car_info->shm->open_button = 1;
-            }
-            // Set the destination floor to the desired floor
-            else {
-                strcpy(car_info->shm->destination_floor, tokens[1]);
-            }
-
-            pthread_cond_broadcast(&car_info->shm->cond);
-            // Pop the cleanup handler and execute it
-            pthread_cleanup_pop(1);
+        if (tokens[0] != NULL && tokens[1] != NULL && strncmp(tokens[0], "FLOOR", 5) == 0) {
+            go_to_floor(car_info, floor_parse(tokens[1]));
         }
+        car_info->messages_received++;
     }
 
+    pthread_cleanup_pop(1);
     pthread_exit(NULL);
 }
 
 void * controller_connect(void *arg) {
     car_data *car_info = (car_data *) arg;
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(3000);
-    const char *ipaddress = "127.0.0.1";
-    if (inet_pton(AF_INET, ipaddress, &addr.sin_addr) != 1) {
-        fprintf(stderr, "inet_pton(%s)\n", ipaddress);
-        pthread_exit(NULL);
-    }
-
     while (car_info->should_connect && keep_running) {
-        car_info->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-        // Attempt to connect to the elevator system every car_info->delay milliseconds
-        if (connect(car_info->sockfd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
-            usleep(car_info->delay * MILLISECOND);
-            close(car_info->sockfd);
+        // Attempt to connect to one of the controllers every car_info->delay milliseconds (at most MAX_RECONNECT_INTERVAL)
+        car_info->sockfd = connect_controller(car_info->controllers);
+        if (car_info->sockfd == -1) {
+            usleep((car_info->delay < MAX_RECONNECT_INTERVAL ? car_info->delay : MAX_RECONNECT_INTERVAL) * MILLISECOND);
             continue;
         }
 
@@ -254,6 +357,9 @@ void * controller_connect(void *arg) {
             break;
         }
 
+        // Every connection starts with the text protocol until the controller accepts the binary one
+        car_info->binary = 0;
+        car_info->connection_lost = 0;
         // Create a new thread which will be responsible for sending messages to the controller
         pthread_t send_thread_id;
         pthread_create(&send_thread_id, NULL, controller_send, (void *) car_info);
@@ -273,9 +379,17 @@ void * controller_connect(void *arg) {
         }
     }
 
+    // manage_car waits for this before the car is freed
+    shm_lock(car_info->shm);
+    car_info->connect_threads--;
+    pthread_cond_broadcast(&car_info->shm->cond);
+    shm_unlock(car_info->shm);
     pthread_exit(NULL);
 }
 
+/**
+ * Starts a thread connecting to the controller. Must be called with the shared memory's mutex held.
+ */
 int controller_init(car_data *car_info) {
     pthread_t thread_id;
     int thread_create_result = pthread_create(&thread_id, NULL, controller_connect, (void *) car_info);
@@ -283,6 +397,7 @@ int controller_init(car_data *car_info) {
         fprintf(stderr, "pthread_create() failed: %s\n", strerror(thread_create_result));
         return -1;
     }
+    car_info->connect_threads++;
 
     // Detach the thread to allow it to clean up automatically when it's done
     pthread_detach(thread_id);
@@ -293,14 +408,14 @@ void close_doors(car_data *car_info);
 
 void open_doors(car_data *car_info) {
     // Keep trying opening the doors until they are open
-    while (strcmp(car_info->shm->status, "Open") != 0) {
+    while (car_info->shm->state.status != STATUS_OPEN) {
         // The doors are closed or closing -> open them
-        if (strcmp(car_info->shm->status, "Closed") == 0 || strcmp(car_info->shm->status, "Closing") == 0) {
-            strcpy(car_info->shm->status, "Opening");
+        if (car_info->shm->state.status == STATUS_CLOSED || car_info->shm->state.status == STATUS_CLOSING) {
+            shm_set_status(car_info->shm, STATUS_OPENING);
             pthread_cond_broadcast(&car_info->shm->cond);
             // Simulate the delay of opening the doors
             struct timespec timeout = get_timeout(car_info->delay);
-            while (pthread_cond_timedwait(&car_info->shm->cond, &car_info->shm->mutex, &timeout) != ETIMEDOUT) {
+            while (!wait_step(car_info, &timeout)) {
                 // The close button was pressed -> stop the opening action and close the doors
                 if (car_info->shm->close_button == 1) {
                     close_doors(car_info);
@@ -309,8 +424,8 @@ void open_doors(car_data *car_info) {
             }
         }
         // The doors are still opening -> open them
-        if (strcmp(car_info->shm->status, "Opening") == 0) {
-            strcpy(car_info->shm->status, "Open");
+        if (car_info->shm->state.status == STATUS_OPENING) {
+            shm_set_status(car_info->shm, STATUS_OPEN);
             pthread_cond_broadcast(&car_info->shm->cond);
         }
     }
@@ -318,7 +433,7 @@ void open_doors(car_data *car_info) {
     if (car_info->shm->individual_service_mode == 0 && car_info->shm->emergency_mode == 0) {
         // Simulate the delay of opening the doors
         struct timespec timeout = get_timeout(car_info->delay);
-        while (pthread_cond_timedwait(&car_info->shm->cond, &car_info->shm->mutex, &timeout) != ETIMEDOUT) {
+        while (!wait_step(car_info, &timeout)) {
             // The close button was pressed -> close the doors immediately
             if (car_info->shm->close_button == 1) {
                 close_doors(car_info);
@@ -327,21 +442,21 @@ void open_doors(car_data *car_info) {
         }
     }
     // No individual service or emergency mode and the doors are still open -> close them
-    if (car_info->shm->individual_service_mode == 0 && car_info->shm->emergency_mode == 0 && strcmp(car_info->shm->status, "Open") == 0) {
+    if (car_info->shm->individual_service_mode == 0 && car_info->shm->emergency_mode == 0 && car_info->shm->state.status == STATUS_OPEN) {
         close_doors(car_info);
     }
 }
 
 void close_doors(car_data *car_info) {
     // Keep trying closing the doors until they are closed
-    while (strcmp(car_info->shm->status, "Closed") != 0) {
+    while (car_info->shm->state.status != STATUS_CLOSED) {
         // The doors are open or opening -> close them
-        if (strcmp(car_info->shm->status, "Open") == 0 || strcmp(car_info->shm->status, "Opening") == 0) {
-            strcpy(car_info->shm->status, "Closing");
+        if (car_info->shm->state.status == STATUS_OPEN || car_info->shm->state.status == STATUS_OPENING) {
+            shm_set_status(car_info->shm, STATUS_CLOSING);
             pthread_cond_broadcast(&car_info->shm->cond);
             // Simulate the delay of closing the doors
             struct timespec timeout = get_timeout(car_info->delay);
-            while (pthread_cond_timedwait(&car_info->shm->cond, &car_info->shm->mutex, &timeout) != ETIMEDOUT) {
+            while (!wait_step(car_info, &timeout)) {
                 // The open button was pressed -> stop the opening action and open the doors
                 if (car_info->shm->open_button == 1) {
                     open_doors(car_info);
@@ -350,8 +465,8 @@ void close_doors(car_data *car_info) {
             }
         }
         // The doors are still closing -> close them
-        if (strcmp(car_info->shm->status, "Closing") == 0) {
-            strcpy(car_info->shm->status, "Closed");
+        if (car_info->shm->state.status == STATUS_CLOSING) {
+            shm_set_status(car_info->shm, STATUS_CLOSED);
             pthread_cond_broadcast(&car_info->shm->cond);
         }
     }
@@ -359,43 +474,48 @@ void close_doors(car_data *car_info) {
 
 void move_car(car_data *car_info) {
     // Destination floor is out of bounds -> set it to the current floor
-    if (!is_floor_within_bounds(car_info->shm->destination_floor, car_info->lowest_floor, car_info->highest_floor)) {
-        strcpy(car_info->shm->destination_floor, car_info->shm->current_floor);
+    if (!is_within_bounds(car_info, car_info->shm->state.destination_floor)
+        || !is_within_bounds(car_info, car_info->shm->state.current_floor)) {
+        shm_set_destination_floor(car_info->shm, car_info->shm->state.current_floor);
         return;
     }
 
-    char direction = are_consecutive_floors(car_info->shm->current_floor, car_info->shm->destination_floor) ? UP : DOWN;
+    char direction = car_info->shm->state.current_floor <= car_info->shm->state.destination_floor ? UP : DOWN;
 
     // Move the car floor-by-floor until the destination is reached
-    while (strcmp(car_info->shm->current_floor, car_info->shm->destination_floor) != 0) {
+    while (car_info->shm->state.current_floor != car_info->shm->state.destination_floor) {
         // Set status to "Between" while moving
-        strcpy(car_info->shm->status, "Between");
+        shm_set_status(car_info->shm, STATUS_BETWEEN);
         pthread_cond_broadcast(&car_info->shm->cond);
-        pthread_mutex_unlock(&car_info->shm->mutex);
+        shm_unlock(car_info->shm);
+        struct timespec deadline = get_timeout(car_info->delay);
         usleep(car_info->delay * MILLISECOND);
-        pthread_mutex_lock(&car_info->shm->mutex);
+        record_lateness(&deadline);
+        shm_lock(car_info->shm);
         // Adjust the floor (increment or decrement)
-        set_next_floor(car_info->shm->current_floor, direction);
+        shm_set_current_floor(car_info->shm, floor_next(car_info->shm->state.current_floor, direction));
     }
     // Reset button states
     car_info->shm->open_button = car_info->shm->close_button = 0;
 
-    strcpy(car_info->shm->status, "Closed");
+    shm_set_status(car_info->shm, STATUS_CLOSED);
     pthread_cond_broadcast(&car_info->shm->cond);
 }
 
 void manage_car(car_data *car_info) {
     // Initialize connection with the controller
+    shm_lock(car_info->shm);
     controller_init(car_info);
+    shm_unlock(car_info->shm);
 
     int last_individual_service_mode = 0;
     int last_emergency_mode = 0;
 
     while (keep_running) {
-        pthread_mutex_lock(&car_info->shm->mutex);
+        shm_lock(car_info->shm);
         // Wait until a change in the shared memory occurs
         struct timespec timeout = get_timeout(car_info->delay);
-        pthread_cond_timedwait(&car_info->shm->cond, &car_info->shm->mutex, &timeout);
+        shm_timedwait(car_info->shm, &timeout);
 
         if (car_info->shm->open_button == 1) {
             car_info->shm->open_button = 0;
@@ -424,14 +544,14 @@ void manage_car(car_data *car_info) {
             if (last_individual_service_mode == 0) {
                 car_info->should_connect = 0;
             }
-            if (strcmp(car_info->shm->current_floor, car_info->shm->destination_floor) != 0) {
+            if (car_info->shm->state.current_floor != car_info->shm->state.destination_floor) {
                 move_car(car_info);
             }
         }
 
         if (car_info->shm->individual_service_mode == 0 && car_info->shm->emergency_mode == 0) {
             // The destination floor is different from the current floor and the doors are closed
-            if (strcmp(car_info->shm->current_floor, car_info->shm->destination_floor) != 0 && strcmp(car_info->shm->status, "Closed") == 0) {
+            if (car_info->shm->state.current_floor != car_info->shm->state.destination_floor && car_info->shm->state.status == STATUS_CLOSED) {
                 move_car(car_info);
                 open_doors(car_info);
             }
@@ -439,34 +559,544 @@ void manage_car(car_data *car_info) {
 
         last_individual_service_mode = car_info->shm->individual_service_mode;
         last_emergency_mode = car_info->shm->emergency_mode;
-        pthread_mutex_unlock(&car_info->shm->mutex);
+        shm_unlock(car_info->shm);
     }
+
+    // The connection threads use the car until they notice keep_running is cleared
+    shm_lock(car_info->shm);
+    while (car_info->connect_threads > 0) {
+        struct timespec timeout = get_timeout(car_info->delay);
+        shm_timedwait(car_info->shm, &timeout);
+    }
+    shm_unlock(car_info->shm);
 }
 
-int main(int argc, char **argv) {
-    // Check if exactly 4 arguments are passed
-    if (argc != 5) {
-        printf("Usage: %s {name} {lowest floor} {highest floor} {delay}\n", argv[0]);
-        exit(1);
+/*
+ * The event loop runtime (-e): one thread waiting in epoll_wait for the controller's socket, a timerfd ending
+ * door and movement steps, a timerfd for reconnecting, a signalfd for SIGINT and an eventfd signalled by a bridge
+ * thread whenever another process (or the loop itself) broadcasts the shared memory's condition variable.
+ * STATUS messages are only sent when the status or the floors changed, so nothing wakes an idle car.
+ */
+
+#define LOOP_MAX_EVENTS 8
+#define HOST_DEFAULT_THREADS 4 // Threads the multi-car host runs its cars on without -t
+#define HOST_POLL_INTERVAL 10 // How often the multi-car host checks the shared memory of its cars for changes, in ms
+
+typedef enum {
+    SOURCE_STEP,                    // A car's step_timer
+    SOURCE_RECONNECT,               // A car's reconnect_timer
+    SOURCE_SOCKET,                  // A car's controller connection
+    SOURCE_SHM,                     // The shared memory of the loop's cars may have changed
+    SOURCE_SIGNAL                   // SIGINT
+} loop_source_kind;
+
+/**
+ * What an epoll event is about, referenced by its data.ptr.
+ */
+typedef struct loop_source {
+    loop_source_kind kind;
+    struct car_loop *loop;          // The car, NULL for SOURCE_SHM and SOURCE_SIGNAL
+} loop_source_t;
+
+/**
+ * A car run by an event loop.
+ */
+typedef struct car_loop {
+    car_data *car_info;
+    int epollfd;                    // The epoll instance of the thread running the car
+    int step_timer;                 // Ends the current door or movement step
+    int reconnect_timer;            // Retries connecting to the controllers
+    loop_source_t step_source;
+    loop_source_t reconnect_source;
+    loop_source_t socket_source;
+    int step_armed;                 // 1 while step_timer runs
+    int reconnect_armed;            // 1 while reconnect_timer runs
+    uint64_t step_deadline;         // When step_timer is due (now_ns())
+    msg_buffer_t buf;               // Receive buffer of the controller connection
+    frame_batch_t batch;            // The CAR message, corked with the first STATUS
+    int last_status;                // Last STATUS sent, -1 after connecting
+    floor_t last_curr_floor;
+    floor_t last_dest_floor;
+    int last_individual_service_mode;
+    int last_emergency_mode;
+    uint32_t seen_changes;          // The last change of the shared memory loop_update() reacted to
+} car_loop_t;
+
+void loop_update(car_loop_t *loop);
+
+void loop_arm(int timerfd, uint64_t ns) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    // A zero value would disarm the timer
+    spec.it_value.tv_sec = ns / 1000000000ULL;
+    spec.it_value.tv_nsec = ns == 0 ? 1 : ns % 1000000000ULL;
+    if (timerfd_settime(timerfd, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime()");
+    }
+}
+
+/**
+ * Starts the next door or movement step, replacing a running one.
+ */
+void loop_arm_step(car_loop_t *loop) {
+    uint64_t ns = (uint64_t) loop->car_info->delay * 1000000ULL;
+    loop->step_deadline = now_ns() + ns;
+    loop->step_armed = 1;
+    loop_arm(loop->step_timer, ns);
+}
+
+/**
+ * Reads a timerfd or eventfd, returns 0 if it had fired, -1 if not.
+ */
+int loop_consume(int fd) {
+    uint64_t count;
+    return read(fd, &count, sizeof(count)) == sizeof(count) ? 0 : -1;
+}
+
+/**
+ * Reacts to the state of the shared memory the way manage_car(), open_doors(), close_doors() and move_car()
+ * do between their waits: buttons, mode changes and starting a movement. Every transitional status gets a step.
+ * The shared memory's mutex must be held.
+ */
+void loop_evaluate(car_loop_t *loop) {
+    car_data *car_info = loop->car_info;
+    car_shared_mem *shm = car_info->shm;
+    int normal = shm->individual_service_mode == 0 && shm->emergency_mode == 0;
+    int changed = 0;
+
+    // The buttons are reset when a movement ends
+    if (shm->state.status != STATUS_BETWEEN) {
+        if (shm->open_button == 1) {
+            shm->open_button = 0;
+            if (shm->state.status == STATUS_CLOSED || shm->state.status == STATUS_CLOSING) {
+                shm_set_status(shm, STATUS_OPENING);
+                loop_arm_step(loop);
+                changed = 1;
+            } else if (shm->state.status == STATUS_OPEN && normal) {
+                // Keep the doors open for another delay
+                loop_arm_step(loop);
+            }
+        }
+        if (shm->close_button == 1) {
+            shm->close_button = 0;
+            if (shm->state.status == STATUS_OPEN || shm->state.status == STATUS_OPENING) {
+                shm_set_status(shm, STATUS_CLOSING);
+                loop_arm_step(loop);
+                changed = 1;
+            }
+        }
+    }
+
+    if ((shm->individual_service_mode == 0 && loop->last_individual_service_mode == 1)
+        || (shm->emergency_mode == 0 && loop->last_emergency_mode == 1)) {
+        car_info->should_connect = 1;
+    }
+    if (shm->emergency_mode == 1 || (shm->individual_service_mode == 1 && loop->last_individual_service_mode == 0)) {
+        car_info->should_connect = 0;
+    }
+    loop->last_individual_service_mode = shm->individual_service_mode;
+    loop->last_emergency_mode = shm->emergency_mode;
+
+    // The doors are closed and the car should be elsewhere -> start moving, in individual service mode even without
+    // the controller
+    if (!loop->step_armed && shm->state.status == STATUS_CLOSED
+        && shm->state.current_floor != shm->state.destination_floor
+        && (shm->individual_service_mode == 1 || shm->emergency_mode == 0)) {
+        if (!is_within_bounds(car_info, shm->state.destination_floor) || !is_within_bounds(car_info, shm->state.current_floor)) {
+            shm_set_destination_floor(shm, shm->state.current_floor);
+        } else {
+            shm_set_status(shm, STATUS_BETWEEN);
+            changed = 1;
+        }
+    }
+
+    // Another process may have changed the status (e.g. the safety system reopening obstructed doors)
+    if (!loop->step_armed && (shm->state.status == STATUS_BETWEEN || shm->state.status == STATUS_OPENING
+        || shm->state.status == STATUS_CLOSING)) {
+        loop_arm_step(loop);
+    }
+    if (changed) {
+        pthread_cond_broadcast(&shm->cond);
+    }
+}
+
+/**
+ * Ends the current door or movement step and starts the next one.
+ */
+void loop_step(car_loop_t *loop) {
+    if (loop_consume(loop->step_timer) == -1) {
+        return;
+    }
+    uint64_t now = now_ns();
+    hist_record(&timer_lateness, now > loop->step_deadline ? now - loop->step_deadline : 0);
+    loop->step_armed = 0;
+
+    car_data *car_info = loop->car_info;
+    car_shared_mem *shm = car_info->shm;
+    shm_lock(shm);
+    int normal = shm->individual_service_mode == 0 && shm->emergency_mode == 0;
+    if (shm->state.status == STATUS_BETWEEN) {
+        if (!is_within_bounds(car_info, shm->state.destination_floor)) {
+            shm_set_destination_floor(shm, shm->state.current_floor);
+        }
+        if (shm->state.current_floor != shm->state.destination_floor) {
+            char direction = shm->state.current_floor <= shm->state.destination_floor ? UP : DOWN;
+            shm_set_current_floor(shm, floor_next(shm->state.current_floor, direction));
+        }
+        if (shm->state.current_floor == shm->state.destination_floor) {
+            // Arrived -> the doors open, except in individual service mode
+            shm->open_button = shm->close_button = 0;
+            shm_set_status(shm, normal ? STATUS_OPENING : STATUS_CLOSED);
+            if (normal) {
+                loop_arm_step(loop);
+            }
+        } else {
+            loop_arm_step(loop);
+        }
+    } else if (shm->state.status == STATUS_OPENING) {
+        shm_set_status(shm, STATUS_OPEN);
+        // The doors stay open for a delay, in individual service and emergency mode until the close button
+        if (normal) {
+            loop_arm_step(loop);
+        }
+    } else if (shm->state.status == STATUS_OPEN) {
+        if (normal) {
+            shm_set_status(shm, STATUS_CLOSING);
+            loop_arm_step(loop);
+        }
+    } else if (shm->state.status == STATUS_CLOSING) {
+        shm_set_status(shm, STATUS_CLOSED);
+    }
+    shm_broadcast(shm);
+    loop_evaluate(loop);
+    shm_unlock(shm);
+}
+
+void loop_close_connection(car_loop_t *loop) {
+    car_data *car_info = loop->car_info;
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, car_info->sockfd, NULL);
+    close(car_info->sockfd);
+    car_info->sockfd = -1;
+    msg_buffer_destroy(&loop->buf);
+}
+
+/**
+ * Sends the status if it changed since the last STATUS message, together with a corked CAR message.
+ */
+void loop_send_status(car_loop_t *loop) {
+    car_data *car_info = loop->car_info;
+    if (car_info->sockfd == -1) {
+        return;
+    }
+    car_snapshot_t snapshot;
+    shm_snapshot(car_info->shm, &snapshot);
+    int unchanged = loop->last_status == snapshot.status
+        && loop->last_curr_floor == snapshot.current_floor
+        && loop->last_dest_floor == snapshot.destination_floor;
+    loop->last_status = snapshot.status;
+    loop->last_curr_floor = snapshot.current_floor;
+    loop->last_dest_floor = snapshot.destination_floor;
+    // A state corrupted by a v1 writer is not reported, the safety system takes care of it
+    if (unchanged || !is_reportable(snapshot.status, snapshot.current_floor, snapshot.destination_floor)) {
+        return;
+    }
+
+    // STATUS (6) + space (1) + status (7) + space (1) + current_floor (3) + space (1) + destination_floor (3) + null terminator (1)
+    char status_msg[23];
+    uint8_t status_record[PROTO_RECORD_SIZE];
+    if (car_info->binary) {
+        proto_record rec = {
+            .type = PROTO_STATUS,
+            .status = snapshot.status,
+            .floor = snapshot.current_floor,
+            .other_floor = snapshot.destination_floor
+        };
+        proto_encode(&rec, status_record);
+        frame_batch_add(&loop->batch, status_record, sizeof(status_record));
+    } else {
+        snprintf(status_msg, sizeof(status_msg), "STATUS %s %s %s", status_to_string(snapshot.status),
+            floor_name(snapshot.current_floor), floor_name(snapshot.destination_floor));
+        frame_batch_add(&loop->batch, status_msg, strlen(status_msg));
+    }
+    if (frame_batch_send(&loop->batch, car_info->sockfd) == -1) {
+        perror("frame_batch_send()");
+        loop_close_connection(loop);
+    }
+}
+
+/**
+ * Connects to a controller if the car should be connected, or says goodbye if it should not.
+ */
+void loop_sync_connection(car_loop_t *loop) {
+    car_data *car_info = loop->car_info;
+    if (car_info->should_connect && car_info->sockfd == -1 && !loop->reconnect_armed && keep_running) {
+        car_info->sockfd = connect_controller(car_info->controllers);
+        if (car_info->sockfd == -1) {
+            loop_arm(loop->reconnect_timer,
+                (uint64_t) (car_info->delay < MAX_RECONNECT_INTERVAL ? car_info->delay : MAX_RECONNECT_INTERVAL) * 1000000ULL);
+            loop->reconnect_armed = 1;
+            return;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &loop->socket_source };
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, car_info->sockfd, &ev) == -1) {
+            perror("epoll_ctl()");
+            loop_close_connection(loop);
+            return;
+        }
+        // Every connection starts with the text protocol until the controller accepts the binary one
+        car_info->binary = 0;
+        // CAR {name} {lowest floor} {highest floor} BINARY, corked with the first STATUS
+        char initial_msg[275];
+        snprintf(initial_msg, sizeof(initial_msg), "CAR %s %s %s %s", car_info->name, car_info->lowest_floor,
+            car_info->highest_floor, PROTO_OFFER);
+        frame_batch_init(&loop->batch);
+        frame_batch_add(&loop->batch, initial_msg, strlen(initial_msg));
+        loop->last_status = -1;
+        loop_send_status(loop);
+    } else if (!car_info->should_connect && car_info->sockfd != -1) {
+        if (loop->batch.count > 0) {
+            frame_batch_send(&loop->batch, car_info->sockfd);
+        }
+        car_snapshot_t snapshot;
+        shm_snapshot(car_info->shm, &snapshot);
+        if (snapshot.individual_service_mode == 1) {
+            send_notice(car_info, PROTO_SERVICE, "INDIVIDUAL SERVICE");
+        } else if (snapshot.emergency_mode == 1) {
+            send_notice(car_info, PROTO_EMERGENCY, "EMERGENCY");
+        }
+        loop_close_connection(loop);
+    }
+}
+
+/**
+ * Handles the messages from the controller which arrived with one read.
+ */
+void loop_receive(car_loop_t *loop) {
+    car_data *car_info = loop->car_info;
+    do {
+        // The controller writes each frame at once, so a partial one completes right away
+        uint32_t len;
+        char *msg = receive_buffered(car_info->sockfd, &loop->buf, &len);
+        if (msg == NULL) {
+            loop_close_connection(loop);
+            return;
+        }
+        car_info->messages_received++;
+
+        proto_record rec;
+        if (proto_decode(msg, len, &rec) == 0) {
+            if (rec.type == PROTO_ACCEPT) {
+                car_info->binary = 1;
+            } else if (rec.type == PROTO_FLOOR) {
+                go_to_floor(car_info, rec.floor);
+            }
+            continue;
+        }
+        char *tokens[4];
+        tokenize_message(msg, tokens, 4);
+        if (tokens[0] != NULL && tokens[1] != NULL && strncmp(tokens[0], "FLOOR", 5) == 0) {
+            go_to_floor(car_info, floor_parse(tokens[1]));
+        }
+    } while (msg_buffer_has_message(&loop->buf));
+
+    shm_lock(car_info->shm);
+    loop_evaluate(loop);
+    shm_unlock(car_info->shm);
+}
+
+/**
+ * Watches fd for input, events on it carry source.
+ */
+void loop_watch(int epollfd, int fd, loop_source_t *source) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = source };
+    if (fd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("timerfd_create()/eventfd()/signalfd()/epoll_ctl()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sets up the timers of a car on the epoll instance of the thread running it and connects it.
+ */
+void loop_init(car_loop_t *loop, car_data *car_info, int epollfd) {
+    memset(loop, 0, sizeof(*loop));
+    loop->car_info = car_info;
+    loop->epollfd = epollfd;
+    car_info->sockfd = -1;
+    msg_buffer_init(&loop->buf);
+    loop->step_source = (loop_source_t) { SOURCE_STEP, loop };
+    loop->reconnect_source = (loop_source_t) { SOURCE_RECONNECT, loop };
+    loop->socket_source = (loop_source_t) { SOURCE_SOCKET, loop };
+
+    loop->step_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop_watch(epollfd, loop->step_timer, &loop->step_source);
+    loop->reconnect_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop_watch(epollfd, loop->reconnect_timer, &loop->reconnect_source);
+
+    loop_update(loop);
+}
+
+void loop_destroy(car_loop_t *loop) {
+    if (loop->car_info->sockfd != -1) {
+        loop_close_connection(loop);
+    }
+    msg_buffer_destroy(&loop->buf);
+    close(loop->step_timer);
+    close(loop->reconnect_timer);
+}
+
+/**
+ * Reacts to changes of the shared memory made by other processes, then brings the connection up to date.
+ */
+void loop_update(car_loop_t *loop) {
+    shm_lock(loop->car_info->shm);
+    shm_changed_since(loop->car_info->shm, &loop->seen_changes);
+    loop_evaluate(loop);
+    shm_unlock(loop->car_info->shm);
+    loop_sync_connection(loop);
+    loop_send_status(loop);
+}
+
+/**
+ * Like loop_update(), but without taking the mutex if nothing changed since the last update.
+ */
+void loop_poll(car_loop_t *loop) {
+    if (shm_may_have_changed(loop->car_info->shm, loop->seen_changes)) {
+        loop_update(loop);
+    }
+}
+
+/**
+ * Handles an event of a car's timers or connection.
+ */
+void loop_dispatch(loop_source_t *source) {
+    car_loop_t *loop = source->loop;
+    if (source->kind == SOURCE_STEP) {
+        loop_step(loop);
+    } else if (source->kind == SOURCE_RECONNECT) {
+        loop_consume(loop->reconnect_timer);
+        loop->reconnect_armed = 0;
+    } else if (source->kind == SOURCE_SOCKET && loop->car_info->sockfd != -1) {
+        loop_receive(loop);
+    }
+    loop_sync_connection(loop);
+    loop_send_status(loop);
+}
+
+/**
+ * Wakes up the event loop of a single car whenever the shared memory's condition variable is broadcast.
+ */
+typedef struct shm_bridge {
+    car_shared_mem *shm;
+    int eventfd;
+    int running;                    // Guarded by the shared memory's mutex
+} shm_bridge_t;
+
+/**
+ * Turns every broadcast of the shared memory's condition variable into an event of the loop.
+ */
+void * shm_bridge(void *arg) {
+    shm_bridge_t *bridge = (shm_bridge_t *) arg;
+    uint64_t one = 1;
+    shm_lock(bridge->shm);
+    while (bridge->running) {
+        shm_wait(bridge->shm);
+        // Signalled with the mutex held, so that no broadcast between two waits goes unnoticed
+        if (write(bridge->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("write() to eventfd");
+        }
+    }
+    shm_unlock(bridge->shm);
+    return NULL;
+}
+
+/**
+ * Blocks SIGINT in the calling thread and the threads it creates from now on.
+ */
+void block_sigint(sigset_t *signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, signals, NULL);
+}
+
+void run_event_loop(car_data *car_info) {
+    // SIGINT is read from a signalfd, blocked before the bridge thread starts so that it never gets it
+    sigset_t signals;
+    block_sigint(&signals);
+
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        perror("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+    loop_source_t shm_source = { SOURCE_SHM, NULL };
+    loop_source_t signal_source = { SOURCE_SIGNAL, NULL };
+    shm_bridge_t bridge = { .shm = car_info->shm, .eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), .running = 1 };
+    loop_watch(epollfd, bridge.eventfd, &shm_source);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    loop_watch(epollfd, signal_fd, &signal_source);
+
+    pthread_t bridge_id;
+    if (pthread_create(&bridge_id, NULL, shm_bridge, &bridge) != 0) {
+        perror("pthread_create()");
+        exit(EXIT_FAILURE);
+    }
+
+    car_loop_t loop;
+    loop_init(&loop, car_info, epollfd);
+    while (keep_running) {
+        struct epoll_event events[LOOP_MAX_EVENTS];
+        int n = epoll_wait(epollfd, events, LOOP_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait()");
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            loop_source_t *source = events[i].data.ptr;
+            if (source->kind == SOURCE_SHM) {
+                loop_consume(bridge.eventfd);
+                loop_poll(&loop);
+            } else if (source->kind == SOURCE_SIGNAL) {
+                keep_running = 0;
+            } else {
+                loop_dispatch(source);
+            }
+        }
     }
-    char * car_name = argv[1];
-    char * lowest_floor = argv[2];
-    char * highest_floor = argv[3];
 
+    shm_lock(car_info->shm);
+    bridge.running = 0;
+    pthread_cond_broadcast(&car_info->shm->cond);
+    shm_unlock(car_info->shm);
+    pthread_join(bridge_id, NULL);
+
+    loop_destroy(&loop);
+    close(bridge.eventfd);
+    close(signal_fd);
+    close(epollfd);
+}
+
+/**
+ * Validates the arguments of a car and creates its shared memory. Returns the car, NULL if an argument is invalid.
+ */
+car_data * car_setup(char *car_name, char *lowest_floor, char *highest_floor, const char *delay_arg, const char *controllers) {
     // Check if the floor numbers are valid
     if (!is_valid_floor(lowest_floor) || !is_valid_floor(highest_floor) || !are_consecutive_floors(lowest_floor, highest_floor)) {
         printf("Invalid floor(s) specified.\n");
-        exit(1);
+        return NULL;
     }
 
     // Check if the delay is valid
     char *p = NULL;
     errno = 0;
-    long conv = strtol(argv[4], &p, 10);
+    long conv = strtol(delay_arg, &p, 10);
 
     if (errno != 0 || *p != '\0' || conv > INT_MAX || conv < INT_MIN) {
         printf("Invalid delay specified.\n");
-        exit(1);
+        return NULL;
     }
     int delay = conv;
 
@@ -476,34 +1106,302 @@ int main(int argc, char **argv) {
 
     if (car_name_len + prefix_len >= MAX_CAR_NAME_LENGTH) {
         printf("Car name too long.\n");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
-    char share_name[MAX_CAR_NAME_LENGTH];
-    (void) strncpy(share_name, SHM_NAME_PREFIX, prefix_len + 1);                // Copy "/car" (including null terminator)
-    (void) strncat(share_name, car_name, MAX_CAR_NAME_LENGTH - prefix_len - 1);  // Concatenate car name
-
-    car_shared_mem *shm = create_shared_memory(share_name, lowest_floor);
+    car_data *car_info = malloc(sizeof(car_data));
+    if (car_info == NULL) {
+        perror("malloc()");
+        return NULL;
+    }
+    (void) strncpy(car_info->share_name, SHM_NAME_PREFIX, prefix_len + 1);                // Copy "/car" (including null terminator)
+    (void) strncat(car_info->share_name, car_name, MAX_CAR_NAME_LENGTH - prefix_len - 1);  // Concatenate car name
 
-    if (shm == NULL) {
-        exit(1);
+    car_info->shm = create_shared_memory(car_info->share_name, lowest_floor);
+    if (car_info->shm == NULL) {
+        free(car_info);
+        return NULL;
     }
 
-    car_data *car_info = malloc(sizeof(car_data));
     car_info->name = car_name;
     car_info->lowest_floor = lowest_floor;
     car_info->highest_floor = highest_floor;
+    car_info->lowest = floor_parse(lowest_floor);
+    car_info->highest = floor_parse(highest_floor);
     car_info->delay = delay;
+    car_info->controllers = controllers;
     car_info->should_connect = 1;
-    car_info->shm = shm;
+    car_info->messages_received = 0;
+    car_info->connect_threads = 0;
+    return car_info;
+}
+
+/*
+ * The multi-car host (-f): the cars of a config file run on a small pool of threads, each an event loop with
+ * one epoll instance for the timers and controller connections of its share of the cars. A bridge thread per car
+ * would defeat the pool, so the shared memory is polled for changes by the internal controls and the safety system
+ * every HOST_POLL_INTERVAL milliseconds instead.
+ */
+
+/**
+ * A thread of the host and the cars it runs.
+ */
+typedef struct host_worker {
+    pthread_t thread_id;
+    car_loop_t *loops;
+    size_t count;
+} host_worker_t;
+
+void * host_worker(void *arg) {
+    host_worker_t *worker = (host_worker_t *) arg;
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        perror("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+    loop_source_t poll_source = { SOURCE_SHM, NULL };
+    int poll_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop_watch(epollfd, poll_timer, &poll_source);
+    struct itimerspec interval = {
+        .it_interval = { .tv_nsec = HOST_POLL_INTERVAL * 1000000L },
+        .it_value = { .tv_nsec = HOST_POLL_INTERVAL * 1000000L }
+    };
+    timerfd_settime(poll_timer, 0, &interval, NULL);
+
+    for (size_t i = 0; i < worker->count; i++) {
+        loop_init(&worker->loops[i], worker->loops[i].car_info, epollfd);
+    }
+
+    // Stopping is noticed at the next poll
+    while (keep_running) {
+        struct epoll_event events[LOOP_MAX_EVENTS];
+        int n = epoll_wait(epollfd, events, LOOP_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait()");
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            loop_source_t *source = events[i].data.ptr;
+            if (source->kind != SOURCE_SHM) {
+                loop_dispatch(source);
+            } else if (loop_consume(poll_timer) == 0) {
+                for (size_t j = 0; j < worker->count; j++) {
+                    loop_poll(&worker->loops[j]);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < worker->count; i++) {
+        loop_destroy(&worker->loops[i]);
+    }
+    close(poll_timer);
+    close(epollfd);
+    return NULL;
+}
+
+/**
+ * Reads the cars of a config file, one per line: {name} {lowest floor} {highest floor} {delay} [{host:port,...}].
+ * Empty lines and lines starting with # are skipped. Returns the number of cars, -1 if the file is invalid.
+ */
+int host_read_config(const char *path, car_data ***cars) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen()");
+        return -1;
+    }
+    int count = 0;
+    int capacity = 0;
+    *cars = NULL;
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char *tokens[6];
+        line[strcspn(line, "\r\n")] = '\0';
+        tokenize_message(line, tokens, 6);
+        if (tokens[0] == NULL || tokens[0][0] == '#') {
+            continue;
+        }
+        if (tokens[3] == NULL || tokens[5] != NULL) {
+            printf("%s:%d: Expected {name} {lowest floor} {highest floor} {delay} [{host:port,...}]\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        car_data *car_info = car_setup(strdup(tokens[0]), strdup(tokens[1]), strdup(tokens[2]), tokens[3],
+            strdup(tokens[4] != NULL ? tokens[4] : DEFAULT_CONTROLLERS));
+        if (car_info == NULL) {
+            printf("%s:%d: Invalid car\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            car_data **grown = realloc(*cars, capacity * sizeof(car_data *));
+            if (grown == NULL) {
+                perror("realloc()");
+                exit(EXIT_FAILURE);
+            }
+            *cars = grown;
+        }
+        (*cars)[count++] = car_info;
+    }
+    fclose(file);
+    return count;
+}
+
+/**
+ * Runs the cars of the config file on threads threads until SIGINT. Returns the number of cars, -1 on error.
+ */
+int run_host(const char *path, int threads, car_data ***cars) {
+    int count = host_read_config(path, cars);
+    if (count <= 0) {
+        if (count == 0) {
+            printf("No cars in %s\n", path);
+        }
+        return -1;
+    }
+    if (threads > count) {
+        threads = count;
+    }
+
+    // SIGINT is waited for by this thread only
+    sigset_t signals;
+    block_sigint(&signals);
+
+    car_loop_t *loops = calloc(count, sizeof(car_loop_t));
+    host_worker_t *workers = calloc(threads, sizeof(host_worker_t));
+    if (loops == NULL || workers == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    // Each thread runs a contiguous share of the cars
+    for (int i = 0; i < count; i++) {
+        loops[i].car_info = (*cars)[i];
+    }
+    for (int i = 0, first = 0; i < threads; i++) {
+        int share = count / threads + (i < count % threads);
+        workers[i].loops = loops + first;
+        workers[i].count = share;
+        first += share;
+        if (pthread_create(&workers[i].thread_id, NULL, host_worker, &workers[i]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Hosting %d cars on %d threads\n", count, threads);
+    fflush(stdout);
+
+    int signal;
+    sigwait(&signals, &signal);
+    keep_running = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+    }
+    free(workers);
+    free(loops);
+    return count;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [-e] {name} {lowest floor} {highest floor} {delay} [{host:port,host:port...}]\n", program);
+    printf("       %s -f {config file} [-t {threads}]\n", program);
+}
+
+int main(int argc, char **argv) {
+    // -e runs the car in a single-threaded event loop instead of a thread per task,
+    // -f hosts all cars of a config file on a pool of -t event loop threads
+    int event_loop = 0;
+    const char *config = NULL;
+    int threads = HOST_DEFAULT_THREADS;
+    int opt;
+    while ((opt = getopt(argc, argv, "+ef:t:")) != -1) {
+        if (opt == 'e') {
+            event_loop = 1;
+        } else if (opt == 'f') {
+            config = optarg;
+        } else if (opt == 't' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    char *program = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // Check if 4 arguments (and optionally the controllers) are passed, or none with a config file
+    if (config != NULL ? argc != 1 : argc != 5 && argc != 6) {
+        print_usage(program);
+        exit(1);
+    }
 
     // Don't terminate the program when writing to a closed socket
     signal(SIGPIPE, SIG_IGN);
-    // Register signal handler for SIGINT (Ctrl + C)
-    signal(SIGINT, handle_sigint);
+    hist_init(&timer_lateness);
+
+    car_data **cars;
+    car_data *single[1];    // cars of a single car process
+    int count;
+    if (config != NULL) {
+        count = run_host(config, threads, &cars);
+        if (count == -1) {
+            exit(1);
+        }
+    } else {
+        car_data *car_info = car_setup(argv[1], argv[2], argv[3], argv[4], argc == 6 ? argv[5] : DEFAULT_CONTROLLERS);
+        if (car_info == NULL) {
+            exit(1);
+        }
+        single[0] = car_info;
+        cars = single;
+        count = 1;
+
+        // Register signal handler for SIGINT (Ctrl + C)
+        signal(SIGINT, handle_sigint);
+        if (event_loop) {
+            run_event_loop(car_info);
+        } else {
+            manage_car(car_info);
+        }
+    }
 
-    manage_car(car_info);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long user_ms = usage.ru_utime.tv_sec * 1000L + usage.ru_utime.tv_usec / 1000L;
+    long system_ms = usage.ru_stime.tv_sec * 1000L + usage.ru_stime.tv_usec / 1000L;
+    printf("Timer lateness over %lu steps (us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+        (unsigned long) hist_count(&timer_lateness), hist_mean(&timer_lateness) / 1000.0,
+        hist_percentile(&timer_lateness, 50.0) / 1000.0, hist_percentile(&timer_lateness, 99.0) / 1000.0,
+        hist_max(&timer_lateness) / 1000.0);
+    printf("CPU time (ms): user %ld, system %ld\n", user_ms, system_ms);
+
+    unsigned long messages_received = 0;
+    for (int i = 0; i < count; i++) {
+        messages_received += cars[i]->messages_received;
+    }
+    printf("Received %lu messages from the controller, allocated %lu receive buffers\n", messages_received,
+        (unsigned long) receive_allocation_count());
+    if (config != NULL) {
+        printf("Per car: CPU time %.2f ms, max RSS %.1f KiB\n", (double) (user_ms + system_ms) / count,
+            (double) usage.ru_maxrss / count);
+    }
 
-    destroy_shared_memory(shm, share_name);
-    free(car_info);
+    for (int i = 0; i < count; i++) {
+        destroy_shared_memory(cars[i]->shm, cars[i]->share_name);
+        if (config != NULL) {
+            free(cars[i]->name);
+            free(cars[i]->lowest_floor);
+            free(cars[i]->highest_floor);
+            free((char *) cars[i]->controllers);
+        }
+        free(cars[i]);
+    }
+    if (config != NULL) {
+        free(cars);
+    }
 }
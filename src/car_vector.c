@@ -1,91 +1,286 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
 #include <pthread.h>
 #include "car_vector.h"
+#include "histogram.h"
+
+/**
+ * Releases the epoch record of a finished thread for reuse.
+ */
+static void cv_release_reader( void *arg ) {
+    cv_reader_t *reader = arg;
+    reader->depth = 0;
+    atomic_store(&reader->epoch, 0);
+    atomic_store(&reader->in_use, 0);
+}
+
+/**
+ * Allocates a snapshot of size cars, the floor indexes live in the same block right after the cars.
+ */
+static cv_snapshot_t * cv_snapshot_alloc( size_t size ) {
+    size_t words = (size + 63) / 64;
+    cv_snapshot_t *snapshot = malloc(sizeof(cv_snapshot_t) + size * sizeof(Car *)
+        + FLOOR_COUNT * words * sizeof(uint64_t) + FLOOR_COUNT * sizeof(uint16_t));
+    if (snapshot == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->size = size;
+    snapshot->words = words;
+    snapshot->floor_cars = (uint64_t *) (snapshot->data + size);
+    snapshot->banks = 0;
+    snapshot->floor_bank = (uint16_t *) (snapshot->floor_cars + FLOOR_COUNT * words);
+    memset(snapshot->floor_bank, 0, FLOOR_COUNT * sizeof(uint16_t));
+    return snapshot;
+}
+
+/**
+ * Fills in the floor indexes from the cars of the snapshot.
+ */
+static void cv_snapshot_index( cv_snapshot_t *snapshot ) {
+    memset(snapshot->floor_cars, 0, FLOOR_COUNT * snapshot->words * sizeof(uint64_t));
+    for (size_t i = 0; i < snapshot->size; i++) {
+        Car *car = snapshot->data[i];
+        for (floor_t floor = car->lowest_floor; floor <= car->highest_floor; floor++) {
+            snapshot->floor_cars[(size_t) (floor - MIN_FLOOR) * snapshot->words + i / 64] |= 1ULL << (i % 64);
+        }
+    }
+
+    // A floor continues the bank of the floor below if a car serves both
+    snapshot->banks = 0;
+    const uint64_t *below = NULL;
+    for (floor_t floor = MIN_FLOOR; floor <= MAX_FLOOR; floor++) {
+        if (floor == NO_FLOOR) {
+            continue;
+        }
+        const uint64_t *cars = cv_floor_cars(snapshot, floor);
+        int served = 0;
+        int continues = 0;
+        for (size_t word = 0; word < snapshot->words; word++) {
+            served |= cars[word] != 0;
+            continues |= below != NULL && (cars[word] & below[word]) != 0;
+        }
+        if (served && !continues) {
+            snapshot->banks++;
+        }
+        snapshot->floor_bank[floor - MIN_FLOOR] = served ? snapshot->banks : 0;
+        below = cars;
+    }
+}
 
 void cv_init( car_vector_t *vec ) {
-    vec->capacity = CV_INITIAL_CAPACITY;
-    vec->size = 0;
-    vec->data = malloc(vec->capacity * sizeof(Car *));
+    atomic_init(&vec->current, cv_snapshot_alloc(0));
+    // Epoch 0 marks readers outside of read sections
+    atomic_init(&vec->epoch, 1);
+    atomic_init(&vec->readers, NULL);
+    pthread_key_create(&vec->reader_key, cv_release_reader);
+    vec->retired = NULL;
+    pool_init(&vec->car_pool, sizeof(Car), CAR_POOL_SLAB_SIZE);
     pthread_mutex_init(&vec->mutex, NULL);
+    vec->lock_wait = NULL;
 }
 
-static void cv_ensure_capacity( car_vector_t *vec, size_t new_size ) {
-    if (new_size <= vec->capacity) {
+/**
+ * Locks the mutex, reporting the time spent waiting if it was contended.
+ */
+static void cv_lock( car_vector_t *vec ) {
+    if (pthread_mutex_trylock(&vec->mutex) == 0) {
         return;
     }
-    int new_capacity = fmax(vec->capacity * CV_GROWTH_FACTOR, new_size);
-    vec->capacity = new_capacity;
-    vec->data = realloc(vec->data, new_capacity * sizeof(Car *));
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&vec->mutex);
+    if (vec->lock_wait != NULL) {
+        vec->lock_wait(now_ns() - start);
+    }
+}
+
+static void cv_free_retired( car_vector_t *vec, cv_retired_t *retired ) {
+    if (retired->is_car) {
+        Car *car = retired->item;
+        pool_destroy(&car->node_pool);
+        free(car->floor_nodes);
+        pthread_mutex_destroy(&car->mutex);
+        pool_free(&vec->car_pool, car);
+    } else {
+        free(retired->item);
+    }
+    free(retired);
 }
 
 void cv_destroy( car_vector_t *vec ) {
-    pthread_mutex_lock(&vec->mutex);
+    cv_lock(vec);
 
-    vec->capacity = 0;
-    vec->size = 0;
-    
-    for (size_t i = 0; i < vec->size; i++) {
-        free(vec->data[i]);
+    while (vec->retired != NULL) {
+        cv_retired_t *next = vec->retired->next;
+        cv_free_retired(vec, vec->retired);
+        vec->retired = next;
+    }
+    cv_snapshot_t *snapshot = atomic_load(&vec->current);
+    for (size_t i = 0; i < snapshot->size; i++) {
+        pool_destroy(&snapshot->data[i]->node_pool);
+        free(snapshot->data[i]->floor_nodes);
     }
+    free(snapshot);
+    atomic_store(&vec->current, NULL);
+    pool_destroy(&vec->car_pool);
 
-    free(vec->data);
-    vec->data = NULL;
+    pthread_key_delete(vec->reader_key);
+    cv_reader_t *reader = atomic_load(&vec->readers);
+    while (reader != NULL) {
+        cv_reader_t *next = reader->next;
+        free(reader);
+        reader = next;
+    }
+    atomic_store(&vec->readers, NULL);
 
     pthread_mutex_unlock(&vec->mutex);
     pthread_mutex_destroy(&vec->mutex);
 }
 
-size_t cv_size( car_vector_t *vec ) {
-    pthread_mutex_lock(&vec->mutex);
-    size_t size = vec->size;
-    pthread_mutex_unlock(&vec->mutex);
-    return size;
-}
+/**
+ * Returns the calling thread's epoch record, claiming an unused one or creating a new one on the first call.
+ */
+static cv_reader_t * cv_get_reader( car_vector_t *vec ) {
+    cv_reader_t *reader = pthread_getspecific(vec->reader_key);
+    if (reader != NULL) {
+        return reader;
+    }
 
-void cv_push( car_vector_t *vec, Car * new_item ) {
-    pthread_mutex_lock(&vec->mutex);
+    for (reader = atomic_load(&vec->readers); reader != NULL; reader = reader->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&reader->in_use, &unused, 1)) {
+            break;
+        }
+    }
+    if (reader == NULL) {
+        reader = malloc(sizeof(cv_reader_t));
+        if (reader == NULL) {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&reader->epoch, 0);
+        atomic_init(&reader->in_use, 1);
+        reader->next = atomic_load(&vec->readers);
+        while (!atomic_compare_exchange_weak(&vec->readers, &reader->next, reader));
+    }
+    reader->depth = 0;
+    pthread_setspecific(vec->reader_key, reader);
+    return reader;
+}
 
-    cv_ensure_capacity(vec, vec->size + 1);
-    vec->data[vec->size] = new_item;
-    vec->size++;
+const cv_snapshot_t * cv_read_lock( car_vector_t *vec ) {
+    cv_reader_t *reader = cv_get_reader(vec);
+    if (reader->depth++ == 0) {
+        atomic_store(&reader->epoch, atomic_load(&vec->epoch));
+    }
+    return atomic_load(&vec->current);
+}
 
-    pthread_mutex_unlock(&vec->mutex);
+void cv_read_unlock( car_vector_t *vec ) {
+    cv_reader_t *reader = pthread_getspecific(vec->reader_key);
+    if (--reader->depth == 0) {
+        atomic_store(&reader->epoch, 0);
+    }
 }
 
-Car * cv_get_at( car_vector_t *vec, size_t index) {
-    pthread_mutex_lock(&vec->mutex);
+/**
+ * Frees the retired items no reader can see anymore. The mutex must be held.
+ */
+static void cv_reclaim( car_vector_t *vec ) {
+    // Readers in epochs after an item's retirement entered after it was unpublished
+    uint64_t oldest = UINT64_MAX;
+    for (cv_reader_t *reader = atomic_load(&vec->readers); reader != NULL; reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
 
-    Car * item = NULL;
-    if (index < vec->size) {
-        item = vec->data[index];
+    cv_retired_t **link = &vec->retired;
+    while (*link != NULL) {
+        cv_retired_t *retired = *link;
+        if (retired->epoch < oldest) {
+            *link = retired->next;
+            cv_free_retired(vec, retired);
+        } else {
+            link = &retired->next;
+        }
     }
+}
 
-    pthread_mutex_unlock(&vec->mutex);
+/**
+ * Queues an unpublished item for freeing and advances the epoch. The mutex must be held.
+ */
+static void cv_retire( car_vector_t *vec, void *item, int is_car ) {
+    cv_retired_t *retired = malloc(sizeof(cv_retired_t));
+    if (retired == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+    retired->item = item;
+    retired->is_car = is_car;
+    retired->epoch = atomic_fetch_add(&vec->epoch, 1);
+    retired->next = vec->retired;
+    vec->retired = retired;
 
-    return item;
+    cv_reclaim(vec);
 }
 
-static void cv_remove_at( car_vector_t *vec, size_t pos ) {
-    if (pos >= vec->size) {
-        return;
-    }
-    for (size_t i = pos; i < vec->size - 1; i++) {
-        vec->data[i] = vec->data[i + 1];
-    }
-    vec->size--;
+/**
+ * Makes the snapshot the current one and retires the previous one. The mutex must be held.
+ */
+static void cv_publish( car_vector_t *vec, cv_snapshot_t *snapshot ) {
+    cv_snapshot_t *previous = atomic_exchange(&vec->current, snapshot);
+    cv_retire(vec, previous, 0);
+}
+
+void cv_push( car_vector_t *vec, Car * new_item ) {
+    cv_lock(vec);
+
+    cv_snapshot_t *current = atomic_load(&vec->current);
+    cv_snapshot_t *snapshot = cv_snapshot_alloc(current->size + 1);
+    memcpy(snapshot->data, current->data, current->size * sizeof(Car *));
+    snapshot->data[current->size] = new_item;
+    cv_snapshot_index(snapshot);
+    cv_publish(vec, snapshot);
+
+    pthread_mutex_unlock(&vec->mutex);
 }
 
 void cv_remove( car_vector_t *vec, Car * item ) {
-    pthread_mutex_lock(&vec->mutex);
+    cv_lock(vec);
 
-    for (size_t i = 0; i < vec->size; i++) {
-        if (vec->data[i] == item) {
-            cv_remove_at(vec, i);
+    cv_snapshot_t *current = atomic_load(&vec->current);
+    for (size_t i = 0; i < current->size; i++) {
+        if (current->data[i] == item) {
+            cv_snapshot_t *snapshot = cv_snapshot_alloc(current->size - 1);
+            memcpy(snapshot->data, current->data, i * sizeof(Car *));
+            memcpy(snapshot->data + i, current->data + i + 1, (current->size - i - 1) * sizeof(Car *));
+            cv_snapshot_index(snapshot);
+            cv_publish(vec, snapshot);
             break;
         }
     }
 
     pthread_mutex_unlock(&vec->mutex);
 }
+
+Car * cv_alloc_car( car_vector_t *vec ) {
+    cv_lock(vec);
+    Car * item = pool_alloc(&vec->car_pool);
+    pthread_mutex_unlock(&vec->mutex);
+
+    if (item != NULL) {
+        item->floor_nodes = NULL;
+        pool_init(&item->node_pool, sizeof(QueueNode), NODE_POOL_SLAB_SIZE);
+        pthread_mutex_init(&item->mutex, NULL);
+    }
+    return item;
+}
+
+void cv_free_car( car_vector_t *vec, Car * item ) {
+    cv_lock(vec);
+    cv_retire(vec, item, 1);
+    pthread_mutex_unlock(&vec->mutex);
+}
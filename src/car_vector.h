@@ -1,54 +1,189 @@
+#ifndef CAR_VECTOR_H
+#define CAR_VECTOR_H
+
 #include <stdbool.h>
 #include <math.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include "shared.h"
+#include "object_pool.h"
 
-#define MAX_CAR_NAME_LENGTH 255 // Limit for the length of shared memory name
-#define MAX_FLOOR_LENGTH 4
-#define MAX_STATUS_LENGTH 8
+#define NODE_POOL_SLAB_SIZE 64  // QueueNodes allocated at once for a car
+#define CAR_POOL_SLAB_SIZE 16   // Cars allocated at once for the vector
 
 typedef struct QueueNode {
-    char floor[MAX_FLOOR_LENGTH];   // The floor number
+    floor_t floor;                  // The floor number
     char direction;                 // 'U' for up, 'D' for down
+    uint64_t called_ns;             // When the first passenger waiting at the node called, 0 if nobody waits
+    uint64_t queued_ns;             // When the node was added to the queue
     struct QueueNode *next;         // Pointer to the next node
 } QueueNode;
 
+#define DIRECTION_INDEX(direction) ((direction) == UP ? 0 : 1)
+
+/**
+ * Aggregates of a car's queue, kept up to date by every queue operation.
+ */
+typedef struct queue_stats {
+    size_t nodes;                   // The number of nodes in the queue
+    size_t direction_nodes[2];      // The number of nodes going up [0] and down [1]
+    floor_t farthest_up;            // The highest floor of the nodes going up, NO_FLOOR if there are none
+    floor_t farthest_down;          // The lowest floor of the nodes going down, NO_FLOOR if there are none
+    uint32_t route_floors;          // Floors travelled from the first node to the last one
+    uint32_t route_stops;           // Stops along the queue, consecutive nodes for the same floor share a stop
+    uint64_t completion_ns;         // Projected time to serve the whole queue (only filled in by snapshots)
+} queue_stats_t;
+
 typedef struct {
     char car_name[MAX_CAR_NAME_LENGTH];         // The name of the car
-    char lowest_floor[MAX_FLOOR_LENGTH];        // The lowest floor the car can go to
-    char highest_floor[MAX_FLOOR_LENGTH];       // The highest floor the car can go to
-    char status[MAX_STATUS_LENGTH];             // The status of the car
-    char current_floor[MAX_FLOOR_LENGTH];       // The current floor of the car
-    char destination_floor[MAX_FLOOR_LENGTH];   // The destination floor of the car
+    floor_t lowest_floor;                       // The lowest floor the car can go to
+    floor_t highest_floor;                      // The highest floor the car can go to
+    car_status status;                          // The status of the car
+    floor_t current_floor;                      // The current floor of the car
+    floor_t destination_floor;                  // The destination floor of the car
     int clientfd;                               // The file descriptor of the client
+    int binary;                                 // 1 if the car speaks the binary protocol, else 0
+    uint64_t delay_ns;                          // Measured time the car takes per floor or door movement, 0 until measured
+    uint64_t moved_ns;                          // When the car last started moving or passed a floor
     QueueNode *queue;                           // The head of the linked list of floors
+    queue_stats_t stats;                        // Aggregates of the queue
+    uint16_t *floor_nodes;                      // Queued nodes per direction and floor in the car's range, NULL if not tracked
+    int trial;                                  // 1 for the copies dispatch_cost() schedules calls into, their changes are not reported
+    floor_t parking_floor;                      // The floor the idle car was parked at, NO_FLOOR if it was not
+    object_pool_t node_pool;                    // The pool the car's QueueNodes are allocated from
     pthread_mutex_t mutex;                      // Mutex for the shared memory
 } Car;
 
-typedef struct car_vector {
-	/// The current number of elements in the vector
+/**
+ * An immutable version of the vector's content.
+ * Writers publish a new snapshot on every change, readers get the current one from cv_read_lock().
+ */
+typedef struct cv_snapshot {
+	/// The number of cars
 	size_t size;
 
-	/// The current storage capacity of the vector
-	size_t capacity;
+	/// The number of words in the car set of a floor
+	size_t words;
+
+	/// Index of the cars serving every floor, see cv_floor_cars()
+	uint64_t *floor_cars;
+
+	/// The number of banks, groups of cars whose floor ranges overlap (directly or through other cars)
+	size_t banks;
+
+	/// The bank of every floor, see cv_floor_bank()
+	uint16_t *floor_bank;
+
+	/// The cars
+	Car * data[];
+} cv_snapshot_t;
 
-	/// The content of the vector.
-	Car ** data;
+/**
+ * The epoch record of a thread reading the vector.
+ */
+typedef struct cv_reader {
+	/// The epoch the thread entered its read section in, 0 outside of read sections
+	_Atomic uint64_t epoch;
 
+	/// 1 while the record belongs to a thread, records of finished threads are reused
+	atomic_int in_use;
+
+	/// Nesting depth of the read sections, only touched by the owning thread
+	unsigned depth;
+
+	struct cv_reader *next;
+} cv_reader_t;
+
+/**
+ * A snapshot or car removed from the vector, freed once no reader can see it anymore.
+ */
+typedef struct cv_retired {
+	/// The retired snapshot or car
+	void *item;
+
+	/// 1 if item is a car, 0 if it is a snapshot
+	int is_car;
+
+	/// The epoch the item was retired in
+	uint64_t epoch;
+
+	struct cv_retired *next;
+} cv_retired_t;
+
+/**
+ * Read-mostly registry of the connected cars.
+ * Readers take no locks, they see the snapshot that was current when they entered their read section.
+ * Writers serialize on the mutex, publish a new snapshot atomically and retire the old one,
+ * which is freed after every reader that could have seen it has left its read section (epoch based reclamation).
+ */
+typedef struct car_vector {
+	/// The current content of the vector
+	_Atomic(cv_snapshot_t *) current;
+
+	/// The global epoch, advanced whenever something is retired
+	_Atomic uint64_t epoch;
+
+	/// The epoch records of all threads that have ever read the vector
+	_Atomic(cv_reader_t *) readers;
+
+	/// The key holding the calling thread's epoch record
+	pthread_key_t reader_key;
+
+	/// Snapshots and cars waiting to be freed (protected by the mutex)
+	cv_retired_t *retired;
+
+	/// The pool the cars are allocated from (protected by the mutex)
+	object_pool_t car_pool;
+
+	/// Serializes the writers
 	pthread_mutex_t mutex;
-} car_vector_t;
 
-#define CV_INITIAL_CAPACITY 4
-#define CV_GROWTH_FACTOR 1.25
+	/// Called with the nanoseconds spent waiting for the mutex whenever it was contended, may be NULL
+	void (*lock_wait)( uint64_t ns );
+} car_vector_t;
 
 void cv_init( car_vector_t *vec );
 
 void cv_destroy( car_vector_t *vec );
 
-size_t cv_size( car_vector_t *vec );
+/**
+ * Enters a read section and returns the current snapshot, which stays valid until cv_read_unlock().
+ * Read sections of a thread may be nested.
+ */
+const cv_snapshot_t * cv_read_lock( car_vector_t *vec );
 
-void cv_push( car_vector_t *vec, Car * new_item );
+void cv_read_unlock( car_vector_t *vec );
+
+/**
+ * Returns the set of the snapshot's cars whose floor range includes the floor, as words bits:
+ * bit i % 64 of word i / 64 is set if data[i] serves the floor.
+ */
+static inline const uint64_t * cv_floor_cars( const cv_snapshot_t *snapshot, floor_t floor ) {
+	return snapshot->floor_cars + (size_t) (floor - MIN_FLOOR) * snapshot->words;
+}
 
-Car * cv_get_at( car_vector_t *vec, size_t index);
+/**
+ * Returns the bank (1 to banks, numbered from the lowest floor up) of the cars serving the floor, 0 if no car does.
+ * All cars that can serve a call between two floors belong to the bank of both floors.
+ */
+static inline size_t cv_floor_bank( const cv_snapshot_t *snapshot, floor_t floor ) {
+	return snapshot->floor_bank[floor - MIN_FLOOR];
+}
+
+void cv_push( car_vector_t *vec, Car * new_item );
 
 void cv_remove( car_vector_t *vec, Car * item );
+
+/**
+ * Allocates a car from the vector's pool and initializes its mutex and QueueNode pool. Returns NULL on failure.
+ */
+Car * cv_alloc_car( car_vector_t *vec );
+
+/**
+ * Returns a car and all of its QueueNodes to the pools once no reader can see the car anymore.
+ * The car must already be removed from the vector.
+ */
+void cv_free_car( car_vector_t *vec, Car * item );
+
+#endif
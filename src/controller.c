@@ -2,372 +2,662 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include "shared.h"
+#include "protocol.h"
 #include "car_vector.h"
+#include "histogram.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "replication.h"
+#include "journal.h"
 
-#define MAX_CLIENTS 10
+#define LISTEN_BACKLOG SOMAXCONN
 
-int listensockfd;  // Global variable for the listening socket
-car_vector_t cars; // Global variable for the cars vector
+/**
+ * A CALL parsed from a text or binary message.
+ */
+typedef struct call_request {
+    floor_t source_floor;       // NO_FLOOR if the message was not a valid call
+    floor_t destination_floor;  // NO_FLOOR if the message was not a valid call
+    int binary;                 // 1 if the call was binary and must be answered in binary
+    int tagged;                 // 1 if the call carries a request id, which makes the connection persistent
+    uint32_t request_id;        // The request id of a tagged call
+} call_request_t;
 
-// Signal handler for SIGINT
-void handle_sigint(int dummy) {
-    if (close(listensockfd) == -1) {
-        perror("close() failed");
-    }
-    cv_destroy(&cars);
-    exit(EXIT_SUCCESS);
-}
+/**
+ * The connection of a call pad, possibly shared by several calls in flight.
+ */
+typedef struct call_session {
+    int fd;                         // The call pad's socket, -1 once the reactor closed it or the session was dropped
+    connection_t *conn;             // The reactor connection, NULL if replies are sent blocking (thread per connection)
+    pthread_mutex_t send_mutex;     // Keeps replies sent by different workers from interleaving
+    char *out_buf;                  // Framed replies the socket did not take yet (reactor connections only)
+    size_t out_len;
+    size_t out_cap;
+    atomic_int refs;                // One for the reactor plus one per call in flight
+} call_session_t;
+
+// Bytes of replies a call pad may leave unread before its session is dropped
+#define CALL_SESSION_BACKLOG 65536
+
+// Kinds of reactor connections (connection_t.kind)
+#define CONN_CAR 1          // data is the Car
+#define CONN_CALL_SESSION 2 // data is the call_session_t of a call pad pipelining tagged calls
+
+int listensockfd;           // Global variable for the listening socket
+car_vector_t cars;          // Global variable for the cars vector
+worker_pool_t workers;      // Workers handling the calls in the event loop mode
+worker_pool_t *shards;      // Dispatcher threads of the shards in the sharded event loop mode, NULL if not sharded
+size_t nshards;
+queue_replica_t restored;   // Queues taken over from the primary or the journal, until their cars reconnect
+uint64_t restore_ns;        // When the queues were taken over, 0 if there were none
+const char *restore_reason; // "takeover" or "restart"
+dispatch_mode dispatch = DISPATCH_QUEUE_LENGTH;
+atomic_int shutting_down;   // 1 once SIGINT was received, the listening socket no longer takes connections
+reactor_t *reactors;        // The event loops of the event loop mode
+pthread_t *reactor_threads;
+size_t nreactors_running;
 
 /**
- * Return the number of elements in the queue.
+ * The connections served by threads of their own (without -e), shut down when the controller stops.
  */
-size_t queue_size(QueueNode *head) {
-    size_t size = 0;
-    QueueNode *current = head;
-    while (current != NULL) {
-        size++;
-        current = current->next;
-    }
-    return size;
-}
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;        // Signalled when a connection's thread ends
+    int *fds;
+    size_t count;
+    size_t capacity;
+} client_threads = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
 
 /**
- * Adds a new node to the queue right after the given node.
+ * Prints the number of handled calls and the distribution of their call-to-reply latency.
  */
-void queue_add(QueueNode *after, char floor[MAX_FLOOR_LENGTH], char direction) {
-    // Do not add the same floor+direction twice
-    if (after->next != NULL && strncmp(after->next->floor, floor, MAX_FLOOR_LENGTH) == 0 && after->next->direction == direction) {
+void print_call_latency(void) {
+    histogram_t *call_latency = malloc(sizeof(histogram_t));
+    if (call_latency == NULL) {
+        perror("malloc()");
         return;
     }
-    
-    QueueNode *new_node = malloc(sizeof(QueueNode));
-    if (new_node == NULL) {
-        perror("malloc()");
-        exit(EXIT_FAILURE);
+    hist_init(call_latency);
+    metrics_histogram_merge(METRIC_CALL_LATENCY, call_latency);
+    printf("CALLs: %lu, call-to-reply latency (us): mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        (unsigned long) hist_count(call_latency),
+        hist_mean(call_latency) / 1000.0,
+        hist_percentile(call_latency, 50.0) / 1000.0,
+        hist_percentile(call_latency, 99.0) / 1000.0,
+        hist_percentile(call_latency, 99.9) / 1000.0,
+        hist_max(call_latency) / 1000.0);
+    fflush(stdout);
+    free(call_latency);
+}
+
+/**
+ * Prints the allocation counters of the car pool, the QueueNode pools of the connected cars and the receive buffers.
+ */
+void print_pool_stats(void) {
+    size_t live = 0;
+    size_t peak = 0;
+    size_t recycled = 0;
+
+    const cv_snapshot_t *snapshot = cv_read_lock(&cars);
+    for (size_t i = 0; i < snapshot->size; i++) {
+        Car *car = snapshot->data[i];
+        pthread_mutex_lock(&car->mutex);
+        live += car->node_pool.live;
+        peak += car->node_pool.peak;
+        recycled += car->node_pool.recycled;
+        pthread_mutex_unlock(&car->mutex);
     }
+    cv_read_unlock(&cars);
+    printf("QueueNodes: live %zu, peak %zu, recycled %zu\n", live, peak, recycled);
 
-    strncpy(new_node->floor, floor, MAX_FLOOR_LENGTH);
-    new_node->direction = direction;
-    new_node->next = after->next;
-    after->next = new_node;
+    pthread_mutex_lock(&cars.mutex);
+    printf("Cars: live %zu, peak %zu, recycled %zu\n", cars.car_pool.live, cars.car_pool.peak, cars.car_pool.recycled);
+    pthread_mutex_unlock(&cars.mutex);
+    // Receive buffers are reused for all messages of a connection, the allocations must not grow with the messages
+    printf("Receive buffers: allocated %lu for %lu STATUS and %lu CALL messages\n",
+        (unsigned long) (receive_allocation_count() + reactor_allocation_count()),
+        (unsigned long) metrics_counter_total(METRIC_STATUS), (unsigned long) metrics_counter_total(METRIC_CALLS));
+    fflush(stdout);
 }
 
-/*
-* Pushes a new node to the front of the queue.
-*/
-void queue_push_front(QueueNode **head, char floor[MAX_FLOOR_LENGTH], char direction) {
-    QueueNode *new_node = malloc(sizeof(QueueNode));
-    if (new_node == NULL) {
-        perror("malloc()");
-        exit(EXIT_FAILURE);
+/**
+ * Counts in the thread about to serve the connection. Returns 0 on success, -1 if out of memory.
+ */
+int client_thread_begin(int clientfd) {
+    pthread_mutex_lock(&client_threads.mutex);
+    if (client_threads.count == client_threads.capacity) {
+        size_t capacity = client_threads.capacity == 0 ? 64 : client_threads.capacity * 2;
+        int *fds = realloc(client_threads.fds, capacity * sizeof(int));
+        if (fds == NULL) {
+            pthread_mutex_unlock(&client_threads.mutex);
+            perror("realloc()");
+            return -1;
+        }
+        client_threads.fds = fds;
+        client_threads.capacity = capacity;
     }
-
-    strncpy(new_node->floor, floor, MAX_FLOOR_LENGTH);
-    new_node->direction = direction;
-    new_node->next = *head;
-    *head = new_node;
+    client_threads.fds[client_threads.count++] = clientfd;
+    pthread_mutex_unlock(&client_threads.mutex);
+    return 0;
 }
 
-/*
-* Removes the first node from the queue.
-*/
-void queue_pop(QueueNode **head) {
-    if (*head == NULL) {
-        return;
+/**
+ * Counts out the thread serving the connection, before it closes the socket.
+ */
+void client_thread_end(int clientfd) {
+    pthread_mutex_lock(&client_threads.mutex);
+    for (size_t i = 0; i < client_threads.count; i++) {
+        if (client_threads.fds[i] == clientfd) {
+            client_threads.fds[i] = client_threads.fds[--client_threads.count];
+            break;
+        }
     }
-    QueueNode *temp = *head;
-    *head = (*head)->next;
-    free(temp);
+    pthread_cond_signal(&client_threads.done);
+    pthread_mutex_unlock(&client_threads.mutex);
 }
 
-/*
-* Removes the first node from the queue if the floor matches.
-*/
-void queue_pop_single(QueueNode **head, char *floor) {
-    if (*head == NULL) {
-        return;
+/**
+ * Shuts down the connections served by threads of their own and waits until their threads ended,
+ * which unregisters the cars.
+ */
+void stop_client_threads(void) {
+    pthread_mutex_lock(&client_threads.mutex);
+    for (size_t i = 0; i < client_threads.count; i++) {
+        shutdown(client_threads.fds[i], SHUT_RDWR);
     }
-    if (strncmp((*head)->floor, floor, MAX_FLOOR_LENGTH) == 0) {
-        queue_pop(head);
+    while (client_threads.count > 0) {
+        pthread_cond_wait(&client_threads.done, &client_threads.mutex);
     }
+    pthread_mutex_unlock(&client_threads.mutex);
+    free(client_threads.fds);
 }
 
-/*
-* Removes the first two nodes from the queue if the floors match.
-* The need for removing two nodes is because the same floor can be added twice with different directions.
-*/
-void queue_pop_double(QueueNode **head, char *floor) {
-    queue_pop_single(head, floor);
-    queue_pop_single(head, floor);
+void record_car_lock_wait(uint64_t ns) {
+    metrics_record(METRIC_CAR_LOCK_WAIT, ns);
+}
+
+void record_cars_lock_wait(uint64_t ns) {
+    metrics_record(METRIC_CARS_LOCK_WAIT, ns);
 }
 
 /**
- * Adds a current floor at the front of the queue.
- * Returns 1 if the node was added, 0 otherwise (car is 'BETWEEN' and current floor is already at the front of the queue).
+ * Streams and logs the node which was just linked into the car's queue.
  */
-int add_virtual_node(Car *car, char direction) {
-    // If the car's status is Between we consider the current floor to be the next floor the elevator would go to
-    if (strncmp(car->status, "Between", MAX_STATUS_LENGTH) == 0) {
-        direction = are_consecutive_floors(car->current_floor, car->destination_floor) ? UP : DOWN;
+void node_added(Car *car, const QueueNode *node) {
+    repl_node_added(car, node);
+    journal_node_added(car, node);
+}
 
-        char next_floor[MAX_FLOOR_LENGTH];
-        strncpy(next_floor, car->current_floor, MAX_FLOOR_LENGTH);
-        // Increment or decrement the floor based on the direction
-        set_next_floor(next_floor, direction);
-        // If the next floor is the destination floor, we don't need to add it to the queue
-        if (strncmp(next_floor, car->destination_floor, MAX_FLOOR_LENGTH) == 0) {
-            return 0;
-        }
+/**
+ * Streams and logs the removal of the head of the car's queue.
+ */
+void head_removed(Car *car) {
+    repl_head_removed(car);
+    journal_head_removed(car);
+}
 
-        queue_push_front(&car->queue, next_floor, direction);
-        return 1;
-    }
-    // If the car's status is anything else, the current floor is current floor...
-    // Now we need to determine the direction
-    // If the queue is empty, set the direction to the direction being requested by the call (in parameter)
-    if (car->queue != NULL) {
-        // If the first real entry in the queue is the same floor as the current floor, just take that entry's direction
-        if (strncmp(car->current_floor, car->queue->floor, MAX_FLOOR_LENGTH) == 0) {
-            direction = car->queue->direction;
-        }
-        // Otherwise, base the direction by looking whether the car would have to go up or down to get to the first real entry in the queue
-        else {
-            direction = are_consecutive_floors(car->current_floor, car->queue->floor) ? UP : DOWN;
-        }
-    }
+void record_call_wait(Car *car, uint64_t wait_ns) {
+    (void) car;
+    metrics_record(METRIC_CALL_WAIT, wait_ns);
+}
+
+/**
+ * Logs the switch of the automatic dispatch to another strategy.
+ */
+void log_traffic_change(traffic_pattern from, traffic_pattern to, dispatch_mode mode) {
+    traffic_shares_t shares = traffic_shares();
+    metrics_count(METRIC_TRAFFIC_CHANGES, 1);
+    printf("Traffic changed from %s to %s (%u incoming, %u outgoing, %u interfloor of the last %d calls), "
+        "dispatching with %s\n", traffic_pattern_name(from), traffic_pattern_name(to),
+        shares.incoming, shares.outgoing, shares.interfloor, TRAFFIC_WINDOW_CALLS, dispatch_mode_name(mode));
+    fflush(stdout);
+}
 
-    queue_push_front(&car->queue, car->current_floor, direction);
-    return 1;
+/**
+ * Returns the local time of day in nanoseconds, the clock parking learns the demand by.
+ */
+uint64_t local_time_of_day(void) {
+    struct timespec now;
+    struct tm local;
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &local);
+    uint64_t seconds = (uint64_t) local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+    return seconds * 1000000000ULL + now.tv_nsec;
 }
 
 /**
- * Checks if the order of the source and destination floors is valid in respect to the given direction.
- * Returns 1 if the order is valid, 0 otherwise. If the floors are the same, the order is always valid.
+ * Sends the car to the given floor in the protocol the car speaks.
+ * The car's mutex is held, so the socket is never waited for: a car that stopped reading its FLOOR messages is
+ * disconnected instead, its connection's thread or reactor then unregisters it.
  */
-int is_valid_order(char *source_floor, char *destination_floor, char direction) {
-    // Same floor -> valid order
-    if (strncmp(source_floor, destination_floor, MAX_FLOOR_LENGTH) == 0) {
-        return 1;
+void send_floor(Car *car, floor_t floor) {
+    if (car->clientfd == -1) {
+        return;
     }
-    if (direction == UP && are_consecutive_floors(source_floor, destination_floor)) {
-        return 1;
+    char msg[10] = {0};
+    uint8_t record[PROTO_RECORD_SIZE];
+    int result;
+    if (car->binary) {
+        proto_record rec = { .type = PROTO_FLOOR, .floor = floor };
+        proto_encode(&rec, record);
+        result = send_frame_nowait(car->clientfd, record, sizeof(record));
+    } else {
+        snprintf(msg, sizeof(msg), "FLOOR %s", floor_name(floor));
+        result = send_frame_nowait(car->clientfd, msg, strlen(msg));
     }
-    if (direction == DOWN && are_consecutive_floors(destination_floor, source_floor)) {
-        return 1;
+    if (result == -1 && shutdown(car->clientfd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        perror("shutdown()");
     }
-    return 0;
 }
 
-void schedule_floors(Car * car, char *source_floor, char *destination_floor) {
-    char direction = are_consecutive_floors(source_floor, destination_floor) ? UP : DOWN;
-
-    int virtual_added = add_virtual_node(car, direction);
-    // Find the suitable position to insert the source and destination floors
-    QueueNode *current = car->queue ? car->queue->next : NULL;
-    QueueNode *prev = car->queue;
-    QueueNode *suitable_pos = NULL;
+void call_session_init(call_session_t *session, int fd, connection_t *conn) {
+    session->fd = fd;
+    session->conn = conn;
+    pthread_mutex_init(&session->send_mutex, NULL);
+    session->out_buf = NULL;
+    session->out_len = 0;
+    session->out_cap = 0;
+    atomic_init(&session->refs, 1);
+}
 
-    // A special case is when the from floor is equal to the current floor (the virtual first item in the queue) and in the same direction.
-    // If the status is Closing - it's too late, so the from and to floors will need to be inserted into the 3rd block.
-    if (strncmp(car->queue->floor, source_floor, MAX_FLOOR_LENGTH) == 0
-        && car->queue->direction == direction
-        && strncmp(car->status, "Closing", MAX_STATUS_LENGTH) == 0) {
-        prev = current;
-        current = current->next;
+/**
+ * Drops a reference to a heap allocated session, the last one frees it.
+ */
+void call_session_release(call_session_t *session) {
+    if (atomic_fetch_sub(&session->refs, 1) == 1) {
+        pthread_mutex_destroy(&session->send_mutex);
+        free(session->out_buf);
+        free(session);
     }
+}
 
-    while (current != NULL) {
-        // We moved to another block -> reset previously found suitable position
-        if (prev->direction != current->direction) {
-            suitable_pos = NULL;
-        }
+/**
+ * Gives up on a call pad which does not read its replies: shuts its socket down, so the reactor closes the
+ * connection, and discards the replies still queued. Must be called with send_mutex held.
+ */
+static void call_session_drop(call_session_t *session) {
+    if (shutdown(session->fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        perror("shutdown()");
+    }
+    session->fd = -1;
+    session->out_len = 0;
+}
 
-        // We are in the block with different direction -> there is no suitable position
-        if (prev->direction == current->direction && prev->direction != direction) {
-            prev = current;
-            current = current->next;
+/**
+ * Sends as much of the queued replies as the socket takes without waiting.
+ * Returns 0 if the session is still usable, -1 if it was dropped. Must be called with send_mutex held.
+ */
+static int call_session_flush(call_session_t *session) {
+    size_t sent_total = 0;
+    while (sent_total < session->out_len) {
+        ssize_t sent = send(session->fd, session->out_buf + sent_total, session->out_len - sent_total,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
             continue;
         }
-
-        if ((prev->direction != direction || is_valid_order(prev->floor, source_floor, direction))
-        && (current->direction != direction || is_valid_order(source_floor, current->floor, direction))) {
-            suitable_pos = prev;
-        }
-        if (suitable_pos != NULL
-        && (prev->direction != direction || is_valid_order(prev->floor, destination_floor, direction))
-        && (current->direction != direction || is_valid_order(destination_floor, current->floor, direction))) {
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
+        if (sent == -1) {
+            call_session_drop(session);
+            return -1;
+        }
+        sent_total += sent;
+    }
+    memmove(session->out_buf, session->out_buf + sent_total, session->out_len - sent_total);
+    session->out_len -= sent_total;
+    return 0;
+}
 
-        prev = current;
-        current = current->next;
+/**
+ * Queues a framed reply on a reactor session and sends what the socket takes right away. The rest is sent by
+ * on_writable, the session is dropped once more than CALL_SESSION_BACKLOG bytes are waiting.
+ * Must be called with send_mutex held.
+ */
+static void call_session_queue(call_session_t *session, const void *payload, uint32_t len) {
+    int was_empty = session->out_len == 0;
+    size_t needed = session->out_len + sizeof(uint32_t) + len;
+    if (needed > CALL_SESSION_BACKLOG) {
+        call_session_drop(session);
+        return;
     }
-    // No suitable position found -> add to the end
-    if (!suitable_pos) {
-        queue_add(prev, source_floor, direction);
-        queue_add(prev->next, destination_floor, direction);
+    if (needed > session->out_cap) {
+        size_t new_cap = session->out_cap != 0 ? session->out_cap : 512;
+        while (new_cap < needed) {
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(session->out_buf, new_cap);
+        if (new_buf == NULL) {
+            perror("realloc()");
+            call_session_drop(session);
+            return;
+        }
+        session->out_buf = new_buf;
+        session->out_cap = new_cap;
     }
-    // Suitable position found -> add at the suitable position
-    else {
-        queue_add(suitable_pos, source_floor, direction);
-        prev = (suitable_pos == prev) ? prev->next : prev;
-        queue_add(prev, destination_floor, direction);
+    uint32_t nlen = htonl(len);
+    memcpy(session->out_buf + session->out_len, &nlen, sizeof(nlen));
+    memcpy(session->out_buf + session->out_len + sizeof(nlen), payload, len);
+    session->out_len = needed;
+
+    // Replies queued before this one are already waiting for the socket to become writable
+    if (!was_empty || call_session_flush(session) == -1 || session->out_len == 0) {
+        return;
     }
-    // Remove the virtual node if it was added
-    if (virtual_added) {
-        queue_pop(&car->queue);
+    if (reactor_want_write(session->conn, 1) == -1) {
+        call_session_drop(session);
     }
 }
 
 /**
- * Returns the car that is the most suitable for the call.
- * Most suitable car is the least busy one - the one with the least entries in the queue.
- * If no car is suitable, returns NULL.
+ * Replies to a call in the protocol it used: PROTO_CAR with the car's name, PROTO_UNAVAILABLE or PROTO_INVALID.
+ * Replies to tagged calls carry the request id. Nothing is sent if the session is already closed.
+ * Replies on reactor sessions never wait for the call pad to read, see call_session_queue().
  */
-Car * choose_car(char *source_floor, char *destination_floor) {
-    Car * car = NULL;
-    size_t min_entries = SIZE_MAX;
+void send_call_reply(call_session_t *session, const call_request_t *call, proto_type type, const char *car_name) {
+    proto_record rec = { .type = type };
+    char payload[MAX_CAR_NAME_LENGTH + 24] = {0};
+    const char *text = type == PROTO_CAR ? "CAR" : type == PROTO_UNAVAILABLE ? "UNAVAILABLE" : "INVALID";
+    uint32_t len;
 
-    for (size_t i = 0; i < cv_size(&cars); i++) {
-        Car *current_car = cv_get_at(&cars, i);
-        // Check if the car can go to the source and destination floors
-        if (!is_floor_within_bounds(source_floor, current_car->lowest_floor, current_car->highest_floor)
-            || !is_floor_within_bounds(destination_floor, current_car->lowest_floor, current_car->highest_floor)) {
-            continue;
+    if (!call->binary) {
+        int n = snprintf(payload, sizeof(payload), "%s", text);
+        if (type == PROTO_CAR) {
+            n += snprintf(payload + n, sizeof(payload) - n, " %s", car_name);
         }
-        size_t entries = queue_size(current_car->queue);
-        // Less busy car found -> new ideal car
-        if (entries < min_entries) {
-            min_entries = entries;
-            car = current_car;
+        if (call->tagged) {
+            n += snprintf(payload + n, sizeof(payload) - n, " %u", call->request_id);
         }
+        len = n;
+    } else {
+        len = proto_encode_reply(&rec, call->tagged ? &call->request_id : NULL, type == PROTO_CAR ? car_name : NULL,
+                                 (uint8_t *) payload);
     }
-    
-    return car;
+
+    pthread_mutex_lock(&session->send_mutex);
+    if (session->fd == -1) {
+        // The call pad hung up or was dropped -> nobody to reply to
+    }
+    else if (session->conn != NULL) {
+        call_session_queue(session, payload, len);
+    }
+    else {
+        send_frame(session->fd, payload, len);
+    }
+    pthread_mutex_unlock(&session->send_mutex);
 }
 
 /**
- * Handles a TCP message from the call pad.
- * Attemps to schedule a car and returns the result to the call pad.
+ * Attemps to schedule a car for the call and replies to the call pad.
  */
-void handle_call(int clientfd, char *source_floor, char *destination_floor) {
-    // There are no cars connected
-    if (cv_size(&cars) == 0) {
-        send_message(clientfd, "UNAVAILABLE");
+void handle_call(call_session_t *session, const call_request_t *call) {
+    metrics_count(METRIC_CALLS, 1);
+    if (call->source_floor == NO_FLOOR || call->destination_floor == NO_FLOOR) {
+        metrics_count(METRIC_INVALID, 1);
+        send_call_reply(session, call, PROTO_INVALID, NULL);
+        return;
     }
+
+    // The chosen car is not freed before the read section is left, even if it disconnects meanwhile
+    const cv_snapshot_t *snapshot = cv_read_lock(&cars);
     // Choose the car that is the most suitable for the call
-    Car *car = choose_car(source_floor, destination_floor);
-    // No car available for the call
+    uint64_t start = now_ns();
+    Car *car = choose_car(snapshot, call->source_floor, call->destination_floor);
+    metrics_record(METRIC_CHOOSE_CAR, now_ns() - start);
+    // No car connected or available for the call
     if (car == NULL) {
-        send_message(clientfd, "UNAVAILABLE");
+        cv_read_unlock(&cars);
+        metrics_count(METRIC_UNAVAILABLE, 1);
+        send_call_reply(session, call, PROTO_UNAVAILABLE, NULL);
         return;
     }
 
-    pthread_mutex_lock(&car->mutex);
+    lock_car(car);
 
-    schedule_floors(car, source_floor, destination_floor);
-    // The car's destination floor differs from the first floor in the queue
-    // or the car's current floor is equal to the first floor in the queue
-    // -> message the car
-    if (strncmp(car->destination_floor, car->queue->floor, MAX_FLOOR_LENGTH) != 0
-        || strncmp(car->current_floor, car->queue->floor, MAX_FLOOR_LENGTH) == 0) {
-        char msg[10] = {0};
-        snprintf(msg, sizeof(msg), "FLOOR %s", car->queue->floor);
-        send_message(car->clientfd, msg);
-    }
+    start = now_ns();
+    schedule_floors(car, call->source_floor, call->destination_floor);
+    metrics_record(METRIC_SCHEDULE_FLOORS, now_ns() - start);
+    send_queue_head(car);
     pthread_mutex_unlock(&car->mutex);
 
-    // Send the name of the car that was dispatched: CAR {car_name}
-    char msg[MAX_CAR_NAME_LENGTH + 5] = {0};
-    snprintf(msg, sizeof(msg), "CAR %s", car->car_name);
-    send_message(clientfd, msg);
+    char car_name[MAX_CAR_NAME_LENGTH + 1] = {0};
+    strncpy(car_name, car->car_name, MAX_CAR_NAME_LENGTH);
+    cv_read_unlock(&cars);
+    // Send the name of the car that was dispatched
+    send_call_reply(session, call, PROTO_CAR, car_name);
 }
 
+
 /**
- * Updates the car's state based on the received status, current floor and destination floor.
- * If the car has arrived at the destination floor, the floor is removed from the queue.
- * If there are more floors in the queue, the next floor is scheduled.
+ * Remembers the name of a registering car. Returns 1 if a car of that name has registered before, 0 otherwise.
  */
-void update_car_state(Car *car, char *status, char *current_floor, char *destination_floor) {
-    strncpy(car->status, status, MAX_STATUS_LENGTH);
-    strncpy(car->current_floor, current_floor, MAX_FLOOR_LENGTH);
-    strncpy(car->destination_floor, destination_floor, MAX_FLOOR_LENGTH);
+int remember_car(const char *car_name) {
+    static char (*names)[MAX_CAR_NAME_LENGTH + 1];
+    static size_t count;
+    static size_t capacity;
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    int known = 0;
 
-    // The car did not arrive at the destination floor yet -> no further action required
-    if (strncmp(status, "Opening", MAX_STATUS_LENGTH) != 0 || strncmp(current_floor, destination_floor, MAX_FLOOR_LENGTH) != 0) {
-        return;
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0; i < count && !known; i++) {
+        known = strncmp(names[i], car_name, MAX_CAR_NAME_LENGTH) == 0;
+    }
+    if (!known && count == capacity) {
+        size_t new_capacity = capacity == 0 ? 16 : capacity * 2;
+        void *new_names = realloc(names, new_capacity * sizeof(*names));
+        if (new_names != NULL) {
+            names = new_names;
+            capacity = new_capacity;
+        }
     }
-    pthread_mutex_lock(&car->mutex);
-    // Remove the current/destination floor from the queue
-    queue_pop_double(&car->queue, current_floor);
-    // Schedule the next floor if there is one
-    if (car->queue != NULL) {
-        char msg[10] = {0};
-        snprintf(msg, sizeof(msg), "FLOOR %s", car->queue->floor);
-        send_message(car->clientfd, msg);
+    if (!known && count < capacity) {
+        strncpy(names[count], car_name, MAX_CAR_NAME_LENGTH);
+        names[count][MAX_CAR_NAME_LENGTH] = '\0';
+        count++;
     }
-    pthread_mutex_unlock(&car->mutex);
+    pthread_mutex_unlock(&mutex);
+    return known;
 }
 
 /**
- * Maintains a connection with a car and manages its state.
+ * Validates the car's floors and registers the car in the cars vector.
+ * If the car offered the binary protocol, it is accepted and used for the rest of the connection.
+ * Returns the registered car, or NULL if the car was rejected.
  */
-void manage_car(int clientfd, char *car_name, char *lowest_floor, char *highest_floor) {
+Car * register_car(int clientfd, char *car_name, char *lowest_floor, char *highest_floor, char *protocol) {
+    floor_t lowest = lowest_floor != NULL ? floor_parse(lowest_floor) : NO_FLOOR;
+    floor_t highest = highest_floor != NULL ? floor_parse(highest_floor) : NO_FLOOR;
     // Validate the floor numbers
-    if (!is_valid_floor(lowest_floor) || !is_valid_floor(highest_floor) || !are_consecutive_floors(lowest_floor, highest_floor)) {
+    if (car_name == NULL || lowest == NO_FLOOR || highest == NO_FLOOR || lowest > highest) {
         send_message(clientfd, "INVALID");
-        return;
+        return NULL;
     }
 
     // Initialize the car struct
-    Car * car = malloc(sizeof(Car));
+    Car * car = cv_alloc_car(&cars);
+    if (car == NULL) {
+        send_message(clientfd, "INVALID");
+        return NULL;
+    }
     strncpy(car->car_name, car_name, MAX_CAR_NAME_LENGTH);
-    strncpy(car->lowest_floor, lowest_floor, MAX_FLOOR_LENGTH);
-    strncpy(car->highest_floor, highest_floor, MAX_FLOOR_LENGTH);
-    strncpy(car->status, "Closed", MAX_STATUS_LENGTH);
-    strncpy(car->current_floor, lowest_floor, MAX_FLOOR_LENGTH);
+    car_state_init(car, lowest, highest);
     car->clientfd = clientfd;
-    car->queue = NULL;
-    pthread_mutex_init(&car->mutex, NULL);
+    car->binary = protocol != NULL && strcmp(protocol, PROTO_OFFER) == 0;
+    if (car->binary) {
+        proto_record rec = { .type = PROTO_ACCEPT };
+        send_record(clientfd, &rec);
+    }
+    // A car reconnecting after a takeover or restart continues with the queue it had
+    lock_car(car);
+    if (restore_ns != 0) {
+        size_t count = replica_restore(&restored, car);
+        if (count > 0) {
+            send_queue_head(car);
+            printf("Car %s restored with %zu queued stops %.1f ms after the %s\n", car->car_name, count,
+                (now_ns() - restore_ns) / 1e6, restore_reason);
+            fflush(stdout);
+        }
+    }
+    // Replaces whatever the journal knew about a car of that name
+    journal_car_queue(car);
+    pthread_mutex_unlock(&car->mutex);
     // Insert the car into the cars vector
     cv_push(&cars, car);
+    metrics_count(remember_car(car->car_name) ? METRIC_CAR_RECONNECTS : METRIC_CAR_CONNECTS, 1);
+    return car;
+}
+
+/**
+ * Removes the car from the cars vector and frees it once no call handler can see it anymore.
+ * Call handlers which already chose the car may still schedule on it, but no longer message its socket.
+ */
+void unregister_car(Car *car) {
+    cv_remove(&cars, car);
+    lock_car(car);
+    // No more queue changes are replicated or logged for the car after its removal
+    repl_car_removed(car);
+    journal_car_removed(car);
+    parking_release(car);
+    car->clientfd = -1;
+    pthread_mutex_unlock(&car->mutex);
+    cv_free_car(&cars, car);
+}
+
+/**
+ * Takes appropriate action for a (text or binary) message received from a car.
+ * Returns 1 if the car is going to disconnect, 0 otherwise.
+ */
+int handle_car_message(Car *car, char *msg, uint32_t len) {
+    proto_record rec;
+    if (proto_decode(msg, len, &rec) == 0) {
+        if (rec.type == PROTO_SERVICE || rec.type == PROTO_EMERGENCY) {
+            return 1;
+        }
+        if (rec.type == PROTO_STATUS && floor_is_valid(rec.floor) && floor_is_valid(rec.other_floor)) {
+            metrics_count(METRIC_STATUS, 1);
+            update_car_state(car, rec.status, rec.floor, rec.other_floor);
+        }
+        return 0;
+    }
+
+    if (strcmp(msg, "INDIVIDUAL SERVICE") == 0 || strcmp(msg, "EMERGENCY") == 0) {
+        return 1;
+    }
 
     char *tokens[4];
+    tokenize_message(msg, tokens, 4);
+
+    if (tokens[0] == NULL || tokens[3] == NULL || strncmp(tokens[0], "STATUS", MAX_STATUS_LENGTH) != 0) {
+        return 0;
+    }
+    int status = status_from_string(tokens[1]);
+    floor_t current_floor = floor_parse(tokens[2]);
+    floor_t destination_floor = floor_parse(tokens[3]);
+    if (status != -1 && current_floor != NO_FLOOR && destination_floor != NO_FLOOR) {
+        metrics_count(METRIC_STATUS, 1);
+        update_car_state(car, status, current_floor, destination_floor);
+    }
+    return 0;
+}
+
+/**
+ * Maintains a connection with a car and manages its state.
+ * The car's messages are received through the connection's buffer, which may already hold some of them.
+ */
+void manage_car(int clientfd, msg_buffer_t *buf, char *car_name, char *lowest_floor, char *highest_floor,
+                char *protocol) {
+    Car *car = register_car(clientfd, car_name, lowest_floor, highest_floor, protocol);
+    if (car == NULL) {
+        return;
+    }
+
     // Loop to receive messages from the car and take appropriate action
     while (1) {
-        char *msg = receive_msg(car->clientfd);
-        // Car is gonna disconnect -> free memory and return
-        if (msg == NULL || strcmp(msg, "INDIVIDUAL SERVICE") == 0 || strcmp(msg, "EMERGENCY") == 0) {
-            free(msg);
-            cv_remove(&cars, car);
-            pthread_mutex_destroy(&car->mutex);
-            free(car);
+        uint32_t len;
+        char *msg = receive_buffered(car->clientfd, buf, &len);
+        // Car is gonna disconnect -> unregister it and return
+        if (msg == NULL || handle_car_message(car, msg, len)) {
+            unregister_car(car);
             return;
         }
-        tokenize_message(msg, tokens, 4);
+    }
+}
+
+/**
+ * Returns 1 if the message is a (text or binary) CALL, 0 otherwise.
+ */
+int is_call_message(const char *msg, uint32_t len) {
+    return proto_is_binary(msg, len) || strncmp(msg, "CALL", 4) == 0;
+}
 
-        if (strncmp(tokens[0], "STATUS", MAX_STATUS_LENGTH) == 0) {
-            update_car_state(car, tokens[1], tokens[2], tokens[3]);
+/**
+ * Parses a text (CALL {source floor} {destination floor} [{request id}]) or binary CALL message from a call pad.
+ * The floors of a message which is not a valid call are set to NO_FLOOR.
+ */
+void parse_call_message(char *msg, uint32_t len, call_request_t *call) {
+    call->binary = proto_is_binary(msg, len);
+    call->source_floor = NO_FLOOR;
+    call->destination_floor = NO_FLOOR;
+    call->tagged = 0;
+    call->request_id = 0;
+
+    if (call->binary) {
+        proto_record rec;
+        if (proto_decode(msg, len, &rec) == 0 && rec.type == PROTO_CALL) {
+            call->source_floor = floor_is_valid(rec.floor) ? rec.floor : NO_FLOOR;
+            call->destination_floor = floor_is_valid(rec.other_floor) ? rec.other_floor : NO_FLOOR;
         }
-        free(msg);
+        call->tagged = proto_request_id(msg, len, &call->request_id) == 0;
+        return;
     }
+
+    char *tokens[5];
+    tokenize_message(msg, tokens, 5);
+    if (tokens[0] == NULL || strcmp(tokens[0], "CALL") != 0 || tokens[2] == NULL || tokens[4] != NULL) {
+        return;
+    }
+    if (tokens[3] != NULL) {
+        char *end = NULL;
+        unsigned long id = strtoul(tokens[3], &end, 10);
+        if (!isdigit((unsigned char) tokens[3][0]) || *end != '\0' || id > UINT32_MAX) {
+            return;
+        }
+        call->tagged = 1;
+        call->request_id = id;
+    }
+    call->source_floor = floor_parse(tokens[1]);
+    call->destination_floor = floor_parse(tokens[2]);
 }
 
 /**
  * Handles a client connection and branches off to the appropriate handler based on the message received.
+ * A call pad sending tagged calls keeps its connection, every following message is handled as a call.
  */
 void * handle_client(void *arg) {
     int clientfd = *((int *) arg);
     free(arg);
 
-    char *msg = receive_msg(clientfd);
+    // Every message of the connection is received into the same buffer
+    msg_buffer_t buf;
+    msg_buffer_init(&buf);
+    uint32_t len;
+    char *msg = receive_buffered(clientfd, &buf, &len);
+    uint64_t received_ns = now_ns();
     if (msg == NULL) {
-        if (shutdown(clientfd, SHUT_RDWR) == -1) {
+        msg_buffer_destroy(&buf);
+        client_thread_end(clientfd);
+        if (shutdown(clientfd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
             perror("shutdown()");
         }
         if (close(clientfd) == -1) {
@@ -376,22 +666,42 @@ void * handle_client(void *arg) {
         pthread_exit(NULL);
     }
 
-    char *tokens[4];
-    tokenize_message(msg, tokens, 4);
+    if (is_call_message(msg, len)) {
+        call_session_t session;
+        call_session_init(&session, clientfd, NULL);
+        call_request_t call;
+        parse_call_message(msg, len, &call);
+        int persistent = call.tagged;
 
-    if (strncmp(tokens[0], "CALL", 4) == 0) {
-        handle_call(clientfd, tokens[1], tokens[2]);
+        while (1) {
+            handle_call(&session, &call);
+            metrics_record(METRIC_CALL_LATENCY, now_ns() - received_ns);
+            if (!persistent) {
+                break;
+            }
+            msg = receive_buffered(clientfd, &buf, &len);
+            received_ns = now_ns();
+            if (msg == NULL) {
+                break;
+            }
+            parse_call_message(msg, len, &call);
+        }
+        pthread_mutex_destroy(&session.send_mutex);
     }
-    else if (strncmp(tokens[0], "CAR", 3) == 0) {
-        manage_car(clientfd, tokens[1], tokens[2], tokens[3]);
+    else if (strncmp(msg, "CAR", 3) == 0) {
+        char *tokens[5];
+        tokenize_message(msg, tokens, 5);
+        manage_car(clientfd, &buf, tokens[1], tokens[2], tokens[3], tokens[4]);
     }
     else {
         send_message(clientfd, "INVALID");
     }
     
-    free(msg);
+    msg_buffer_destroy(&buf);
+    client_thread_end(clientfd);
 
-    if (shutdown(clientfd, SHUT_RDWR) == -1) {
+    // The socket was shut down already if the controller is stopping
+    if (shutdown(clientfd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
         perror("shutdown()");
     }
     if (close(clientfd) == -1) {
@@ -401,42 +711,254 @@ void * handle_client(void *arg) {
     pthread_exit(NULL);
 }
 
-int main(void) {
-    listensockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listensockfd == -1) {
-        perror("socket()");
-        exit(EXIT_FAILURE);
+typedef struct call_job {
+    connection_t *conn;         // The connection of a one-shot call, detached from its reactor, NULL for tagged calls
+    call_session_t *session;    // The session of a tagged call, NULL for one-shot calls
+    call_request_t call;        // The parsed CALL
+    uint64_t received_ns;       // When the CALL message was received
+} call_job_t;
+
+/**
+ * Worker task handling a single CALL received by a reactor.
+ */
+void call_task(void *arg) {
+    call_job_t *job = arg;
+
+    if (job->conn != NULL) {
+        call_session_t session;
+        call_session_init(&session, job->conn->fd, NULL);
+        handle_call(&session, &job->call);
+        pthread_mutex_destroy(&session.send_mutex);
+        connection_close(job->conn);
+    } else {
+        handle_call(job->session, &job->call);
+        call_session_release(job->session);
     }
+    metrics_record(METRIC_CALL_LATENCY, now_ns() - job->received_ns);
+    free(job);
+}
 
-    // Don't terminate the program when writing to a closed socket
-    signal(SIGPIPE, SIG_IGN);
-    // Register signal handler for SIGINT (Ctrl + C)
-    signal(SIGINT, handle_sigint);
+/**
+ * Returns the pool that handles the call: the shared workers, or the shard of the bank serving both floors.
+ * Banks are spread round-robin over the shards. A call whose floors are not in one bank cannot be served by
+ * any car, it falls back to shard 0, which answers it with UNAVAILABLE (or INVALID) like any other such call.
+ */
+worker_pool_t * route_call(const call_request_t *call) {
+    if (shards == NULL) {
+        return &workers;
+    }
+    if (call->source_floor == NO_FLOOR || call->destination_floor == NO_FLOOR) {
+        return &shards[0];
+    }
+    const cv_snapshot_t *snapshot = cv_read_lock(&cars);
+    size_t bank = cv_floor_bank(snapshot, call->source_floor);
+    if (bank != cv_floor_bank(snapshot, call->destination_floor)) {
+        bank = 0;
+    }
+    cv_read_unlock(&cars);
+    return bank != 0 ? &shards[(bank - 1) % nshards] : &shards[0];
+}
 
-    int opt_enable = 1;
-    if (setsockopt(listensockfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
-        perror("setsockopt()");
+/**
+ * Hands a call received by a reactor over to the workers.
+ * One-shot calls take their connection out of the reactor, tagged calls keep it in a session.
+ * Returns the on_message result for the connection.
+ */
+int submit_call(connection_t *conn, char *msg, uint32_t len) {
+    call_job_t *job = malloc(sizeof(call_job_t));
+    if (job == NULL) {
+        perror("malloc()");
+        return REACTOR_CLOSE;
+    }
+    job->received_ns = now_ns();
+    parse_call_message(msg, len, &job->call);
+
+    // The first tagged call turns the connection into a session
+    if (conn->kind == 0 && job->call.tagged) {
+        call_session_t *session = malloc(sizeof(call_session_t));
+        if (session == NULL) {
+            perror("malloc()");
+            free(job);
+            return REACTOR_CLOSE;
+        }
+        call_session_init(session, conn->fd, conn);
+        conn->data = session;
+        conn->kind = CONN_CALL_SESSION;
+    }
+
+    if (conn->kind == CONN_CALL_SESSION) {
+        job->conn = NULL;
+        job->session = conn->data;
+        atomic_fetch_add(&job->session->refs, 1);
+        wp_submit(route_call(&job->call), call_task, job);
+        return REACTOR_KEEP;
+    }
+
+    job->conn = conn;
+    job->session = NULL;
+    reactor_detach(conn);
+    wp_submit(route_call(&job->call), call_task, job);
+    return REACTOR_DETACHED;
+}
+
+/**
+ * Handles a message received by a reactor.
+ * The first message decides whether the connection belongs to a call pad or a car,
+ * calls are handed over to the workers while cars stay on the reactor for their whole life.
+ */
+int on_message(connection_t *conn, char *msg, uint32_t len) {
+    // Car connection -> every message is an update from the car
+    if (conn->kind == CONN_CAR) {
+        int disconnect = handle_car_message(conn->data, msg, len);
+        return disconnect ? REACTOR_CLOSE : REACTOR_KEEP;
+    }
+
+    // Session connection -> every message is a call
+    if (conn->kind == CONN_CALL_SESSION || is_call_message(msg, len)) {
+        return submit_call(conn, msg, len);
+    }
+
+    if (strncmp(msg, "CAR", 3) == 0) {
+        char *tokens[5];
+        tokenize_message(msg, tokens, 5);
+        conn->data = register_car(conn->fd, tokens[1], tokens[2], tokens[3], tokens[4]);
+        conn->kind = CONN_CAR;
+        return conn->data != NULL ? REACTOR_KEEP : REACTOR_CLOSE;
+    }
+
+    send_message(conn->fd, "INVALID");
+    return REACTOR_CLOSE;
+}
+
+/**
+ * Unregisters the car or closes the call session when its connection is closed by a reactor.
+ */
+void on_close(connection_t *conn) {
+    if (conn->kind == CONN_CAR && conn->data != NULL) {
+        unregister_car(conn->data);
+    }
+    // Calls still in flight must not reply to the socket, which is about to be closed and reused
+    if (conn->kind == CONN_CALL_SESSION) {
+        call_session_t *session = conn->data;
+        pthread_mutex_lock(&session->send_mutex);
+        session->fd = -1;
+        pthread_mutex_unlock(&session->send_mutex);
+        call_session_release(session);
+    }
+}
+
+/**
+ * Sends the replies queued on a call session once its socket takes more bytes.
+ */
+int on_writable(connection_t *conn) {
+    if (conn->kind != CONN_CALL_SESSION) {
+        return REACTOR_KEEP;
+    }
+    call_session_t *session = conn->data;
+    int result = REACTOR_KEEP;
+    pthread_mutex_lock(&session->send_mutex);
+    if (session->fd == -1 || call_session_flush(session) == -1) {
+        // Dropped for not reading its replies
+        result = REACTOR_CLOSE;
+    }
+    else if (session->out_len == 0 && reactor_want_write(conn, 0) == -1) {
+        call_session_drop(session);
+        result = REACTOR_CLOSE;
+    }
+    pthread_mutex_unlock(&session->send_mutex);
+    return result;
+}
+
+void * reactor_thread(void *arg) {
+    reactor_run((reactor_t *) arg);
+    return NULL;
+}
+
+/**
+ * Starts the shards, each with a single dispatcher thread pinned to a CPU of its own (as long as there are enough CPUs).
+ */
+void start_shards(size_t count) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    shards = malloc(count * sizeof(worker_pool_t));
+    if (shards == NULL) {
+        perror("malloc()");
         exit(EXIT_FAILURE);
     }
+    for (size_t i = 0; i < count; i++) {
+        if (wp_init(&shards[i], 1) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        // Pinning is an optimization, a shard runs fine wherever the scheduler puts it
+        wp_pin(&shards[i], ncpus > 0 ? (int) (i % ncpus) : 0);
+    }
+    nshards = count;
+}
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(3000);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    
-    if (bind(listensockfd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
-        perror("bind()");
+/**
+ * Serves all connections with nreactors epoll event loops sharing the listening socket, each on a thread of its own.
+ * Calls are handled by a fixed pool of nworkers threads, or by the dispatcher threads of shard_count shards
+ * if shard_count is not 0.
+ */
+void run_event_loop(size_t nreactors, size_t nworkers, size_t shard_count) {
+    int flags = fcntl(listensockfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(listensockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl()");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(listensockfd, MAX_CLIENTS) == -1) {
-        perror("listen()");
+    if (shard_count > 0) {
+        start_shards(shard_count);
+    } else if (wp_init(&workers, nworkers) == -1) {
         exit(EXIT_FAILURE);
     }
 
-    cv_init(&cars);
+    const reactor_handlers_t handlers = { .on_message = on_message, .on_writable = on_writable, .on_close = on_close };
+    reactors = malloc(nreactors * sizeof(reactor_t));
+    reactor_threads = malloc(nreactors * sizeof(pthread_t));
+    if (reactors == NULL || reactor_threads == NULL) {
+        perror("malloc()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < nreactors; i++) {
+        if (reactor_init(&reactors[i], listensockfd, &handlers) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < nreactors; i++) {
+        int thread_create_result = pthread_create(&reactor_threads[i], NULL, reactor_thread, &reactors[i]);
+        if (thread_create_result != 0) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(thread_create_result));
+            exit(EXIT_FAILURE);
+        }
+    }
+    nreactors_running = nreactors;
+}
 
+/**
+ * Stops the event loops, then lets the workers answer the calls handed over to them already.
+ */
+void stop_event_loop(void) {
+    for (size_t i = 0; i < nreactors_running; i++) {
+        reactor_stop(&reactors[i]);
+    }
+    for (size_t i = 0; i < nreactors_running; i++) {
+        pthread_join(reactor_threads[i], NULL);
+    }
+    if (shards != NULL) {
+        for (size_t i = 0; i < nshards; i++) {
+            wp_destroy(&shards[i]);
+        }
+    } else {
+        wp_destroy(&workers);
+    }
+}
+
+/**
+ * Accepts connections and serves each one on a thread of its own, until the listening socket is shut down.
+ */
+void * accept_connections(void *arg) {
+    (void) arg;
     while (1) {
         int *clientfd = malloc(sizeof(*clientfd));
         if (clientfd == NULL) {
@@ -449,23 +971,269 @@ int main(void) {
 
         *clientfd = accept(listensockfd, (struct sockaddr *) &clientaddr, &clientaddr_len);
         if (*clientfd == -1) {
+            free(clientfd);
+            if (atomic_load(&shutting_down)) {
+                break;
+            }
             perror("accept()");
             continue;
         }
 
+        if (client_thread_begin(*clientfd) == -1) {
+            close(*clientfd);
+            free(clientfd);
+            continue;
+        }
         pthread_t thread_id;
         int thread_create_result = pthread_create(&thread_id, NULL, handle_client, (void *) clientfd);
         if (thread_create_result != 0) {
             fprintf(stderr, "pthread_create() failed: %s\n", strerror(thread_create_result));
+            client_thread_end(*clientfd);
             if (close(*clientfd) == -1) {
                 perror("close()");
             }
+            free(clientfd);
             continue;
         }
 
         pthread_detach(thread_id);
     }
+    return NULL;
+}
+
+/**
+ * Appends the metrics of the connected cars to the metrics endpoint's output.
+ */
+void write_car_metrics(FILE *out) {
+    fprintf(out, "# TYPE elevator_car_queue_depth gauge\n");
+    const cv_snapshot_t *snapshot = cv_read_lock(&cars);
+    for (size_t i = 0; i < snapshot->size; i++) {
+        queue_stats_t stats = queue_stats_snapshot(snapshot->data[i]);
+        fprintf(out, "elevator_car_queue_depth{car=\"%s\"} %zu\n", snapshot->data[i]->car_name, stats.nodes);
+    }
+    fprintf(out, "# TYPE elevator_car_queue_completion_ns gauge\n");
+    for (size_t i = 0; i < snapshot->size; i++) {
+        queue_stats_t stats = queue_stats_snapshot(snapshot->data[i]);
+        fprintf(out, "elevator_car_queue_completion_ns{car=\"%s\"} %lu\n", snapshot->data[i]->car_name,
+            (unsigned long) stats.completion_ns);
+    }
+    cv_read_unlock(&cars);
 
+    if (dispatch == DISPATCH_AUTO) {
+        traffic_pattern current = traffic_current();
+        fprintf(out, "# TYPE elevator_traffic_pattern gauge\n");
+        for (int pattern = 0; pattern < TRAFFIC_PATTERN_COUNT; pattern++) {
+            fprintf(out, "elevator_traffic_pattern{pattern=\"%s\"} %d\n", traffic_pattern_name(pattern),
+                (traffic_pattern) pattern == current);
+        }
+    }
+}
+
+/**
+ * Parses a positive count from a command line argument.
+ */
+size_t parse_count(const char *arg) {
+    char *end = NULL;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value <= 0) {
+        fprintf(stderr, "Invalid count: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+/**
+ * Parses a port number from a command line argument.
+ */
+uint16_t parse_port(const char *arg) {
+    size_t port = parse_count(arg);
+    if (port > 65535) {
+        fprintf(stderr, "Invalid port: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return port;
+}
+
+int main(int argc, char **argv) {
+    int event_loop = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nreactors = ncpus > 0 ? ncpus : 1;
+    size_t nworkers = nreactors;
+    size_t shard_count = 0;
+    long metrics_port = METRICS_DEFAULT_PORT;
+    uint16_t port = 3000;
+    uint16_t replication_port = 0;
+    uint16_t primary_port = 0;
+    const char *journal_dir = NULL;
+    int parking = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ed:F:j:m:p:Pr:R:s:w:")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (dispatch_mode_parse(optarg, &dispatch) == -1) {
+                fprintf(stderr, "Unknown dispatch mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            event_loop = 1;
+            break;
+        case 'F':
+            primary_port = parse_port(optarg);
+            break;
+        case 'j':
+            journal_dir = optarg;
+            break;
+        case 'm':
+            // 0 disables the metrics endpoint
+            metrics_port = strcmp(optarg, "0") == 0 ? 0 : parse_port(optarg);
+            break;
+        case 'p':
+            port = parse_port(optarg);
+            break;
+        case 'P':
+            parking = 1;
+            break;
+        case 'r':
+            nreactors = parse_count(optarg);
+            break;
+        case 'R':
+            replication_port = parse_port(optarg);
+            break;
+        case 's':
+            shard_count = parse_count(optarg);
+            break;
+        case 'w':
+            nworkers = parse_count(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-e] [-d queue|eta|group|auto] [-P] [-m metrics port] [-p port] [-r reactors] [-s shards] [-w workers]"
+                " [-R replication port] [-F primary's replication port] [-j journal directory]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (shard_count > 0 && !event_loop) {
+        fprintf(stderr, "Shards need the event loop mode (-e)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A standby gets its queues from the primary, which has its own journal
+    if (primary_port != 0 && journal_dir != NULL) {
+        fprintf(stderr, "A standby (-F) cannot have a journal (-j)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A standby only listens to the primary until it takes over
+    replica_init(&restored);
+    if (primary_port != 0) {
+        repl_follow(primary_port, &restored);
+        restore_ns = now_ns();
+        restore_reason = "takeover";
+    }
+
+    // SIGINT (Ctrl + C) is blocked in every thread from now on, the main thread waits for it and stops the others
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (journal_dir != NULL) {
+        if (journal_open(journal_dir, &restored) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        restore_ns = now_ns();
+        restore_reason = "restart";
+    }
+
+    listensockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listensockfd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Don't terminate the program when writing to a closed socket
+    signal(SIGPIPE, SIG_IGN);
+
+    int opt_enable = 1;
+    if (setsockopt(listensockfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Accepted sockets inherit TCP_NODELAY: FLOOR messages and replies must not wait for the ACK of the previous one
+    if (set_low_latency(listensockfd) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(listensockfd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(listensockfd, LISTEN_BACKLOG) == -1) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+
+    cv_init(&cars);
+    metrics_init();
+    cars.lock_wait = record_cars_lock_wait;
+    scheduler_hooks_t hooks = {
+        .now = now_ns, .send_floor = send_floor, .lock_wait = record_car_lock_wait,
+        .node_added = node_added, .head_removed = head_removed, .picked_up = record_call_wait,
+        .time_of_day = parking ? local_time_of_day : NULL, .traffic_changed = log_traffic_change
+    };
+    scheduler_init(&hooks, dispatch);
+    if (metrics_port != 0 && metrics_serve(metrics_port, write_car_metrics) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (replication_port != 0 && repl_serve(&cars, replication_port) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t acceptor_id;
+    if (event_loop) {
+        run_event_loop(nreactors, nworkers, shard_count);
+    } else {
+        int thread_create_result = pthread_create(&acceptor_id, NULL, accept_connections, NULL);
+        if (thread_create_result != 0) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(thread_create_result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int signal_number;
+    while (sigwait(&signals, &signal_number) != 0) {
+        // Only SIGINT is waited for
+    }
+
+    // Stop taking connections and calls, the threads still reading the cars finish first
+    atomic_store(&shutting_down, 1);
+    if (event_loop) {
+        stop_event_loop();
+    } else {
+        // Shutting the listening socket down wakes the acceptor up from accept()
+        shutdown(listensockfd, SHUT_RDWR);
+        pthread_join(acceptor_id, NULL);
+    }
+    metrics_stop();
+    repl_stop();
+    if (close(listensockfd) == -1) {
+        perror("close() failed");
+    }
+
+    print_call_latency();
+    print_pool_stats();
+
+    // The connection threads unregister their cars, the event loop's cars stay registered until cv_destroy()
+    stop_client_threads();
     cv_destroy(&cars);
-    close(listensockfd);
+    exit(EXIT_SUCCESS);
 }
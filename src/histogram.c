@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "histogram.h"
+
+static size_t hist_bucket_index( uint64_t value ) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HIST_SUB_BUCKET_BITS;
+    // (value >> shift) is in the range [HIST_SUB_BUCKETS, 2 * HIST_SUB_BUCKETS)
+    return (shift + 1) * HIST_SUB_BUCKETS + (value >> shift) - HIST_SUB_BUCKETS;
+}
+
+static uint64_t hist_bucket_upper_bound( size_t index ) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init( histogram_t *hist ) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        atomic_init(&hist->counts[i], 0);
+    }
+    atomic_init(&hist->total, 0);
+    atomic_init(&hist->sum, 0);
+    atomic_init(&hist->max, 0);
+}
+
+void hist_record( histogram_t *hist, uint64_t value ) {
+    atomic_fetch_add_explicit(&hist->counts[hist_bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+        // max was reloaded by the failed exchange -> try again
+    }
+}
+
+uint64_t hist_percentile( histogram_t *hist, double percentile ) {
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) (total * percentile / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t bound = hist_bucket_upper_bound(i);
+            uint64_t max = hist_max(hist);
+            return bound < max ? bound : max;
+        }
+    }
+    return hist_max(hist);
+}
+
+void hist_merge( histogram_t *dst, histogram_t *src ) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t count = atomic_load_explicit(&src->counts[i], memory_order_relaxed);
+        if (count != 0) {
+            atomic_fetch_add_explicit(&dst->counts[i], count, memory_order_relaxed);
+        }
+    }
+    atomic_fetch_add_explicit(&dst->total, atomic_load_explicit(&src->total, memory_order_relaxed), memory_order_relaxed);
+    atomic_fetch_add_explicit(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed), memory_order_relaxed);
+
+    uint64_t value = hist_max(src);
+    uint64_t max = atomic_load_explicit(&dst->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&dst->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+        // max was reloaded by the failed exchange -> try again
+    }
+}
+
+uint64_t hist_count( histogram_t *hist ) {
+    return atomic_load_explicit(&hist->total, memory_order_relaxed);
+}
+
+uint64_t hist_mean( histogram_t *hist ) {
+    uint64_t total = hist_count(hist);
+    return total == 0 ? 0 : atomic_load_explicit(&hist->sum, memory_order_relaxed) / total;
+}
+
+uint64_t hist_max( histogram_t *hist ) {
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+uint64_t now_ns( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
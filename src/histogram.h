@@ -0,0 +1,57 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Every power of two is split into 2^HIST_SUB_BUCKET_BITS linear sub-buckets,
+// which bounds the relative error of any recorded value to ~6%.
+#define HIST_SUB_BUCKET_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * A log-linear (HDR style) histogram of 64-bit values.
+ * Recording is a couple of relaxed atomic increments, so it can be shared between threads without locking.
+ */
+typedef struct histogram {
+    /// Number of values recorded into each bucket
+    _Atomic uint64_t counts[HIST_BUCKETS];
+
+    /// Total number of recorded values
+    _Atomic uint64_t total;
+
+    /// Sum of all recorded values
+    _Atomic uint64_t sum;
+
+    /// Largest recorded value
+    _Atomic uint64_t max;
+} histogram_t;
+
+void hist_init( histogram_t *hist );
+
+void hist_record( histogram_t *hist, uint64_t value );
+
+/**
+ * Returns the (upper bound of the) value below which the given percentage (0-100) of the recorded values fall.
+ */
+uint64_t hist_percentile( histogram_t *hist, double percentile );
+
+/**
+ * Adds all values recorded into src to dst.
+ */
+void hist_merge( histogram_t *dst, histogram_t *src );
+
+uint64_t hist_count( histogram_t *hist );
+
+uint64_t hist_mean( histogram_t *hist );
+
+uint64_t hist_max( histogram_t *hist );
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t now_ns( void );
+
+#endif
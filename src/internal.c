@@ -1,29 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include "shared.h"
 
-car_shared_mem* open_shared_memory(const char * share_name) {
-    int fd = shm_open(share_name, O_RDWR, 0666);
-    if (fd == -1) {
-        return NULL;
+/**
+ * Returns why the car cannot be moved up or down, NULL if it can.
+ */
+const char * check_service_move(uint8_t individual_service_mode, uint8_t status) {
+    if (!individual_service_mode) {
+        return "Operation only allowed in service mode.";
     }
-
-    car_shared_mem *shm = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (shm == MAP_FAILED) {
-        perror("mmap()");
-        close(fd);
-        return NULL;
+    if (status == STATUS_BETWEEN) {
+        return "Operation not allowed while elevator is moving.";
     }
-
-    close(fd);
-
-    return shm;
+    if (status != STATUS_CLOSED) {
+        return "Operation not allowed while doors are open.";
+    }
+    return NULL;
 }
 
 int main(int argc, char **argv) {
@@ -54,89 +47,81 @@ int main(int argc, char **argv) {
     }
 
     if (strcmp(argv[2], "open") == 0) {
-        pthread_mutex_lock(&shm->mutex);
+        shm_lock(shm);
         shm->open_button = 1;
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "close") == 0) {
-        pthread_mutex_lock(&shm->mutex);
+        shm_lock(shm);
         shm->close_button = 1;
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "stop") == 0) {
-        pthread_mutex_lock(&shm->mutex);
+        shm_lock(shm);
         shm->emergency_stop = 1;
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "service_on") == 0) {
-        pthread_mutex_lock(&shm->mutex);
+        shm_lock(shm);
         shm->individual_service_mode = 1;
         shm->emergency_mode = 0;
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "service_off") == 0) {
-        pthread_mutex_lock(&shm->mutex);
+        shm_lock(shm);
         shm->individual_service_mode = 0;
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "up") == 0) {
-        pthread_mutex_lock(&shm->mutex);
-
-        if (!shm->individual_service_mode) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation only allowed in service mode.\n");
-            exit(EXIT_FAILURE);
-        }
-        if (strcmp(shm->status, "Between") == 0) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation not allowed while elevator is moving.\n");
+        // Most refusals are decided without waiting for the car to release the mutex
+        car_snapshot_t snapshot;
+        shm_snapshot(shm, &snapshot);
+        const char *error = check_service_move(snapshot.individual_service_mode, snapshot.status);
+        if (error != NULL) {
+            printf("%s\n", error);
             exit(EXIT_FAILURE);
         }
-        if (strcmp(shm->status, "Closed") != 0) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation not allowed while doors are open.\n");
+
+        shm_lock(shm);
+        error = check_service_move(shm->individual_service_mode, shm->state.status);
+        if (error != NULL) {
+            shm_unlock(shm);
+            printf("%s\n", error);
             exit(EXIT_FAILURE);
         }
 
-        char floor[4];
-        strcpy(floor, shm->current_floor);
-        increment_floor(floor);
-        strcpy(shm->destination_floor, floor);
+        shm_set_destination_floor(shm, floor_next(shm->state.current_floor, UP));
 
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else if (strcmp(argv[2], "down") == 0) {
-        pthread_mutex_lock(&shm->mutex);
-
-        if (!shm->individual_service_mode) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation only allowed in service mode.\n");
+        // Most refusals are decided without waiting for the car to release the mutex
+        car_snapshot_t snapshot;
+        shm_snapshot(shm, &snapshot);
+        const char *error = check_service_move(snapshot.individual_service_mode, snapshot.status);
+        if (error != NULL) {
+            printf("%s\n", error);
             exit(EXIT_FAILURE);
         }
-        if (strcmp(shm->status, "Between") == 0) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation not allowed while elevator is moving.\n");
-            exit(EXIT_FAILURE);
-        }
-        if (strcmp(shm->status, "Closed") != 0) {
-            pthread_mutex_unlock(&shm->mutex);
-            printf("Operation not allowed while doors are open.\n");
+
+        shm_lock(shm);
+        error = check_service_move(shm->individual_service_mode, shm->state.status);
+        if (error != NULL) {
+            shm_unlock(shm);
+            printf("%s\n", error);
             exit(EXIT_FAILURE);
         }
 
-        char floor[4];
-        strcpy(floor, shm->current_floor);
-        decrement_floor(floor);
-        strcpy(shm->destination_floor, floor);
+        shm_set_destination_floor(shm, floor_next(shm->state.current_floor, DOWN));
 
-        pthread_cond_broadcast(&shm->cond);
-        pthread_mutex_unlock(&shm->mutex);
+        shm_broadcast(shm);
+        shm_unlock(shm);
     }
     else {
         printf("Invalid operation.\n");
@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared.h"
+#include "metrics.h"
+#include "queue_record.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x454c5651        // "ELVQ", the start of a snapshot
+#define SNAPSHOT_NAME "queues.snapshot"
+#define LOG_PREFIX "queues.log."
+
+/**
+ * A log of queue changes: length-prefixed records, followed by a zero length.
+ */
+typedef struct journal_log {
+    int fd;
+    char *map;                  // The whole file, mapped shared
+    size_t len;                 // Bytes of records
+    size_t capacity;            // Bytes of the file and the mapping
+    uint32_t generation;        // The log follows the snapshot of this generation
+} journal_log_t;
+
+static struct {
+    pthread_mutex_t mutex;      // Guards the log
+    journal_log_t log;
+    int dirfd;
+    queue_replica_t base;       // The queues as of the start of the log, only touched by the compactor after opening
+} journal = { .mutex = PTHREAD_MUTEX_INITIALIZER, .dirfd = -1 };
+
+static atomic_int opened;           // 1 once the journal logs changes
+
+static void log_name(char *name, size_t size, uint32_t generation) {
+    snprintf(name, size, LOG_PREFIX "%u", generation);
+}
+
+/**
+ * Creates the empty log of the generation. Returns 0 on success, -1 on failure.
+ */
+static int log_create(journal_log_t *log, uint32_t generation) {
+    char name[32];
+    log_name(name, sizeof(name), generation);
+    int fd = openat(journal.dirfd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open() of the journal log");
+        return -1;
+    }
+    // The file stays sparse until records are appended, its zeros mark the end of the records
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, JOURNAL_LOG_CAPACITY) == -1
+        || (map = mmap(NULL, JOURNAL_LOG_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("ftruncate()/mmap() of the journal log");
+        close(fd);
+        unlinkat(journal.dirfd, name, 0);
+        return -1;
+    }
+    // The new name must survive a crash as well as the records in the file
+    fsync(journal.dirfd);
+    log->fd = fd;
+    log->map = map;
+    log->len = 0;
+    log->capacity = JOURNAL_LOG_CAPACITY;
+    log->generation = generation;
+    return 0;
+}
+
+static void log_close(journal_log_t *log) {
+    munmap(log->map, log->capacity);
+    close(log->fd);
+}
+
+/**
+ * Doubles the size of the log. The journal's mutex must be held.
+ */
+static void log_grow(journal_log_t *log) {
+    size_t capacity = log->capacity * 2;
+    char *map = MAP_FAILED;
+    if (ftruncate(log->fd, capacity) == -1
+        || (map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0)) == MAP_FAILED) {
+        perror("ftruncate()/mmap() of the journal log");
+        exit(EXIT_FAILURE);
+    }
+    munmap(log->map, log->capacity);
+    log->map = map;
+    log->capacity = capacity;
+}
+
+/**
+ * Appends a record about the car to the log. The car's mutex must be held.
+ * The record lands in the page cache only, the compactor syncs it to disk.
+ */
+static void journal_append(qrec_type type, Car *car, uint32_t index, const QueueNode *node) {
+    // Unregistered cars are gone for the journal, even if a late call still lands on them
+    if (!atomic_load_explicit(&opened, memory_order_relaxed) || car->clientfd == -1) {
+        return;
+    }
+    size_t size = qrec_size(type, car);
+    pthread_mutex_lock(&journal.mutex);
+    journal_log_t *log = &journal.log;
+    // Leave room for the zero length ending the records
+    while (log->len + 2 * sizeof(uint32_t) + size > log->capacity) {
+        log_grow(log);
+    }
+    char *ptr = log->map + log->len;
+    qrec_encode(ptr + sizeof(uint32_t), type, car, index, node);
+    // The length goes last, so that a record cut short by a kill ends the records instead of being replayed
+    atomic_signal_fence(memory_order_release);
+    uint32_t nsize = htonl(size);
+    memcpy(ptr, &nsize, sizeof(nsize));
+    log->len += sizeof(uint32_t) + size;
+    pthread_mutex_unlock(&journal.mutex);
+    metrics_count(METRIC_JOURNAL_RECORDS, 1);
+}
+
+void journal_node_added(Car *car, const QueueNode *node) {
+    if (!atomic_load_explicit(&opened, memory_order_relaxed)) {
+        return;
+    }
+    journal_append(QREC_INSERT, car, qrec_node_index(car, node), node);
+}
+
+void journal_head_removed(Car *car) {
+    journal_append(QREC_POP, car, 0, NULL);
+}
+
+void journal_car_queue(Car *car) {
+    journal_append(QREC_QUEUE, car, 0, NULL);
+}
+
+void journal_car_removed(Car *car) {
+    journal_append(QREC_REMOVE, car, 0, NULL);
+}
+
+/**
+ * Replaces the snapshot with the queues of the replica, to be followed by the log of the generation.
+ * Returns the number of bytes written, or -1 on failure.
+ */
+static ssize_t snapshot_write(queue_replica_t *replica, uint32_t generation) {
+    int fd = openat(journal.dirfd, SNAPSHOT_NAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open() of the journal snapshot");
+        return -1;
+    }
+    uint32_t header[2] = { htonl(JOURNAL_MAGIC), htonl(generation) };
+    ssize_t written = -1;
+    if (send_looped(fd, header, sizeof(header)) == 0) {
+        written = replica_write(replica, fd);
+    }
+    // The old snapshot is only replaced by a complete new one
+    if (written == -1 || fsync(fd) == -1) {
+        perror("write() of the journal snapshot");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (renameat(journal.dirfd, SNAPSHOT_NAME ".tmp", journal.dirfd, SNAPSHOT_NAME) == -1) {
+        perror("rename() of the journal snapshot");
+        return -1;
+    }
+    fsync(journal.dirfd);
+    return written + sizeof(header);
+}
+
+/**
+ * Starts the next log and folds the current one into the snapshot.
+ */
+static void journal_compact(void) {
+    // Only the compactor changes the log's generation
+    journal_log_t next;
+    if (log_create(&next, journal.log.generation + 1) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&journal.mutex);
+    journal_log_t sealed = journal.log;
+    journal.log = next;
+    pthread_mutex_unlock(&journal.mutex);
+
+    uint64_t records = 0;
+    replica_apply_frames(&journal.base, sealed.map, sealed.len, &records);
+    // A sealed log which is not in a snapshot yet is replayed after the older snapshot on a restart
+    if (snapshot_write(&journal.base, next.generation) != -1) {
+        char name[32];
+        log_name(name, sizeof(name), sealed.generation);
+        unlinkat(journal.dirfd, name, 0);
+    }
+    log_close(&sealed);
+}
+
+/**
+ * Syncs the log every JOURNAL_SYNC_MS and compacts it once it exceeds JOURNAL_COMPACT_SIZE.
+ */
+static void * journal_compactor(void *arg) {
+    (void) arg;
+    while (1) {
+        usleep(JOURNAL_SYNC_MS * 1000);
+        // Only the compactor closes logs, the file stays open while it is synced without the mutex
+        pthread_mutex_lock(&journal.mutex);
+        int fd = journal.log.fd;
+        size_t len = journal.log.len;
+        pthread_mutex_unlock(&journal.mutex);
+        // Syncing the file writes back the dirty pages of its mapping
+        if (fdatasync(fd) == -1) {
+            perror("fdatasync() of the journal log");
+        }
+        if (len >= JOURNAL_COMPACT_SIZE) {
+            journal_compact();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Maps the file read-only. Returns the mapping, NULL if the file is empty or could not be mapped.
+ */
+static const char * map_file(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat()");
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        return NULL;
+    }
+    const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap()");
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * Applies the records of the snapshot to both replicas. Returns the generation of the log following the snapshot,
+ * 0 if there is no snapshot, -1 if the snapshot is unreadable. The size of the snapshot is stored in *bytes.
+ */
+static long snapshot_load(queue_replica_t *restored, size_t *bytes) {
+    *bytes = 0;
+    int fd = openat(journal.dirfd, SNAPSHOT_NAME, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("open() of the journal snapshot");
+        return -1;
+    }
+    size_t size = 0;
+    const char *map = map_file(fd, &size);
+    close(fd);
+    uint32_t header[2];
+    if (map == NULL || size < sizeof(header)) {
+        fprintf(stderr, "Unreadable journal snapshot\n");
+        return -1;
+    }
+    memcpy(header, map, sizeof(header));
+    if (ntohl(header[0]) != JOURNAL_MAGIC) {
+        fprintf(stderr, "Not a journal snapshot\n");
+        munmap((void *) map, size);
+        return -1;
+    }
+    uint64_t records = 0;
+    replica_apply_frames(&journal.base, map + sizeof(header), size - sizeof(header), &records);
+    replica_apply_frames(restored, map + sizeof(header), size - sizeof(header), &records);
+    munmap((void *) map, size);
+    *bytes = size;
+    return ntohl(header[1]);
+}
+
+/**
+ * Applies the records of the log of the generation to both replicas.
+ * Returns the number of bytes of records, -1 if there is no such log.
+ */
+static ssize_t log_load(queue_replica_t *restored, uint32_t generation) {
+    char name[32];
+    log_name(name, sizeof(name), generation);
+    int fd = openat(journal.dirfd, name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t size = 0;
+    const char *map = map_file(fd, &size);
+    close(fd);
+    if (map == NULL) {
+        return 0;
+    }
+    uint64_t records = 0;
+    size_t len = replica_apply_frames(&journal.base, map, size, &records);
+    replica_apply_frames(restored, map, size, &records);
+    munmap((void *) map, size);
+    return len;
+}
+
+/**
+ * Removes the logs preceding the generation.
+ */
+static void remove_old_logs(uint32_t generation) {
+    int fd = dup(journal.dirfd);
+    DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        perror("opendir() of the journal");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, LOG_PREFIX, strlen(LOG_PREFIX)) == 0
+            && strtoul(entry->d_name + strlen(LOG_PREFIX), NULL, 10) < generation) {
+            unlinkat(journal.dirfd, entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+int journal_open(const char *dir, queue_replica_t *restored) {
+    uint64_t start = now_ns();
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir() of the journal");
+        return -1;
+    }
+    journal.dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (journal.dirfd == -1) {
+        perror("open() of the journal");
+        return -1;
+    }
+    replica_init(&journal.base);
+
+    // The snapshot holds the queues as of its log, the logs from then on are replayed in order
+    size_t snapshot_bytes;
+    long generation = snapshot_load(restored, &snapshot_bytes);
+    if (generation == -1) {
+        return -1;
+    }
+    size_t log_bytes = 0;
+    ssize_t len;
+    while ((len = log_load(restored, generation)) != -1) {
+        log_bytes += len;
+        generation++;
+    }
+
+    // Start over with the replayed logs folded into the snapshot, so that the next restart does not replay them again
+    if (snapshot_write(&journal.base, generation) == -1 || log_create(&journal.log, generation) == -1) {
+        return -1;
+    }
+    remove_old_logs(generation);
+
+    pthread_t thread_id;
+    int result = pthread_create(&thread_id, NULL, journal_compactor, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(result));
+        return -1;
+    }
+    pthread_detach(thread_id);
+    atomic_store(&opened, 1);
+
+    size_t cars;
+    size_t nodes = replica_nodes(restored, &cars);
+    printf("Journal replayed %zu bytes of snapshot and %zu bytes of log in %.1f ms, restoring the queues of %zu cars "
+        "with %zu stops\n", snapshot_bytes, log_bytes, (now_ns() - start) / 1e6, cars, nodes);
+    fflush(stdout);
+    return 0;
+}
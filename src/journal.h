@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "car_vector.h"
+#include "queue_record.h"
+
+/*
+ * Journal of the cars' queues, letting a restarted controller continue with the queues it had.
+ * Every change to a queue is appended to a memory-mapped log (queues.log.<generation>) without waiting for the disk,
+ * the log is synced every JOURNAL_SYNC_MS. Once a log exceeds JOURNAL_COMPACT_SIZE, a background thread starts the
+ * next one and folds the previous one into a snapshot of all queues (queues.snapshot), so that a restart only replays
+ * the snapshot and the latest log.
+ * A kill loses nothing appended before it, a crash of the host loses at most the last JOURNAL_SYNC_MS of changes.
+ */
+
+#define JOURNAL_SYNC_MS 100                         // How often the log is synced to disk
+#define JOURNAL_COMPACT_SIZE (1024 * 1024)          // Bytes of log after which the log is folded into the snapshot
+#define JOURNAL_LOG_CAPACITY (16 * 1024 * 1024)     // Bytes a log is created with, it grows if it fills up
+
+/**
+ * Opens the journal in the directory, which is created if needed.
+ * The queues found in the journal are rebuilt in the replica, cars registering afterwards get their queue back with
+ * replica_restore(). Returns 0 on success, -1 on failure.
+ */
+int journal_open( const char *dir, queue_replica_t *restored );
+
+/**
+ * Logs the node which was just linked into the car's queue. The car's mutex must be held.
+ * Does nothing without an open journal, like all logging functions.
+ */
+void journal_node_added( Car *car, const QueueNode *node );
+
+/**
+ * Logs the removal of the head of the car's queue. The car's mutex must be held.
+ */
+void journal_head_removed( Car *car );
+
+/**
+ * Logs the whole queue of a car which just registered. The car's mutex must be held.
+ */
+void journal_car_queue( Car *car );
+
+/**
+ * Logs the removal of a car which disconnected. The car's mutex must be held.
+ */
+void journal_car_removed( Car *car );
+
+#endif
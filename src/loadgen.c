@@ -0,0 +1,501 @@
+/*
+ * Load generator for finding the controller's saturation point.
+ * Registers fake cars, which move through floors and doors on a short delay and answer every FLOOR
+ * with the STATUS stream a real car would send, then makes calls from a number of persistent call pad
+ * connections, either in closed loop (a window of calls in flight per connection) or open loop
+ * (at a fixed total rate, latency counted from when a call was due so that a stalled controller
+ * cannot hide its queueing delay).
+ * Needs a running controller, `make bench-controller` starts one and runs a fixed set of loads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "shared.h"
+#include "protocol.h"
+#include "histogram.h"
+#include "call_client.h"
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_CARS 8
+#define DEFAULT_FLOORS 20
+#define DEFAULT_SECONDS 5
+#define DEFAULT_CAR_DELAY_MS 5
+#define MAX_IN_FLIGHT 4096          // Calls a connection may have in flight, a power of two
+#define IDLE_POLL_MS 50             // How often idle fake cars check whether the run is over
+#define RECEIVE_TIMEOUT_S 2         // Give up on replies which do not arrive after the run
+
+/**
+ * A car registered with the controller which moves like car.c, only without shared memory.
+ */
+typedef struct fake_car {
+    char name[22];                  // "L" and the car's number
+    call_client_t conn;             // The car's connection, opened like a call pad's
+    int binary;                     // 1 once the controller accepted the binary protocol
+    car_status status;
+    floor_t current_floor;
+    floor_t destination_floor;
+    int open_requested;             // FLOOR for the current floor arrived while the doors were open
+    uint64_t next_step_ns;          // When the current movement finishes, 0 if the car rests
+    size_t floors_received;
+    size_t statuses_sent;
+    pthread_t thread;
+} fake_car_t;
+
+/**
+ * A call pad connection and the send times of its calls in flight, indexed by request id.
+ */
+typedef struct caller {
+    call_client_t client;
+    unsigned seed;
+    uint64_t sent_ns[MAX_IN_FLIGHT];
+    atomic_size_t sent;
+    atomic_size_t received;
+    pthread_t sender;
+    pthread_t receiver;
+} caller_t;
+
+static int binary;
+static int floors = DEFAULT_FLOORS;  // Floors per bank
+static int banks = 1;               // Banks of cars with disjoint floor ranges, bank b serves floors b * floors + 1 and up
+static uint64_t car_delay_ns = DEFAULT_CAR_DELAY_MS * 1000000ULL;
+static size_t window = 1;           // Calls in flight per connection in closed loop
+static double rate;                 // Calls per second over all connections in open loop, 0 for closed loop
+static size_t nconnections = DEFAULT_CONNECTIONS;
+
+static atomic_int calling = 1;      // Cleared when the callers should stop making new calls
+static atomic_int cars_running = 1; // Cleared when the fake cars should disconnect
+
+static histogram_t latency;
+static _Atomic uint64_t replies[3];     // Indexed by call_result
+static atomic_size_t backlogged;        // Open loop calls sent late because MAX_IN_FLIGHT were in flight
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now) {
+        struct timespec ts = { .tv_sec = (deadline - now) / 1000000000ULL, .tv_nsec = (deadline - now) % 1000000000ULL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void fake_car_send_status(fake_car_t *car) {
+    int result;
+    if (car->binary) {
+        proto_record rec = { .type = PROTO_STATUS, .status = car->status,
+            .floor = car->current_floor, .other_floor = car->destination_floor };
+        result = send_record(car->conn.fd, &rec);
+    } else {
+        char msg[32];
+        snprintf(msg, sizeof(msg), "STATUS %s %s %s", status_to_string(car->status),
+            floor_name(car->current_floor), floor_name(car->destination_floor));
+        result = send_message(car->conn.fd, msg);
+    }
+    if (result != -1) {
+        car->statuses_sent++;
+    }
+}
+
+static void fake_car_set_status(fake_car_t *car, car_status status) {
+    car->status = status;
+    fake_car_send_status(car);
+}
+
+/**
+ * Starts the next movement of a car whose doors just closed, like car.c's main loop.
+ */
+static void fake_car_next_movement(fake_car_t *car, uint64_t now) {
+    car->next_step_ns = 0;
+    if (car->open_requested) {
+        car->open_requested = 0;
+        fake_car_set_status(car, STATUS_OPENING);
+        car->next_step_ns = now + car_delay_ns;
+    } else if (car->destination_floor != car->current_floor) {
+        fake_car_set_status(car, STATUS_BETWEEN);
+        car->next_step_ns = now + car_delay_ns;
+    }
+}
+
+static void fake_car_step(fake_car_t *car, uint64_t now) {
+    car->next_step_ns = now + car_delay_ns;
+    switch (car->status) {
+    case STATUS_BETWEEN:
+        if (car->current_floor != car->destination_floor) {
+            car->current_floor = floor_next(car->current_floor, car->current_floor < car->destination_floor ? UP : DOWN);
+        }
+        if (car->current_floor != car->destination_floor) {
+            fake_car_send_status(car);
+            break;
+        }
+        // Arrived -> the doors open right away
+        fake_car_set_status(car, STATUS_OPENING);
+        break;
+    case STATUS_OPENING:
+        fake_car_set_status(car, STATUS_OPEN);
+        break;
+    case STATUS_OPEN:
+        fake_car_set_status(car, STATUS_CLOSING);
+        break;
+    case STATUS_CLOSING:
+        fake_car_set_status(car, STATUS_CLOSED);
+        fake_car_next_movement(car, now);
+        break;
+    default:
+        car->next_step_ns = 0;
+        break;
+    }
+}
+
+static void fake_car_floor(fake_car_t *car, floor_t floor, uint64_t now) {
+    car->floors_received++;
+    if (floor == car->current_floor && car->status != STATUS_BETWEEN) {
+        if (car->status == STATUS_OPENING || car->status == STATUS_OPEN) {
+            car->open_requested = 1;
+            return;
+        }
+        fake_car_set_status(car, STATUS_OPENING);
+        car->next_step_ns = now + car_delay_ns;
+        return;
+    }
+    car->destination_floor = floor;
+    fake_car_send_status(car);
+    if (car->status == STATUS_CLOSED && car->next_step_ns == 0) {
+        fake_car_next_movement(car, now);
+    }
+}
+
+/**
+ * Handles a message from the controller. Returns -1 if the controller hung up, 0 otherwise.
+ */
+static int fake_car_receive(fake_car_t *car) {
+    uint32_t len;
+    char *msg = receive_frame(car->conn.fd, &len);
+    if (msg == NULL) {
+        return -1;
+    }
+    proto_record rec;
+    if (proto_decode(msg, len, &rec) == 0) {
+        if (rec.type == PROTO_ACCEPT) {
+            car->binary = 1;
+        } else if (rec.type == PROTO_FLOOR && floor_is_valid(rec.floor)) {
+            fake_car_floor(car, rec.floor, now_ns());
+        }
+    } else {
+        char *tokens[2];
+        tokenize_message(msg, tokens, 2);
+        if (tokens[0] != NULL && tokens[1] != NULL && strcmp(tokens[0], "FLOOR") == 0 && floor_parse(tokens[1]) != NO_FLOOR) {
+            fake_car_floor(car, floor_parse(tokens[1]), now_ns());
+        }
+    }
+    free(msg);
+    return 0;
+}
+
+static void * fake_car_thread(void *arg) {
+    fake_car_t *car = arg;
+    while (atomic_load(&cars_running)) {
+        uint64_t now = now_ns();
+        if (car->next_step_ns != 0 && car->next_step_ns <= now) {
+            fake_car_step(car, now);
+            continue;
+        }
+        int timeout = IDLE_POLL_MS;
+        // Round up, waking up early would only spin
+        if (car->next_step_ns != 0 && (car->next_step_ns - now + 999999) / 1000000 < IDLE_POLL_MS) {
+            timeout = (car->next_step_ns - now + 999999) / 1000000;
+        }
+        struct pollfd pfd = { .fd = car->conn.fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == 1 && fake_car_receive(car) == -1) {
+            fprintf(stderr, "Car %s: the controller hung up\n", car->name);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Connects and registers the car in its bank, starting at the bank's lowest floor. Returns 0 on success, -1 otherwise.
+ */
+static int fake_car_start(fake_car_t *car, size_t index) {
+    floor_t lowest_floor = 1 + (index % banks) * floors;
+    memset(car, 0, sizeof(*car));
+    snprintf(car->name, sizeof(car->name), "L%zu", index + 1);
+    car->status = STATUS_CLOSED;
+    car->current_floor = lowest_floor;
+    car->destination_floor = lowest_floor;
+
+    // Cars register on the same port as call pads
+    if (cc_connect(&car->conn, 0) == -1) {
+        return -1;
+    }
+    char msg[64];
+    snprintf(msg, sizeof(msg), "CAR %s %s %s%s", car->name, floor_name(lowest_floor),
+        floor_name(lowest_floor + floors - 1), binary ? " " PROTO_OFFER : "");
+    if (send_message(car->conn.fd, msg) == -1) {
+        return -1;
+    }
+    fake_car_send_status(car);
+    return pthread_create(&car->thread, NULL, fake_car_thread, car) == 0 ? 0 : -1;
+}
+
+static void random_call(caller_t *caller, floor_t *source_floor, floor_t *destination_floor) {
+    int bank = rand_r(&caller->seed) % banks;
+    int source = rand_r(&caller->seed) % floors;
+    int destination = (source + 1 + rand_r(&caller->seed) % (floors - 1)) % floors;
+    *source_floor = 1 + bank * floors + source;
+    *destination_floor = 1 + bank * floors + destination;
+}
+
+/**
+ * Sends a call due at due_ns. Returns 0 on success, -1 otherwise.
+ */
+static int caller_send(caller_t *caller, uint64_t due_ns) {
+    floor_t source_floor, destination_floor;
+    uint32_t request_id;
+    random_call(caller, &source_floor, &destination_floor);
+    // The slot is free, the call which used it last has been answered
+    caller->sent_ns[caller->client.next_id % MAX_IN_FLIGHT] = due_ns;
+    if (cc_send_call(&caller->client, source_floor, destination_floor, &request_id) == -1) {
+        return -1;
+    }
+    atomic_fetch_add(&caller->sent, 1);
+    return 0;
+}
+
+/**
+ * Waits for the next reply and records it. Returns 0 on success, -1 otherwise.
+ */
+static int caller_receive(caller_t *caller) {
+    call_reply_t reply;
+    if (cc_receive_reply(&caller->client, &reply) == -1) {
+        return -1;
+    }
+    hist_record(&latency, now_ns() - caller->sent_ns[reply.request_id % MAX_IN_FLIGHT]);
+    atomic_fetch_add(&replies[reply.result], 1);
+    atomic_fetch_add(&caller->received, 1);
+    return 0;
+}
+
+/**
+ * Closed loop: keeps the window full, sending the next call as soon as a reply arrives.
+ */
+static void * closed_loop_thread(void *arg) {
+    caller_t *caller = arg;
+    while (1) {
+        while (atomic_load(&calling) && atomic_load(&caller->sent) - atomic_load(&caller->received) < window) {
+            if (caller_send(caller, now_ns()) == -1) {
+                return NULL;
+            }
+        }
+        if (atomic_load(&caller->sent) == atomic_load(&caller->received) || caller_receive(caller) == -1) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Open loop: sends the connection's share of the rate on schedule, whether replies come back or not.
+ */
+static void * open_loop_sender(void *arg) {
+    caller_t *caller = arg;
+    uint64_t interval = (uint64_t) (1e9 * nconnections / rate);
+    // Spread the connections over the interval
+    uint64_t due = now_ns() + rand_r(&caller->seed) % (interval + 1);
+    while (atomic_load(&calling)) {
+        sleep_until(due);
+        if (atomic_load(&caller->sent) - atomic_load(&caller->received) >= MAX_IN_FLIGHT) {
+            atomic_fetch_add(&backlogged, 1);
+            sleep_until(now_ns() + interval);
+            continue;
+        }
+        if (caller_send(caller, due) == -1) {
+            break;
+        }
+        due += interval;
+    }
+    return NULL;
+}
+
+static void * open_loop_receiver(void *arg) {
+    caller_t *caller = arg;
+    while (atomic_load(&calling) || atomic_load(&caller->received) < atomic_load(&caller->sent)) {
+        if (caller_receive(caller) == -1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void print_report(uint64_t elapsed_ns, fake_car_t *cars, size_t ncars) {
+    uint64_t total = replies[CALL_ASSIGNED] + replies[CALL_UNAVAILABLE] + replies[CALL_INVALID];
+    if (rate > 0) {
+        printf("Open loop at %.0f calls/s", rate);
+    } else {
+        printf("Closed loop, window %zu", window);
+    }
+    printf(", %zu connections, %s, %zu cars", nconnections, binary ? "binary" : "text", ncars);
+    if (banks > 1) {
+        printf(" in %d banks", banks);
+    }
+    printf("\n");
+    printf("Calls: %lu (%.0f/s), assigned %lu, unavailable %lu, invalid %lu",
+        (unsigned long) total, total / (elapsed_ns / 1e9), (unsigned long) replies[CALL_ASSIGNED],
+        (unsigned long) replies[CALL_UNAVAILABLE], (unsigned long) replies[CALL_INVALID]);
+    if (backlogged > 0) {
+        printf(", %zu late (%d in flight)", (size_t) backlogged, MAX_IN_FLIGHT);
+    }
+    printf("\nReply latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        hist_percentile(&latency, 50.0) / 1000.0,
+        hist_percentile(&latency, 99.0) / 1000.0,
+        hist_percentile(&latency, 99.9) / 1000.0,
+        hist_max(&latency) / 1000.0);
+
+    size_t floors_received = 0;
+    size_t statuses_sent = 0;
+    for (size_t i = 0; i < ncars; i++) {
+        floors_received += cars[i].floors_received;
+        statuses_sent += cars[i].statuses_sent;
+    }
+    printf("Cars: %zu FLOOR received, %zu STATUS sent\n", floors_received, statuses_sent);
+}
+
+static size_t parse_count(const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end != '\0' || value < 0) {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+/**
+ * Parses a number of banks or floors, which cannot exceed the MAX_FLOOR floors a building has.
+ */
+static int parse_floor_count(const char *arg) {
+    size_t value = parse_count(arg);
+    if (value > MAX_FLOOR) {
+        fprintf(stderr, "At most %d floors in all banks: %s\n", MAX_FLOOR, arg);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    size_t ncars = DEFAULT_CARS;
+    size_t seconds = DEFAULT_SECONDS;
+    unsigned seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bB:c:C:D:f:r:s:t:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = 1;
+            break;
+        case 'B':
+            banks = parse_floor_count(optarg);
+            break;
+        case 'c':
+            nconnections = parse_count(optarg);
+            break;
+        case 'C':
+            ncars = parse_count(optarg);
+            break;
+        case 'D':
+            car_delay_ns = parse_count(optarg) * 1000000ULL;
+            break;
+        case 'f':
+            floors = parse_floor_count(optarg);
+            break;
+        case 'r':
+            rate = parse_count(optarg);
+            break;
+        case 's':
+            seed = parse_count(optarg);
+            break;
+        case 't':
+            seconds = parse_count(optarg);
+            break;
+        case 'w':
+            window = parse_count(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b] [-B banks] [-c connections] [-C cars] [-D car delay ms] [-f floors per bank] "
+                "[-r calls per second | -w window] [-s seed] [-t seconds]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nconnections == 0 || window == 0 || window > MAX_IN_FLIGHT || banks == 0 || floors < 2 || banks * floors > MAX_FLOOR) {
+        fprintf(stderr, "Need at least one connection, a window of 1 to %d and 2 to %d floors in all banks\n", MAX_IN_FLIGHT, MAX_FLOOR);
+        exit(EXIT_FAILURE);
+    }
+    hist_init(&latency);
+
+    fake_car_t *cars = calloc(ncars, sizeof(fake_car_t));
+    caller_t *callers = calloc(nconnections, sizeof(caller_t));
+    if ((ncars > 0 && cars == NULL) || callers == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < ncars; i++) {
+        if (fake_car_start(&cars[i], i) == -1) {
+            fprintf(stderr, "Registering car %zu failed, is the controller running?\n", i + 1);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Let the controller register the cars before calls arrive
+    usleep(100000);
+
+    for (size_t i = 0; i < nconnections; i++) {
+        caller_t *caller = &callers[i];
+        if (cc_connect(&caller->client, binary) == -1) {
+            fprintf(stderr, "Connecting call pad %zu failed, is the controller running?\n", i + 1);
+            exit(EXIT_FAILURE);
+        }
+        struct timeval timeout = { .tv_sec = RECEIVE_TIMEOUT_S };
+        setsockopt(caller->client.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        caller->seed = seed + i;
+        atomic_init(&caller->sent, 0);
+        atomic_init(&caller->received, 0);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nconnections; i++) {
+        caller_t *caller = &callers[i];
+        int result = rate > 0
+            ? pthread_create(&caller->sender, NULL, open_loop_sender, caller)
+                | pthread_create(&caller->receiver, NULL, open_loop_receiver, caller)
+            : pthread_create(&caller->sender, NULL, closed_loop_thread, caller);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sleep(seconds);
+    atomic_store(&calling, 0);
+    for (size_t i = 0; i < nconnections; i++) {
+        pthread_join(callers[i].sender, NULL);
+        if (rate > 0) {
+            pthread_join(callers[i].receiver, NULL);
+        }
+        cc_close(&callers[i].client);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    atomic_store(&cars_running, 0);
+    for (size_t i = 0; i < ncars; i++) {
+        pthread_join(cars[i].thread, NULL);
+        cc_close(&cars[i].conn);
+    }
+    print_report(elapsed, cars, ncars);
+    free(cars);
+    free(callers);
+    return 0;
+}
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "shared.h"
+#include "metrics.h"
+
+// Exposition names, indexed by metric_counter and metric_histogram
+static const char *COUNTER_NAMES[METRIC_COUNTER_COUNT] = {
+    "elevator_calls_total",
+    "elevator_calls_unavailable_total",
+    "elevator_calls_invalid_total",
+    "elevator_status_messages_total",
+    "elevator_car_connects_total",
+    "elevator_car_reconnects_total",
+    "elevator_replication_records_total",
+    "elevator_replication_bytes_total",
+    "elevator_journal_records_total",
+    "elevator_traffic_pattern_changes_total"
+};
+static const char *HISTOGRAM_NAMES[METRIC_HISTOGRAM_COUNT] = {
+    "elevator_call_latency_ns",
+    "elevator_choose_car_ns",
+    "elevator_schedule_floors_ns",
+    "elevator_car_lock_wait_ns",
+    "elevator_cars_lock_wait_ns",
+    "elevator_replication_encode_ns",
+    "elevator_call_wait_ns"
+};
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// How long a scraper may take to send its request or to take the response before it is dropped
+#define SCRAPE_TIMEOUT_MS 1000
+
+static _Atomic(metrics_shard_t *) shards;   // All shards ever created
+static pthread_key_t shard_key;             // The calling thread's shard
+
+static void (*serve_write_extra)( FILE *out );
+static int serve_fd = -1;                   // The endpoint's listening socket, -1 if it is not served
+static pthread_t serve_thread;
+static atomic_int serve_stopping;           // 1 once metrics_stop() shut the listening socket down
+static uint64_t start_ns;
+
+/**
+ * Releases the shard of a finished thread for reuse. Its counts stay in place.
+ */
+static void metrics_release_shard( void *arg ) {
+    metrics_shard_t *shard = arg;
+    atomic_store(&shard->in_use, 0);
+}
+
+void metrics_init( void ) {
+    atomic_init(&shards, NULL);
+    pthread_key_create(&shard_key, metrics_release_shard);
+    start_ns = now_ns();
+}
+
+/**
+ * Returns the calling thread's shard, claiming an unused one or creating a new one on the first call.
+ */
+static metrics_shard_t * metrics_shard( void ) {
+    metrics_shard_t *shard = pthread_getspecific(shard_key);
+    if (shard != NULL) {
+        return shard;
+    }
+
+    for (shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&shard->in_use, &unused, 1)) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        shard = malloc(sizeof(metrics_shard_t));
+        if (shard == NULL) {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+            atomic_init(&shard->counters[i], 0);
+        }
+        for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+            hist_init(&shard->histograms[i]);
+        }
+        atomic_init(&shard->in_use, 1);
+        shard->next = atomic_load(&shards);
+        while (!atomic_compare_exchange_weak(&shards, &shard->next, shard));
+    }
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+void metrics_count( metric_counter counter, uint64_t n ) {
+    atomic_fetch_add_explicit(&metrics_shard()->counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_record( metric_histogram histogram, uint64_t value ) {
+    hist_record(&metrics_shard()->histograms[histogram], value);
+}
+
+uint64_t metrics_counter_total( metric_counter counter ) {
+    uint64_t total = 0;
+    for (metrics_shard_t *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+void metrics_histogram_merge( metric_histogram histogram, histogram_t *out ) {
+    for (metrics_shard_t *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+        hist_merge(out, &shard->histograms[histogram]);
+    }
+}
+
+void metrics_write( FILE *out ) {
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(out, "# TYPE %s counter\n%s %lu\n", COUNTER_NAMES[i], COUNTER_NAMES[i],
+            (unsigned long) metrics_counter_total(i));
+    }
+
+    histogram_t *hist = malloc(sizeof(histogram_t));
+    if (hist == NULL) {
+        perror("malloc()");
+        return;
+    }
+    for (size_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const char *name = HISTOGRAM_NAMES[i];
+        hist_init(hist);
+        metrics_histogram_merge(i, hist);
+
+        fprintf(out, "# TYPE %s summary\n", name);
+        for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+            fprintf(out, "%s{quantile=\"%g\"} %lu\n", name, QUANTILES[q],
+                (unsigned long) hist_percentile(hist, QUANTILES[q] * 100.0));
+        }
+        fprintf(out, "%s_sum %lu\n%s_count %lu\n", name, (unsigned long) atomic_load(&hist->sum),
+            name, (unsigned long) hist_count(hist));
+        fprintf(out, "# TYPE %s_max gauge\n%s_max %lu\n", name, name, (unsigned long) hist_max(hist));
+    }
+    free(hist);
+}
+
+/**
+ * Writes the rate of STATUS messages since the previous scrape (or since the start for the first one).
+ */
+static void metrics_write_status_rate( FILE *out ) {
+    static uint64_t last_ns;
+    static uint64_t last_total;
+
+    uint64_t now = now_ns();
+    uint64_t total = metrics_counter_total(METRIC_STATUS);
+    uint64_t since = last_ns != 0 ? last_ns : start_ns;
+    double rate = now > since ? (total - last_total) / ((now - since) / 1e9) : 0.0;
+    last_ns = now;
+    last_total = total;
+
+    fprintf(out, "# TYPE elevator_status_messages_per_second gauge\nelevator_status_messages_per_second %.1f\n", rate);
+}
+
+/**
+ * Answers every connection with the current metrics, whatever it asked for.
+ */
+static void * metrics_thread( void *arg ) {
+    int listenfd = *((int *) arg);
+    free(arg);
+
+    while (1) {
+        int clientfd = accept(listenfd, NULL, NULL);
+        if (clientfd == -1) {
+            if (atomic_load(&serve_stopping)) {
+                break;
+            }
+            if (errno != EINTR) {
+                perror("accept()");
+            }
+            continue;
+        }
+
+        // The endpoint serves one scraper at a time -> a scraper which stalls must not hold up the others for long
+        struct timeval timeout = { .tv_sec = SCRAPE_TIMEOUT_MS / 1000, .tv_usec = SCRAPE_TIMEOUT_MS % 1000 * 1000 };
+        if (setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+                || setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+            perror("setsockopt()");
+            close(clientfd);
+            continue;
+        }
+
+        // Drain the request, a scraper sends a single small HTTP request
+        char request[1024];
+        if (read(clientfd, request, sizeof(request)) == -1) {
+            // Timed out -> the scraper sent nothing, drop it
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("read()");
+            }
+            close(clientfd);
+            continue;
+        }
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out == NULL) {
+            perror("open_memstream()");
+            close(clientfd);
+            continue;
+        }
+        metrics_write(out);
+        metrics_write_status_rate(out);
+        if (serve_write_extra != NULL) {
+            serve_write_extra(out);
+        }
+        fclose(out);
+
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+        if (send_looped(clientfd, header, header_len) == -1 || send_looped(clientfd, body, body_len) == -1) {
+            perror("write()");
+        }
+        free(body);
+        close(clientfd);
+    }
+    return NULL;
+}
+
+int metrics_serve( uint16_t port, void (*write_extra)( FILE *out ) ) {
+    serve_write_extra = write_extra;
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    int opt_enable = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+        close(listenfd);
+        return -1;
+    }
+
+    // Metrics are for local scrapers only
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenfd, SOMAXCONN) == -1) {
+        perror("bind()/listen() for metrics");
+        close(listenfd);
+        return -1;
+    }
+
+    int *arg = malloc(sizeof(int));
+    if (arg == NULL) {
+        perror("malloc()");
+        close(listenfd);
+        return -1;
+    }
+    *arg = listenfd;
+    int result = pthread_create(&serve_thread, NULL, metrics_thread, arg);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(result));
+        free(arg);
+        close(listenfd);
+        return -1;
+    }
+    serve_fd = listenfd;
+    return 0;
+}
+
+void metrics_stop( void ) {
+    if (serve_fd == -1) {
+        return;
+    }
+    // Shutting the listening socket down wakes the thread up from accept()
+    atomic_store(&serve_stopping, 1);
+    shutdown(serve_fd, SHUT_RDWR);
+    pthread_join(serve_thread, NULL);
+    close(serve_fd);
+    serve_fd = -1;
+}
@@ -0,0 +1,87 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include "histogram.h"
+
+#define METRICS_DEFAULT_PORT 3001
+
+typedef enum {
+    METRIC_CALLS,               // CALL messages received
+    METRIC_UNAVAILABLE,         // Calls answered with UNAVAILABLE
+    METRIC_INVALID,             // Calls answered with INVALID
+    METRIC_STATUS,              // STATUS messages received from cars
+    METRIC_CAR_CONNECTS,        // Cars registered
+    METRIC_CAR_RECONNECTS,      // Cars registered under a name which was registered before
+    METRIC_REPL_RECORDS,        // Records streamed to the standby
+    METRIC_REPL_BYTES,          // Bytes streamed to the standby
+    METRIC_JOURNAL_RECORDS,     // Records appended to the journal
+    METRIC_TRAFFIC_CHANGES,     // Switches of the traffic pattern in the automatic dispatch mode
+    METRIC_COUNTER_COUNT
+} metric_counter;
+
+typedef enum {
+    METRIC_CALL_LATENCY,        // Time from receiving a CALL to replying to it
+    METRIC_CHOOSE_CAR,          // Time spent in choose_car()
+    METRIC_SCHEDULE_FLOORS,     // Time spent in schedule_floors() for a dispatched call
+    METRIC_CAR_LOCK_WAIT,       // Time spent waiting for a contended car->mutex
+    METRIC_CARS_LOCK_WAIT,      // Time spent waiting for a contended cars.mutex
+    METRIC_REPL_ENCODE,         // Time spent replicating a changed queue, with the car's mutex held
+    METRIC_CALL_WAIT,           // Time from a CALL to the doors opening for the passenger at the source floor
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram;
+
+/**
+ * The metrics recorded by a single thread.
+ * Only the owning thread writes to a shard, so recording never contends with other threads.
+ * Readers sum up all shards, shards of finished threads are kept (and reused) so that no counts are lost.
+ */
+typedef struct metrics_shard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    histogram_t histograms[METRIC_HISTOGRAM_COUNT];
+
+    /// 1 while the shard belongs to a thread
+    atomic_int in_use;
+
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+void metrics_init( void );
+
+void metrics_count( metric_counter counter, uint64_t n );
+
+/**
+ * Records a duration in nanoseconds (or any other value) into the calling thread's histogram.
+ */
+void metrics_record( metric_histogram histogram, uint64_t value );
+
+/**
+ * Returns the sum of the counter over all threads.
+ */
+uint64_t metrics_counter_total( metric_counter counter );
+
+/**
+ * Merges the histogram of all threads into out, which must be initialized.
+ */
+void metrics_histogram_merge( metric_histogram histogram, histogram_t *out );
+
+/**
+ * Writes all counters and histograms (as summaries) in the plain-text Prometheus exposition format.
+ */
+void metrics_write( FILE *out );
+
+/**
+ * Serves the metrics over HTTP on 127.0.0.1:port from a thread of its own.
+ * write_extra, if not NULL, is called after metrics_write() to append metrics sampled at scrape time.
+ * Returns 0 on success, -1 otherwise.
+ */
+int metrics_serve( uint16_t port, void (*write_extra)( FILE *out ) );
+
+/**
+ * Stops serving the metrics, after the scrape in progress if there is one. Does nothing if they are not served.
+ */
+void metrics_stop( void );
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "object_pool.h"
+
+typedef struct pool_slab {
+    union {
+        struct pool_slab *next;
+        max_align_t align;      // Keeps the objects following the header aligned
+    };
+} pool_slab_t;
+
+typedef struct pool_free_object {
+    struct pool_free_object *next;
+} pool_free_object_t;
+
+void pool_init( object_pool_t *pool, size_t object_size, size_t slab_objects ) {
+    size_t alignment = _Alignof(max_align_t);
+    if (object_size < sizeof(pool_free_object_t)) {
+        object_size = sizeof(pool_free_object_t);
+    }
+    pool->object_size = (object_size + alignment - 1) / alignment * alignment;
+    pool->slab_objects = slab_objects;
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->unused = NULL;
+    pool->unused_count = 0;
+    pool->live = 0;
+    pool->peak = 0;
+    pool->recycled = 0;
+}
+
+void pool_destroy( object_pool_t *pool ) {
+    while (pool->slabs != NULL) {
+        pool_slab_t *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    pool->free_list = NULL;
+    pool->unused = NULL;
+    pool->unused_count = 0;
+    pool->live = 0;
+}
+
+void * pool_alloc( object_pool_t *pool ) {
+    void *object;
+
+    // Reuse a freed object
+    if (pool->free_list != NULL) {
+        object = pool->free_list;
+        pool->free_list = pool->free_list->next;
+        pool->recycled++;
+    }
+    else {
+        // The newest slab is used up -> allocate another one
+        if (pool->unused_count == 0) {
+            pool_slab_t *slab = malloc(sizeof(pool_slab_t) + pool->slab_objects * pool->object_size);
+            if (slab == NULL) {
+                perror("malloc()");
+                return NULL;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->unused = (char *) (slab + 1);
+            pool->unused_count = pool->slab_objects;
+        }
+        object = pool->unused;
+        pool->unused += pool->object_size;
+        pool->unused_count--;
+    }
+
+    pool->live++;
+    if (pool->live > pool->peak) {
+        pool->peak = pool->live;
+    }
+    return object;
+}
+
+void pool_free( object_pool_t *pool, void *object ) {
+    if (object == NULL) {
+        return;
+    }
+    pool_free_object_t *free_object = object;
+    free_object->next = pool->free_list;
+    pool->free_list = free_object;
+    pool->live--;
+}
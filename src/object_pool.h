@@ -0,0 +1,52 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>
+
+/**
+ * A pool of fixed-size objects carved out of larger slabs.
+ * Freed objects are kept on a free list and handed out again before any new memory is touched.
+ * The pool is not thread safe, it is meant to be protected by the lock of its owner.
+ */
+typedef struct object_pool {
+	/// The size of a single object, rounded up to keep objects aligned
+	size_t object_size;
+
+	/// The number of objects in each slab
+	size_t slab_objects;
+
+	/// Singly linked list of all slabs
+	struct pool_slab *slabs;
+
+	/// Singly linked list of freed objects
+	struct pool_free_object *free_list;
+
+	/// Objects of the newest slab which were never handed out
+	char *unused;
+	size_t unused_count;
+
+	/// The number of objects currently handed out
+	size_t live;
+
+	/// The highest number of objects handed out at the same time
+	size_t peak;
+
+	/// The number of allocations served from the free list
+	size_t recycled;
+} object_pool_t;
+
+void pool_init( object_pool_t *pool, size_t object_size, size_t slab_objects );
+
+/**
+ * Frees all slabs, including the objects still handed out.
+ */
+void pool_destroy( object_pool_t *pool );
+
+/**
+ * Returns an uninitialized object, or NULL if a new slab could not be allocated.
+ */
+void * pool_alloc( object_pool_t *pool );
+
+void pool_free( object_pool_t *pool, void *object );
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "shared.h"
+#include "protocol.h"
+
+int proto_is_binary(const char *msg, uint32_t len) {
+    return len > 0 && (uint8_t) msg[0] == PROTO_MAGIC;
+}
+
+void proto_encode(const proto_record *rec, uint8_t *buf) {
+    uint16_t floor = htons((uint16_t) rec->floor);
+    uint16_t other_floor = htons((uint16_t) rec->other_floor);
+
+    buf[0] = PROTO_MAGIC;
+    buf[1] = rec->type;
+    buf[2] = rec->status;
+    buf[3] = 0;
+    memcpy(buf + 4, &floor, sizeof(floor));
+    memcpy(buf + 6, &other_floor, sizeof(other_floor));
+}
+
+int proto_decode(const char *msg, uint32_t len, proto_record *rec) {
+    if (len < PROTO_RECORD_SIZE || !proto_is_binary(msg, len)) {
+        return -1;
+    }
+    uint16_t floor;
+    uint16_t other_floor;
+    memcpy(&floor, msg + 4, sizeof(floor));
+    memcpy(&other_floor, msg + 6, sizeof(other_floor));
+
+    rec->type = (uint8_t) msg[1];
+    rec->status = (uint8_t) msg[2];
+    rec->floor = (int16_t) ntohs(floor);
+    rec->other_floor = (int16_t) ntohs(other_floor);
+
+    if (rec->type == PROTO_STATUS && rec->status >= STATUS_COUNT) {
+        return -1;
+    }
+    return 0;
+}
+
+int send_record(int fd, const proto_record *rec) {
+    uint8_t frame[sizeof(uint32_t) + PROTO_RECORD_SIZE];
+    uint32_t len = htonl(PROTO_RECORD_SIZE);
+
+    memcpy(frame, &len, sizeof(len));
+    proto_encode(rec, frame + sizeof(len));
+    return send_looped(fd, frame, sizeof(frame));
+}
+
+int proto_request_id(const char *msg, uint32_t len, uint32_t *request_id) {
+    if (len < PROTO_RECORD_SIZE + PROTO_REQUEST_ID_SIZE || !proto_is_binary(msg, len)) {
+        return -1;
+    }
+    uint32_t id;
+    memcpy(&id, msg + PROTO_RECORD_SIZE, sizeof(id));
+    *request_id = ntohl(id);
+    return 0;
+}
+
+size_t proto_encode_reply(const proto_record *rec, const uint32_t *request_id, const char *car_name, uint8_t *buf) {
+    size_t len = PROTO_RECORD_SIZE;
+
+    proto_encode(rec, buf);
+    if (request_id != NULL) {
+        uint32_t id = htonl(*request_id);
+        memcpy(buf + len, &id, sizeof(id));
+        len += PROTO_REQUEST_ID_SIZE;
+    }
+    if (car_name != NULL) {
+        size_t name_len = strnlen(car_name, MAX_CAR_NAME_LENGTH);
+        memcpy(buf + len, car_name, name_len);
+        len += name_len;
+    }
+    return len;
+}
@@ -0,0 +1,91 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary alternative to the text messages exchanged between the controller, cars and call pads.
+ *
+ * Binary messages use the same length-prefixed framing as the text ones. The payload is a fixed-size
+ * record starting with PROTO_MAGIC, a byte which never starts a text message, so both formats can be
+ * told apart on every message:
+ *
+ *   offset  size  field
+ *   0       1     PROTO_MAGIC
+ *   1       1     type (proto_type)
+ *   2       1     status (car_status, STATUS only)
+ *   3       1     reserved, 0
+ *   4       2     floor, signed, big endian (STATUS: current, FLOOR: target, CALL: source)
+ *   6       2     other floor, signed, big endian (STATUS: destination, CALL: destination)
+ *
+ * A PROTO_CAR reply is followed by the name of the car.
+ *
+ * A car offers the binary protocol by appending PROTO_OFFER to its text CAR message. A controller
+ * supporting it answers with a PROTO_ACCEPT record, from then on both sides send binary records.
+ * Call pads use it simply by sending a binary CALL, which is answered in binary.
+ *
+ * A call pad may keep its connection open and pipeline calls tagged with a request id. A tagged binary
+ * CALL is followed by the id (4 bytes, big endian), the reply repeats it right after its record,
+ * before the name of a PROTO_CAR reply. Tagged text calls are "CALL {source} {destination} {id}" and
+ * are answered with "CAR {name} {id}", "UNAVAILABLE {id}" or "INVALID {id}". Replies to tagged calls
+ * are sent as soon as each call is assigned, so they may arrive in a different order than the calls.
+ */
+
+#define PROTO_MAGIC 0xEB
+#define PROTO_RECORD_SIZE 8
+#define PROTO_OFFER "BINARY"
+#define PROTO_REQUEST_ID_SIZE 4
+
+typedef enum {
+    PROTO_STATUS = 1,       // Car -> controller: status, current floor, destination floor
+    PROTO_FLOOR,            // Controller -> car: go to floor
+    PROTO_CALL,             // Call pad -> controller: source floor, destination floor
+    PROTO_CAR,              // Controller -> call pad: the car assigned to the call, followed by its name
+    PROTO_UNAVAILABLE,      // Controller -> call pad: no car can take the call
+    PROTO_INVALID,          // Controller -> any: the message was not understood
+    PROTO_ACCEPT,           // Controller -> car: the binary protocol was accepted
+    PROTO_SERVICE,          // Car -> controller: the car goes into individual service mode
+    PROTO_EMERGENCY         // Car -> controller: the car goes into emergency mode
+} proto_type;
+
+typedef struct proto_record {
+    uint8_t type;
+    uint8_t status;
+    int16_t floor;
+    int16_t other_floor;
+} proto_record;
+
+/**
+ * Returns 1 if the message is a binary record, 0 if it is a text message.
+ */
+int proto_is_binary(const char *msg, uint32_t len);
+
+/**
+ * Serializes the record into buf, which must hold at least PROTO_RECORD_SIZE bytes.
+ */
+void proto_encode(const proto_record *rec, uint8_t *buf);
+
+/**
+ * Parses a binary record. Returns 0 on success, -1 if the message is not a well formed record.
+ */
+int proto_decode(const char *msg, uint32_t len, proto_record *rec);
+
+/**
+ * Frames and sends a single record. Returns 0 on success, -1 otherwise.
+ */
+int send_record(int fd, const proto_record *rec);
+
+/**
+ * Reads the request id following the record of a tagged message. Returns 0 on success, -1 if the message is not tagged.
+ */
+int proto_request_id(const char *msg, uint32_t len, uint32_t *request_id);
+
+/**
+ * Serializes the payload of a reply to a call into buf: the record, the request id unless it is NULL and the car's
+ * name unless it is NULL. buf must hold at least PROTO_RECORD_SIZE + PROTO_REQUEST_ID_SIZE + MAX_CAR_NAME_LENGTH bytes.
+ * Returns the length of the payload.
+ */
+size_t proto_encode_reply(const proto_record *rec, const uint32_t *request_id, const char *car_name, uint8_t *buf);
+
+#endif
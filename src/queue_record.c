@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "shared.h"
+#include "scheduler.h"
+#include "queue_record.h"
+
+#define REPLICA_WRITE_SIZE 65536    // Bytes of records written to a file at once
+
+static void put_u16(char **ptr, uint16_t value) {
+    uint16_t nvalue = htons(value);
+    memcpy(*ptr, &nvalue, sizeof(nvalue));
+    *ptr += sizeof(nvalue);
+}
+
+static void put_u32(char **ptr, uint32_t value) {
+    uint32_t nvalue = htonl(value);
+    memcpy(*ptr, &nvalue, sizeof(nvalue));
+    *ptr += sizeof(nvalue);
+}
+
+static uint16_t get_u16(const char **ptr) {
+    uint16_t nvalue;
+    memcpy(&nvalue, *ptr, sizeof(nvalue));
+    *ptr += sizeof(nvalue);
+    return ntohs(nvalue);
+}
+
+static uint32_t get_u32(const char **ptr) {
+    uint32_t nvalue;
+    memcpy(&nvalue, *ptr, sizeof(nvalue));
+    *ptr += sizeof(nvalue);
+    return ntohl(nvalue);
+}
+
+static void put_node(char **ptr, const QueueNode *node) {
+    put_u16(ptr, node->floor);
+    *(*ptr)++ = node->direction;
+}
+
+static void get_node(const char **ptr, QueueNode *node) {
+    node->floor = get_u16(ptr);
+    node->direction = *(*ptr)++;
+    node->next = NULL;
+}
+
+/**
+ * Returns 1 if all count encoded nodes at ptr stop at a floor from lowest_floor to highest_floor and go UP or DOWN,
+ * else 0.
+ */
+static int nodes_valid(const char *ptr, size_t count, floor_t lowest_floor, floor_t highest_floor) {
+    for (size_t i = 0; i < count; i++) {
+        QueueNode node;
+        get_node(&ptr, &node);
+        if (node.floor < lowest_floor || node.floor > highest_floor
+            || (node.direction != UP && node.direction != DOWN)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Encodes the type and the car every record but the heartbeat starts with. Returns where the record continues.
+ */
+static char * put_header(char *ptr, qrec_type type, const char *car_name, floor_t lowest_floor, floor_t highest_floor) {
+    size_t name_len = strnlen(car_name, MAX_CAR_NAME_LENGTH);
+    *ptr++ = type;
+    *ptr++ = name_len;
+    memcpy(ptr, car_name, name_len);
+    ptr += name_len;
+    put_u16(&ptr, lowest_floor);
+    put_u16(&ptr, highest_floor);
+    return ptr;
+}
+
+size_t qrec_size(qrec_type type, const Car *car) {
+    if (type == QREC_HEARTBEAT) {
+        return 1;
+    }
+    size_t size = QREC_HEADER_SIZE(strnlen(car->car_name, MAX_CAR_NAME_LENGTH));
+    if (type == QREC_QUEUE) {
+        size += sizeof(uint32_t) + car->stats.nodes * QREC_NODE_SIZE;
+    } else if (type == QREC_INSERT) {
+        size += sizeof(uint32_t) + QREC_NODE_SIZE;
+    }
+    return size;
+}
+
+void qrec_encode(char *buf, qrec_type type, const Car *car, uint32_t index, const QueueNode *node) {
+    if (type == QREC_HEARTBEAT) {
+        *buf = type;
+        return;
+    }
+    char *ptr = put_header(buf, type, car->car_name, car->lowest_floor, car->highest_floor);
+    if (type == QREC_QUEUE) {
+        put_u32(&ptr, car->stats.nodes);
+        for (node = car->queue; node != NULL; node = node->next) {
+            put_node(&ptr, node);
+        }
+    } else if (type == QREC_INSERT) {
+        put_u32(&ptr, index);
+        put_node(&ptr, node);
+    }
+}
+
+uint32_t qrec_node_index(const Car *car, const QueueNode *node) {
+    uint32_t index = 0;
+    for (const QueueNode *other = car->queue; other != node; other = other->next) {
+        index++;
+    }
+    return index;
+}
+
+void replica_init(queue_replica_t *replica) {
+    pthread_mutex_init(&replica->mutex, NULL);
+    replica->cars = NULL;
+    replica->size = 0;
+    replica->capacity = 0;
+}
+
+void replica_destroy(queue_replica_t *replica) {
+    for (size_t i = 0; i < replica->size; i++) {
+        free(replica->cars[i].nodes);
+    }
+    free(replica->cars);
+    pthread_mutex_destroy(&replica->mutex);
+}
+
+/**
+ * Returns the car of that name, or NULL if there is none. The replica's mutex must be held.
+ */
+static replica_car_t * replica_find(queue_replica_t *replica, const char *car_name) {
+    for (size_t i = 0; i < replica->size; i++) {
+        if (strncmp(replica->cars[i].car_name, car_name, MAX_CAR_NAME_LENGTH) == 0) {
+            return &replica->cars[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Adds a car with an empty queue. The replica's mutex must be held.
+ */
+static replica_car_t * replica_add(queue_replica_t *replica, const char *car_name, floor_t lowest_floor,
+                                   floor_t highest_floor) {
+    if (replica->size == replica->capacity) {
+        size_t capacity = replica->capacity == 0 ? 16 : replica->capacity * 2;
+        replica_car_t *cars = realloc(replica->cars, capacity * sizeof(replica_car_t));
+        if (cars == NULL) {
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        replica->cars = cars;
+        replica->capacity = capacity;
+    }
+    replica_car_t *car = &replica->cars[replica->size++];
+    strcpy(car->car_name, car_name);
+    car->lowest_floor = lowest_floor;
+    car->highest_floor = highest_floor;
+    car->nodes = NULL;
+    car->start = 0;
+    car->count = 0;
+    car->capacity = 0;
+    return car;
+}
+
+/**
+ * Removes a car. The replica's mutex must be held.
+ */
+static void replica_remove(queue_replica_t *replica, replica_car_t *car) {
+    free(car->nodes);
+    *car = replica->cars[--replica->size];
+}
+
+/**
+ * Makes room for count nodes after the car's start. The replica's mutex must be held.
+ */
+static void replica_reserve(replica_car_t *car, size_t count) {
+    if (car->start + count <= car->capacity) {
+        return;
+    }
+    // Popped nodes leave room at the front
+    memmove(car->nodes, car->nodes + car->start, car->count * sizeof(QueueNode));
+    car->start = 0;
+    if (count <= car->capacity) {
+        return;
+    }
+    size_t capacity = car->capacity == 0 ? 16 : car->capacity * 2;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    QueueNode *nodes = realloc(car->nodes, capacity * sizeof(QueueNode));
+    if (nodes == NULL) {
+        perror("realloc()");
+        exit(EXIT_FAILURE);
+    }
+    car->nodes = nodes;
+    car->capacity = capacity;
+}
+
+int replica_apply(queue_replica_t *replica, const char *rec, uint32_t len) {
+    if (len == 1 && rec[0] == QREC_HEARTBEAT) {
+        return 0;
+    }
+    if (len < 2 || len < (size_t) QREC_HEADER_SIZE((unsigned char) rec[1])) {
+        return -1;
+    }
+    const char *ptr = rec;
+    int type = *ptr++;
+    size_t name_len = (unsigned char) *ptr++;
+    char car_name[MAX_CAR_NAME_LENGTH + 1] = {0};
+    memcpy(car_name, ptr, name_len);
+    ptr += name_len;
+    floor_t lowest_floor = get_u16(&ptr);
+    floor_t highest_floor = get_u16(&ptr);
+    size_t remaining = len - QREC_HEADER_SIZE(name_len);
+    int result = 0;
+
+    pthread_mutex_lock(&replica->mutex);
+    replica_car_t *car = replica_find(replica, car_name);
+    if (type == QREC_QUEUE && remaining >= sizeof(uint32_t)
+        && remaining - sizeof(uint32_t) == (size_t) get_u32(&ptr) * QREC_NODE_SIZE
+        && nodes_valid(ptr, (remaining - sizeof(uint32_t)) / QREC_NODE_SIZE, lowest_floor, highest_floor)) {
+        size_t count = (remaining - sizeof(uint32_t)) / QREC_NODE_SIZE;
+        if (car == NULL) {
+            car = replica_add(replica, car_name, lowest_floor, highest_floor);
+        }
+        car->lowest_floor = lowest_floor;
+        car->highest_floor = highest_floor;
+        car->start = 0;
+        car->count = 0;
+        replica_reserve(car, count);
+        for (size_t i = 0; i < count; i++) {
+            get_node(&ptr, &car->nodes[i]);
+        }
+        car->count = count;
+    }
+    else if (type == QREC_INSERT && remaining == sizeof(uint32_t) + QREC_NODE_SIZE
+             && nodes_valid(ptr + sizeof(uint32_t), 1, lowest_floor, highest_floor)) {
+        size_t index = get_u32(&ptr);
+        if (car == NULL) {
+            car = replica_add(replica, car_name, lowest_floor, highest_floor);
+        }
+        if (index <= car->count) {
+            replica_reserve(car, car->count + 1);
+            QueueNode *at = car->nodes + car->start + index;
+            memmove(at + 1, at, (car->count - index) * sizeof(QueueNode));
+            get_node(&ptr, at);
+            car->count++;
+        }
+    }
+    else if (type == QREC_POP && remaining == 0) {
+        if (car != NULL && car->count > 0) {
+            car->start++;
+            car->count--;
+        }
+    }
+    else if (type == QREC_REMOVE && remaining == 0) {
+        if (car != NULL) {
+            replica_remove(replica, car);
+        }
+    }
+    else {
+        result = -1;
+    }
+    pthread_mutex_unlock(&replica->mutex);
+    return result;
+}
+
+size_t replica_apply_frames(queue_replica_t *replica, const char *buf, size_t len, uint64_t *records) {
+    size_t offset = 0;
+    while (len - offset >= sizeof(uint32_t)) {
+        uint32_t nsize;
+        memcpy(&nsize, buf + offset, sizeof(nsize));
+        size_t size = ntohl(nsize);
+        if (size == 0 || len - offset - sizeof(uint32_t) < size) {
+            break;
+        }
+        replica_apply(replica, buf + offset + sizeof(uint32_t), size);
+        offset += sizeof(uint32_t) + size;
+        (*records)++;
+    }
+    return offset;
+}
+
+size_t replica_nodes(queue_replica_t *replica, size_t *cars) {
+    size_t nodes = 0;
+    pthread_mutex_lock(&replica->mutex);
+    for (size_t i = 0; i < replica->size; i++) {
+        nodes += replica->cars[i].count;
+    }
+    *cars = replica->size;
+    pthread_mutex_unlock(&replica->mutex);
+    return nodes;
+}
+
+/**
+ * Sends the len bytes buffered by replica_write and empties the buffer. Returns 0 on success, -1 otherwise.
+ */
+static int replica_flush(int fd, const char *buf, size_t *len, ssize_t *written) {
+    if (send_looped(fd, buf, *len) == -1) {
+        *written = -1;
+        return -1;
+    }
+    *written += *len;
+    *len = 0;
+    return 0;
+}
+
+ssize_t replica_write(queue_replica_t *replica, int fd) {
+    char *buf = malloc(REPLICA_WRITE_SIZE);
+    if (buf == NULL) {
+        perror("malloc()");
+        return -1;
+    }
+    size_t len = 0;
+    ssize_t written = 0;
+
+    pthread_mutex_lock(&replica->mutex);
+    for (size_t i = 0; i < replica->size && written != -1; i++) {
+        replica_car_t *car = &replica->cars[i];
+        if (car->count == 0) {
+            continue;
+        }
+        size_t size = QREC_HEADER_SIZE(strnlen(car->car_name, MAX_CAR_NAME_LENGTH)) + sizeof(uint32_t);
+        // Nodes are written in chunks, the header goes with the first one
+        if (len + sizeof(uint32_t) + size + QREC_NODE_SIZE > REPLICA_WRITE_SIZE
+                && replica_flush(fd, buf, &len, &written) == -1) {
+            break;
+        }
+        char *ptr = buf + len;
+        uint32_t nsize = htonl(size + car->count * QREC_NODE_SIZE);
+        memcpy(ptr, &nsize, sizeof(nsize));
+        ptr = put_header(ptr + sizeof(nsize), QREC_QUEUE, car->car_name, car->lowest_floor, car->highest_floor);
+        put_u32(&ptr, car->count);
+        len = ptr - buf;
+        for (size_t j = 0; j < car->count; j++) {
+            if (len + QREC_NODE_SIZE > REPLICA_WRITE_SIZE) {
+                if (replica_flush(fd, buf, &len, &written) == -1) {
+                    break;
+                }
+                ptr = buf;
+            }
+            put_node(&ptr, &car->nodes[car->start + j]);
+            len += QREC_NODE_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&replica->mutex);
+
+    if (written != -1 && len > 0) {
+        replica_flush(fd, buf, &len, &written);
+    }
+    free(buf);
+    return written;
+}
+
+size_t replica_restore(queue_replica_t *replica, Car *car) {
+    size_t count = 0;
+    pthread_mutex_lock(&replica->mutex);
+    replica_car_t *replicated = replica_find(replica, car->car_name);
+    // A car changing its floor range is a different car, its old queue may not fit
+    if (replicated != NULL && replicated->lowest_floor == car->lowest_floor
+        && replicated->highest_floor == car->highest_floor) {
+        queue_restore(car, replicated->nodes + replicated->start, replicated->count);
+        count = replicated->count;
+    }
+    if (replicated != NULL) {
+        replica_remove(replica, replicated);
+    }
+    pthread_mutex_unlock(&replica->mutex);
+    return count;
+}
@@ -0,0 +1,105 @@
+#ifndef QUEUE_RECORD_H
+#define QUEUE_RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "car_vector.h"
+
+/*
+ * Records of the changes to the cars' queues, as streamed to a standby (replication.c) and logged to disk
+ * (journal.c), and the replica the records rebuild the queues in.
+ *
+ * Every record starts with its type and the car (integers in network byte order):
+ * type (1) + name length (1) + name + lowest floor (2) + highest floor (2)
+ * QREC_QUEUE continues with the number of nodes (4) and the nodes, QREC_INSERT with the node's index (4) and the node.
+ * A node is its floor (2) + direction (1). Only QREC_HEARTBEAT consists of the type alone.
+ */
+
+typedef enum {
+    QREC_QUEUE = 1,     // The whole queue of a car, replacing whatever was known about it
+    QREC_INSERT,        // A node was inserted into the queue of a car
+    QREC_POP,           // The head of the queue of a car was removed
+    QREC_REMOVE,        // A car disconnected, its queue is gone
+    QREC_HEARTBEAT      // Nothing changed
+} qrec_type;
+
+#define QREC_HEADER_SIZE(name_len) (1 + 1 + (name_len) + 2 + 2)
+#define QREC_NODE_SIZE 3
+
+/**
+ * The queue of a car as rebuilt from records.
+ */
+typedef struct replica_car {
+    char car_name[MAX_CAR_NAME_LENGTH + 1];
+    floor_t lowest_floor;
+    floor_t highest_floor;
+    QueueNode *nodes;           // The queue is nodes[start] to nodes[start + count - 1], next is unused
+    size_t start;
+    size_t count;
+    size_t capacity;
+} replica_car_t;
+
+/**
+ * The queues of all cars as rebuilt from records.
+ */
+typedef struct queue_replica {
+    pthread_mutex_t mutex;
+    replica_car_t *cars;
+    size_t size;
+    size_t capacity;
+} queue_replica_t;
+
+/**
+ * Returns the size of a record about the car. The car's mutex must be held.
+ */
+size_t qrec_size( qrec_type type, const Car *car );
+
+/**
+ * Encodes a record about the car into buf, which must hold qrec_size() bytes. The car's mutex must be held.
+ * QREC_QUEUE carries all nodes of the car's queue, QREC_INSERT the node at the index.
+ */
+void qrec_encode( char *buf, qrec_type type, const Car *car, uint32_t index, const QueueNode *node );
+
+/**
+ * Returns the position of the node in the car's queue. The car's mutex must be held.
+ */
+uint32_t qrec_node_index( const Car *car, const QueueNode *node );
+
+void replica_init( queue_replica_t *replica );
+
+void replica_destroy( queue_replica_t *replica );
+
+/**
+ * Applies a record to the replica. Returns 0 on success, -1 if the record is malformed, including a node
+ * outside the car's floor range or going neither UP nor DOWN.
+ * An insert the known queue does not fit is ignored, it preceded the QREC_QUEUE record of its car.
+ */
+int replica_apply( queue_replica_t *replica, const char *rec, uint32_t len );
+
+/**
+ * Applies all complete length-prefixed records of buf[0..len). A zero length ends the records.
+ * Returns the number of bytes consumed, the rest is an incomplete record.
+ * The number of applied records is added to *records.
+ */
+size_t replica_apply_frames( queue_replica_t *replica, const char *buf, size_t len, uint64_t *records );
+
+/**
+ * Returns the total number of queued nodes of the replica, the number of cars is stored in *cars.
+ */
+size_t replica_nodes( queue_replica_t *replica, size_t *cars );
+
+/**
+ * Writes a length-prefixed QREC_QUEUE record of every car of the replica to fd.
+ * Returns the number of bytes written, or -1 on failure.
+ */
+ssize_t replica_write( queue_replica_t *replica, int fd );
+
+/**
+ * Moves the replicated queue of the car, if the replica knows the car's name with the same floor range, into the
+ * car's queue and forgets the car. The car's mutex must be held. Returns the number of restored nodes.
+ */
+size_t replica_restore( queue_replica_t *replica, Car *car );
+
+#endif
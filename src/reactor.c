@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "reactor.h"
+
+static atomic_ulong buffer_allocations;     // Receive buffers allocated or grown by all reactors
+
+uint64_t reactor_allocation_count( void ) {
+    return atomic_load_explicit(&buffer_allocations, memory_order_relaxed);
+}
+
+int reactor_init( reactor_t *reactor, int listenfd, const reactor_handlers_t *handlers ) {
+    reactor->listenfd = listenfd;
+    reactor->handlers = *handlers;
+    reactor->running = 0;
+
+    reactor->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epollfd == -1) {
+        perror("epoll_create1()");
+        return -1;
+    }
+
+    reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wakefd == -1) {
+        perror("eventfd()");
+        close(reactor->epollfd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->wakefd;
+    if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) == -1) {
+        perror("epoll_ctl()");
+        reactor_destroy(reactor);
+        return -1;
+    }
+
+    // EPOLLEXCLUSIVE -> only one of the reactors sharing the socket is woken up per connection
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &reactor->listenfd;
+    if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+        perror("epoll_ctl()");
+        reactor_destroy(reactor);
+        return -1;
+    }
+
+    return 0;
+}
+
+void reactor_destroy( reactor_t *reactor ) {
+    close(reactor->wakefd);
+    close(reactor->epollfd);
+}
+
+void reactor_stop( reactor_t *reactor ) {
+    reactor->running = 0;
+    uint64_t one = 1;
+    if (write(reactor->wakefd, &one, sizeof(one)) == -1) {
+        perror("write()");
+    }
+}
+
+void reactor_detach( connection_t *conn ) {
+    if (epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+        perror("epoll_ctl()");
+    }
+    conn->reactor = NULL;
+}
+
+int reactor_want_write( connection_t *conn, int enable ) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = enable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+void connection_close( connection_t *conn ) {
+    // Closing the socket also removes it from the epoll set
+    if (shutdown(conn->fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        perror("shutdown()");
+    }
+    if (close(conn->fd) == -1) {
+        perror("close()");
+    }
+    free(conn->in_buf);
+    free(conn);
+}
+
+static void reactor_close( reactor_t *reactor, connection_t *conn ) {
+    if (reactor->handlers.on_close != NULL) {
+        reactor->handlers.on_close(conn);
+    }
+    connection_close(conn);
+}
+
+static void reactor_accept( reactor_t *reactor ) {
+    while (1) {
+        int clientfd = accept4(reactor->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd == -1) {
+            // Another reactor was faster or the backlog is drained
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept4()");
+            }
+            return;
+        }
+
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        if (conn == NULL) {
+            perror("calloc()");
+            close(clientfd);
+            continue;
+        }
+        conn->fd = clientfd;
+        conn->reactor = reactor;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+            perror("epoll_ctl()");
+            close(clientfd);
+            free(conn);
+        }
+    }
+}
+
+/**
+ * Passes every complete message in the connection's buffer to the message handler.
+ * Returns REACTOR_KEEP if the connection is still owned by the reactor and should stay open.
+ */
+static int reactor_dispatch( reactor_t *reactor, connection_t *conn ) {
+    size_t offset = 0;
+    int result = REACTOR_KEEP;
+
+    while (conn->in_len - offset >= sizeof(uint32_t)) {
+        uint32_t nlen;
+        memcpy(&nlen, conn->in_buf + offset, sizeof(nlen));
+        uint32_t len = ntohl(nlen);
+        if (len > REACTOR_MAX_MESSAGE_LENGTH) {
+            return REACTOR_CLOSE;
+        }
+        // The message is not complete yet
+        if (conn->in_len - offset - sizeof(nlen) < len) {
+            break;
+        }
+
+        // The message is passed in place, the byte after it (the start of the next message, or the spare byte
+        // reactor_read() leaves) is borrowed for the NUL terminator
+        char *msg = conn->in_buf + offset + sizeof(nlen);
+        offset += sizeof(nlen) + len;
+        char saved = conn->in_buf[offset];
+        conn->in_buf[offset] = '\0';
+
+        result = reactor->handlers.on_message(conn, msg, len);
+        // A detached or closed connection and its buffer may be gone already
+        if (result != REACTOR_KEEP) {
+            return result;
+        }
+        conn->in_buf[offset] = saved;
+    }
+
+    // Move the incomplete remainder to the beginning of the buffer
+    memmove(conn->in_buf, conn->in_buf + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+    return result;
+}
+
+static void reactor_read( reactor_t *reactor, connection_t *conn ) {
+    while (1) {
+        if (conn->in_cap - conn->in_len < REACTOR_READ_CHUNK) {
+            size_t new_cap = conn->in_cap + REACTOR_READ_CHUNK;
+            char *new_buf = realloc(conn->in_buf, new_cap);
+            if (new_buf == NULL) {
+                perror("realloc()");
+                reactor_close(reactor, conn);
+                return;
+            }
+            atomic_fetch_add_explicit(&buffer_allocations, 1, memory_order_relaxed);
+            conn->in_buf = new_buf;
+            conn->in_cap = new_cap;
+        }
+
+        // One byte stays spare for the NUL terminator of a message ending the buffered data
+        ssize_t received = read(conn->fd, conn->in_buf + conn->in_len, conn->in_cap - conn->in_len - 1);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        // Everything available has been read
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        // The peer hung up or the connection broke
+        if (received <= 0) {
+            reactor_close(reactor, conn);
+            return;
+        }
+        conn->in_len += received;
+
+        int result = reactor_dispatch(reactor, conn);
+        if (result == REACTOR_CLOSE) {
+            reactor_close(reactor, conn);
+            return;
+        }
+        if (result == REACTOR_DETACHED) {
+            return;
+        }
+    }
+}
+
+void reactor_run( reactor_t *reactor ) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    reactor->running = 1;
+
+    while (reactor->running) {
+        int n = epoll_wait(reactor->epollfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait()");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &reactor->wakefd) {
+                continue;
+            }
+            if (events[i].data.ptr == &reactor->listenfd) {
+                reactor_accept(reactor);
+                continue;
+            }
+            connection_t *conn = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && reactor->handlers.on_writable != NULL
+                    && reactor->handlers.on_writable(conn) == REACTOR_CLOSE) {
+                reactor_close(reactor, conn);
+                continue;
+            }
+            // Input, hang up or error
+            if (events[i].events & ~EPOLLOUT) {
+                reactor_read(reactor, conn);
+            }
+        }
+    }
+}
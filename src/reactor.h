@@ -0,0 +1,105 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_READ_CHUNK 4096
+#define REACTOR_MAX_MESSAGE_LENGTH 65536
+
+// Return values of reactor_handlers_t.on_message
+#define REACTOR_KEEP 0      // Keep the connection registered with the reactor
+#define REACTOR_CLOSE 1     // Close the connection
+#define REACTOR_DETACHED 2  // The handler took the connection out of the reactor (see reactor_detach)
+
+typedef struct reactor reactor_t;
+
+/**
+ * A non-blocking connection owned by a reactor.
+ * Incoming bytes are buffered until a complete length-prefixed message is available.
+ */
+typedef struct connection {
+	/// The socket of the connection
+	int fd;
+
+	/// The reactor the connection is registered with
+	reactor_t *reactor;
+
+	/// Buffered bytes which do not form a complete message yet
+	char *in_buf;
+	size_t in_len;
+	size_t in_cap;
+
+	/// Arbitrary state attached by the handlers
+	void *data;
+
+	/// Tells the handlers what kind of state data is, 0 until they set it
+	int kind;
+} connection_t;
+
+typedef struct reactor_handlers {
+	/// Called for every complete message of len bytes. The message is NUL-terminated and lives in the connection's
+	/// buffer, the handler may modify it but must not keep it after returning.
+	int (*on_message)( connection_t *conn, char *msg, uint32_t len );
+
+	/// Called when a connection armed with reactor_want_write() can take more bytes, before any pending input is read.
+	/// Returns REACTOR_KEEP or REACTOR_CLOSE. May be NULL if no handler arms connections.
+	int (*on_writable)( connection_t *conn );
+
+	/// Called right before the reactor closes a connection (hang up, error or REACTOR_CLOSE). May be NULL.
+	void (*on_close)( connection_t *conn );
+} reactor_handlers_t;
+
+/**
+ * An epoll based event loop accepting and serving connections on a shared listening socket.
+ * Several reactors may share the same listening socket, each one accepting on its own.
+ */
+struct reactor {
+	int epollfd;
+
+	/// The non-blocking listening socket
+	int listenfd;
+
+	/// eventfd used to interrupt epoll_wait() when stopping
+	int wakefd;
+
+	volatile int running;
+
+	reactor_handlers_t handlers;
+};
+
+int reactor_init( reactor_t *reactor, int listenfd, const reactor_handlers_t *handlers );
+
+/**
+ * Runs the event loop on the calling thread until reactor_stop() is called.
+ */
+void reactor_run( reactor_t *reactor );
+
+void reactor_stop( reactor_t *reactor );
+
+void reactor_destroy( reactor_t *reactor );
+
+/**
+ * Removes the connection from its reactor. The caller becomes responsible for closing it with connection_close().
+ * Any bytes buffered after the current message are discarded.
+ */
+void reactor_detach( connection_t *conn );
+
+/**
+ * Asks the reactor to call on_writable once the connection can take more bytes (enable = 1), or stops asking (enable = 0).
+ * May be called from any thread while the connection is registered. Returns 0 on success, -1 otherwise.
+ */
+int reactor_want_write( connection_t *conn, int enable );
+
+/**
+ * Shuts down and closes the connection's socket and frees the connection.
+ */
+void connection_close( connection_t *conn );
+
+/**
+ * Returns the number of times the reactors allocated or grew a connection's receive buffer.
+ */
+uint64_t reactor_allocation_count( void );
+
+#endif
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "shared.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "queue_record.h"
+#include "replication.h"
+
+#define REPL_READ_SIZE 65536    // Bytes the standby reads at once
+
+/**
+ * The stream to the standby, filled by the threads changing queues and drained by the sender thread.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Signalled when records were added or a standby attached
+    int fd;                     // The standby's socket, -1 without standby
+    char *buf;                  // Length-prefixed records not sent yet
+    size_t len;
+    size_t capacity;
+} stream = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, NULL, 0, 0 };
+
+static atomic_int attached;         // 1 while stream.fd is a standby, lets changes skip the mutex without one
+static car_vector_t *primary_cars;
+static int acceptor_fd = -1;        // The listening socket for standbys, -1 if the primary does not replicate
+static pthread_t acceptor_thread;
+static atomic_int stopping;         // 1 once repl_stop() shut the listening socket down
+
+/**
+ * Reserves room for a record of size bytes at the end of the stream and writes its length prefix.
+ * Returns where the record goes, or NULL if the standby fell too far behind and was dropped.
+ * The stream's mutex must be held.
+ */
+static char * stream_reserve(size_t size) {
+    size_t needed = stream.len + sizeof(uint32_t) + size;
+    if (needed > REPL_MAX_BACKLOG) {
+        // The sender notices the broken connection and forgets the standby
+        fprintf(stderr, "Standby fell %zu bytes behind, dropping it\n", stream.len);
+        shutdown(stream.fd, SHUT_RDWR);
+        stream.len = 0;
+        return NULL;
+    }
+    if (needed > stream.capacity) {
+        size_t capacity = stream.capacity == 0 ? 4096 : stream.capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *buf = realloc(stream.buf, capacity);
+        if (buf == NULL) {
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+        stream.buf = buf;
+        stream.capacity = capacity;
+    }
+    char *ptr = stream.buf + stream.len;
+    uint32_t nlen = htonl(size);
+    memcpy(ptr, &nlen, sizeof(nlen));
+    stream.len = needed;
+    return ptr + sizeof(nlen);
+}
+
+/**
+ * Streams a record about the car to the standby, if there is one. The car's mutex must be held.
+ */
+static void replicate(qrec_type type, Car *car, uint32_t index, const QueueNode *node) {
+    // Unregistered cars are gone for the standby, even if a late call still lands on them
+    if (!atomic_load_explicit(&attached, memory_order_relaxed) || car->clientfd == -1) {
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&stream.mutex);
+    if (stream.fd != -1) {
+        // The sender only waits for an empty stream
+        int wake = stream.len == 0;
+        char *rec = stream_reserve(qrec_size(type, car));
+        if (rec != NULL) {
+            qrec_encode(rec, type, car, index, node);
+            metrics_count(METRIC_REPL_RECORDS, 1);
+        }
+        if (wake) {
+            pthread_cond_signal(&stream.cond);
+        }
+    }
+    pthread_mutex_unlock(&stream.mutex);
+    metrics_record(METRIC_REPL_ENCODE, now_ns() - start);
+}
+
+void repl_node_added(Car *car, const QueueNode *node) {
+    if (!atomic_load_explicit(&attached, memory_order_relaxed)) {
+        return;
+    }
+    replicate(QREC_INSERT, car, qrec_node_index(car, node), node);
+}
+
+void repl_head_removed(Car *car) {
+    replicate(QREC_POP, car, 0, NULL);
+}
+
+void repl_car_removed(Car *car) {
+    replicate(QREC_REMOVE, car, 0, NULL);
+}
+
+/**
+ * Sends the stream to the standby, or a heartbeat if there was nothing to send for REPL_HEARTBEAT_MS.
+ */
+static void * repl_sender(void *arg) {
+    (void) arg;
+    char *sending = NULL;
+    size_t sending_capacity = 0;
+
+    pthread_mutex_lock(&stream.mutex);
+    while (1) {
+        while (stream.fd == -1) {
+            pthread_cond_wait(&stream.cond, &stream.mutex);
+        }
+        if (stream.len == 0) {
+            struct timespec timeout;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_nsec += REPL_HEARTBEAT_MS * 1000000L;
+            if (timeout.tv_nsec >= 1000000000L) {
+                timeout.tv_sec += 1;
+                timeout.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&stream.cond, &stream.mutex, &timeout);
+            if (stream.fd == -1) {
+                continue;
+            }
+            if (stream.len == 0) {
+                char *ptr = stream_reserve(qrec_size(QREC_HEARTBEAT, NULL));
+                qrec_encode(ptr, QREC_HEARTBEAT, NULL, 0, NULL);
+            }
+        }
+
+        // Let the records of a burst of calls pile up, one send per batch instead of one per call
+        pthread_mutex_unlock(&stream.mutex);
+        usleep(REPL_BATCH_US);
+        pthread_mutex_lock(&stream.mutex);
+        if (stream.fd == -1) {
+            continue;
+        }
+
+        // Swap the buffers, so that the stream keeps filling up while the records are sent
+        char *buf = stream.buf;
+        size_t len = stream.len;
+        size_t capacity = stream.capacity;
+        stream.buf = sending;
+        stream.capacity = sending_capacity;
+        stream.len = 0;
+        sending = buf;
+        sending_capacity = capacity;
+        int fd = stream.fd;
+        pthread_mutex_unlock(&stream.mutex);
+
+        int result = send_looped(fd, sending, len);
+        metrics_count(METRIC_REPL_BYTES, len);
+
+        pthread_mutex_lock(&stream.mutex);
+        if (result == -1) {
+            printf("Standby detached\n");
+            fflush(stdout);
+            close(fd);
+            stream.fd = -1;
+            stream.len = 0;
+            atomic_store(&attached, 0);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Accepts standbys one at a time and sends every new one the queues of all cars.
+ */
+static void * repl_acceptor(void *arg) {
+    int listenfd = *((int *) arg);
+    free(arg);
+
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd == -1) {
+            if (atomic_load(&stopping)) {
+                break;
+            }
+            perror("accept() for replication");
+            continue;
+        }
+        pthread_mutex_lock(&stream.mutex);
+        if (stream.fd != -1) {
+            pthread_mutex_unlock(&stream.mutex);
+            close(fd);
+            continue;
+        }
+        // Records are small and the standby must see them right away
+        set_low_latency(fd);
+        stream.fd = fd;
+        stream.len = 0;
+        atomic_store(&attached, 1);
+        pthread_mutex_unlock(&stream.mutex);
+        printf("Standby attached\n");
+        fflush(stdout);
+
+        // Changes from now on are streamed already, the standby ignores those preceding the queue of their car
+        const cv_snapshot_t *snapshot = cv_read_lock(primary_cars);
+        for (size_t i = 0; i < snapshot->size; i++) {
+            Car *car = snapshot->data[i];
+            lock_car(car);
+            replicate(QREC_QUEUE, car, 0, NULL);
+            pthread_mutex_unlock(&car->mutex);
+        }
+        cv_read_unlock(primary_cars);
+        pthread_cond_signal(&stream.cond);
+    }
+    return NULL;
+}
+
+/**
+ * Starts a thread running start_routine(arg), detached if thread_id is NULL. Returns 0 on success, -1 otherwise.
+ */
+static int start_thread(void *(*start_routine)( void * ), void *arg, pthread_t *thread_id) {
+    pthread_t detached_id;
+    int result = pthread_create(thread_id != NULL ? thread_id : &detached_id, NULL, start_routine, arg);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(result));
+        return -1;
+    }
+    if (thread_id == NULL) {
+        pthread_detach(detached_id);
+    }
+    return 0;
+}
+
+int repl_serve(car_vector_t *cars, uint16_t port) {
+    primary_cars = cars;
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    int opt_enable = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
+        perror("setsockopt()");
+        close(listenfd);
+        return -1;
+    }
+
+    // The standby runs on the same host
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listenfd, 1) == -1) {
+        perror("bind()/listen() for replication");
+        close(listenfd);
+        return -1;
+    }
+
+    int *arg = malloc(sizeof(int));
+    if (arg == NULL) {
+        perror("malloc()");
+        close(listenfd);
+        return -1;
+    }
+    *arg = listenfd;
+    if (start_thread(repl_sender, NULL, NULL) == -1 || start_thread(repl_acceptor, arg, &acceptor_thread) == -1) {
+        free(arg);
+        close(listenfd);
+        return -1;
+    }
+    acceptor_fd = listenfd;
+    return 0;
+}
+
+void repl_stop(void) {
+    if (acceptor_fd == -1) {
+        return;
+    }
+    // Shutting the listening socket down wakes the acceptor up, the sender never looks at the cars
+    atomic_store(&stopping, 1);
+    shutdown(acceptor_fd, SHUT_RDWR);
+    pthread_join(acceptor_thread, NULL);
+    close(acceptor_fd);
+    acceptor_fd = -1;
+}
+
+void repl_follow(uint16_t port, queue_replica_t *replica) {
+    char endpoint[32];
+    snprintf(endpoint, sizeof(endpoint), "127.0.0.1:%u", port);
+    uint64_t start = now_ns();
+    int fd;
+    while ((fd = connect_controller(endpoint)) == -1) {
+        if (now_ns() - start > REPL_TIMEOUT_MS * 1000000ULL) {
+            printf("No primary on port %u, taking over\n", port);
+            fflush(stdout);
+            return;
+        }
+        usleep(REPL_HEARTBEAT_MS * 1000);
+    }
+    printf("Following the primary on port %u\n", port);
+    fflush(stdout);
+
+    // The records are read in chunks, a record per read would cost the standby more than the primary
+    char *buf = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    uint64_t records = 0;
+    const char *reason = "closed the stream";
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, REPL_TIMEOUT_MS);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            reason = "went silent";
+            break;
+        }
+        if (capacity - len < REPL_READ_SIZE) {
+            capacity = len + REPL_READ_SIZE;
+            char *new_buf = realloc(buf, capacity);
+            if (new_buf == NULL) {
+                perror("realloc()");
+                exit(EXIT_FAILURE);
+            }
+            buf = new_buf;
+        }
+        ssize_t received = read(fd, buf + len, capacity - len);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        len += received;
+
+        // Apply the complete records, keep a partial one for the next read
+        size_t offset = replica_apply_frames(replica, buf, len, &records);
+        memmove(buf, buf + offset, len - offset);
+        len -= offset;
+    }
+    free(buf);
+    close(fd);
+
+    size_t cars;
+    size_t nodes = replica_nodes(replica, &cars);
+    printf("Primary %s after %lu records, taking over the queues of %zu cars with %zu stops\n",
+        reason, (unsigned long) records, cars, nodes);
+    fflush(stdout);
+}
@@ -0,0 +1,56 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include "car_vector.h"
+#include "queue_record.h"
+
+/*
+ * Hot standby of the controller.
+ * The primary streams every node added to or removed from the queue of a car to the standby over a local socket.
+ * The standby keeps the latest queue of every car and takes over when the stream breaks or stays silent for REPL_TIMEOUT_MS.
+ * Replication is asynchronous: calls assigned within REPL_BATCH_US before the primary dies may be lost.
+ */
+
+#define REPL_HEARTBEAT_MS 50                // The primary sends a heartbeat after having nothing to send for this long
+#define REPL_TIMEOUT_MS 200                 // The standby takes over after hearing nothing from the primary for this long
+#define REPL_BATCH_US 1000                  // The primary collects changes for this long before sending them
+#define REPL_MAX_BACKLOG (16 * 1024 * 1024) // Bytes a standby may fall behind before the primary drops it
+
+/**
+ * Starts serving the replication stream to a single standby on the loopback port.
+ * The standby first receives the queues of all cars of the vector, then every change.
+ * Returns 0 on success, -1 if the port could not be listened on.
+ */
+int repl_serve( car_vector_t *cars, uint16_t port );
+
+/**
+ * Stops accepting standbys, after which the cars are no longer read. Records are still streamed to an attached
+ * standby. Does nothing if the primary does not replicate.
+ */
+void repl_stop( void );
+
+/**
+ * Replicates the node which was just linked into the car's queue. The car's mutex must be held.
+ * Does nothing without a standby, like all replicating functions.
+ */
+void repl_node_added( Car *car, const QueueNode *node );
+
+/**
+ * Replicates the removal of the head of the car's queue. The car's mutex must be held.
+ */
+void repl_head_removed( Car *car );
+
+/**
+ * Replicates the removal of a car which disconnected. The car's mutex must be held.
+ */
+void repl_car_removed( Car *car );
+
+/**
+ * Follows the primary serving the replication stream on the loopback port, rebuilding the cars' queues in the replica.
+ * Returns once the primary is gone, i.e. it closed the stream, was silent for REPL_TIMEOUT_MS or could not be
+ * reached within REPL_TIMEOUT_MS. Cars registering afterwards get their queue back with replica_restore().
+ */
+void repl_follow( uint16_t port, queue_replica_t *replica );
+
+#endif
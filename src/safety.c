@@ -16,108 +16,28 @@ They are used with:
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h> 
-#include <pthread.h>
+#include <time.h>
+#include <errno.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-
-#define FILE_PERMISSIONS 0666
-#define MAX_CAR_NAME_LENGTH 255 // Limit for the length of shared memory name
-#define SHM_NAME_PREFIX "/car"
-
-#define MAX_FLOOR_LENGTH 4
-#define MAX_STATUS_LENGTH 8
-
-typedef struct {
-    pthread_mutex_t mutex;                      // Locked while accessing struct contents
-    pthread_cond_t cond;                        // Signalled when the contents change
-    char current_floor[MAX_FLOOR_LENGTH];       // C string in the range B99-B1 and 1-999
-    char destination_floor[MAX_FLOOR_LENGTH];   // C string in the range B99-B1 and 1-999
-    char status[MAX_STATUS_LENGTH];             // C string indicating the elevator's status
-    uint8_t open_button;                        // 1 if open doors button is pressed, else 0
-    uint8_t close_button;                       // 1 if close doors button is pressed, else 0
-    uint8_t door_obstruction;                   // 1 if obstruction detected, else 0
-    uint8_t overload;                           // 1 if overload detected
-    uint8_t emergency_stop;                     // 1 if stop button has been pressed, else 0
-    uint8_t individual_service_mode;            // 1 if in individual service mode, else 0
-    uint8_t emergency_mode;                     // 1 if in emergency mode, else 0
-} car_shared_mem;
-
-car_shared_mem* open_shared_memory(const char * share_name) {
-    int fd = shm_open(share_name, O_RDWR, FILE_PERMISSIONS);
-    if (fd == -1) {
-        return NULL;
-    }
-
-    car_shared_mem *shm = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (shm == MAP_FAILED) {
-        (void) close(fd);
-        return NULL;
-    }
-
-    (void) close(fd);
+#include "shared.h"
 
-    return shm;
-}
-
-/*
-* Determines if a character is a digit.
-*/
-int is_digit(char c) {
-    return (c >= '0' && c <= '9') ? 1 : 0;
-}
+#define FULL_CHECK_INTERVAL_NS 100000000L   // A quiet car has all its fields checked this often
+#define FULL_CHECK_WAKEUPS 64U              // A busy car has all its fields checked every this many wakeups
 
 /*
-* Validates that the status string contains one of the valid status values.
+* Validates that the status is one of the valid status values.
+* A v1 writer storing an unknown status string leaves STATUS_INVALID.
 */
-int validate_status(const char status[MAX_STATUS_LENGTH]) {
-    return strncmp(status, "Open", MAX_STATUS_LENGTH) == 0
-        || strncmp(status, "Opening", MAX_STATUS_LENGTH) == 0
-        || strncmp(status, "Closed", MAX_STATUS_LENGTH) == 0
-        || strncmp(status, "Closing", MAX_STATUS_LENGTH) == 0
-        || strncmp(status, "Between", MAX_STATUS_LENGTH) == 0;
+int validate_status(uint8_t status) {
+    return status < (uint8_t) STATUS_COUNT;
 }
 
 /*
-* Validates that the floor string is in the correct format.
-* The format can be either "B##" or "###" where # is a digit (no leading zeros).
+* Validates that the floor is in the range B99-B1 or 1-999.
+* A v1 writer storing an invalid floor string (e.g. with leading zeros) leaves NO_FLOOR.
 */
-int validate_floor(const char floor[MAX_FLOOR_LENGTH]) {
-    size_t len = strlen(floor);
-
-    // Ensure it's not an empty string
-    if (len == 0U) {
-        return 0;
-    }
-    // Check for format: B##
-    if (floor[0] == 'B') {
-        // Floor number can't start with 0
-        if ((len < 2U) || (len > 3U) || (floor[1] == '0')) {
-            return 0;
-        }
-
-        // Check the remaining characters are digits
-        for (size_t i = 1U; i < len; i++) {
-            if (is_digit(floor[i]) == 0) {
-                return 0;
-            }
-        }
-    }
-    // Check for format: ###
-    else {
-        // Floor number can't start with 0
-        if ((len < 1U) || (len > 3U) || (floor[0] == '0')) {
-            return 0;
-        }
-
-        // Check all characters are digits
-        for (size_t i = 0U; i < len; i++) {
-            if (is_digit(floor[i]) == 0) {
-                return 0;
-            }
-        }
-    }
-    return 1;
+int validate_floor(floor_t floor) {
+    return floor_is_valid(floor);
 }
 
 /*
@@ -134,43 +54,54 @@ int validate_bools(car_shared_mem *shm) {
 }
 
 int validate_door_obstruction(car_shared_mem *shm) {
-    return shm->door_obstruction == 0 || strncmp(shm->status, "Opening", MAX_STATUS_LENGTH) == 0 || strncmp(shm->status, "Closing", MAX_STATUS_LENGTH) == 0;
+    return shm->door_obstruction == 0 || shm->state.status == (uint8_t) STATUS_OPENING || shm->state.status == (uint8_t) STATUS_CLOSING;
+}
+
+/*
+* Validates the fields in the dirty mask, everything if emergency mode changed since the fields were not validated
+* in emergency mode.
+*/
+int validate_dirty(car_shared_mem *shm, unsigned dirty) {
+    const unsigned flags = SHM_DIRTY_ALL & ~(SHM_DIRTY_STATUS | SHM_DIRTY_CURRENT_FLOOR | SHM_DIRTY_DESTINATION_FLOOR);
+    unsigned checked = ((dirty & SHM_DIRTY_EMERGENCY_MODE) != 0U) ? SHM_DIRTY_ALL : dirty;
+    return (((checked & SHM_DIRTY_CURRENT_FLOOR) == 0U) || validate_floor(shm->state.current_floor))
+        && (((checked & SHM_DIRTY_DESTINATION_FLOOR) == 0U) || validate_floor(shm->state.destination_floor))
+        && (((checked & SHM_DIRTY_STATUS) == 0U) || validate_status(shm->state.status))
+        && (((checked & flags) == 0U) || validate_bools(shm))
+        && (((checked & (SHM_DIRTY_STATUS | SHM_DIRTY_DOOR_OBSTRUCTION)) == 0U) || validate_door_obstruction(shm));
 }
 
 /*
-* Ensures that everything looks reasonable in the shared memory.
+* Ensures that everything in the dirty mask looks reasonable in the shared memory.
 * If something is wrong, it will take appropriate action.
 * Returns 1 if a change was made, 0 otherwise.
 */
-int check_safety(car_shared_mem *shm) {
+int check_safety(car_shared_mem *shm, unsigned dirty) {
     int change_occurred = 0;
     // Check for door obstruction
-    if (shm->door_obstruction == 1 && strncmp(shm->status, "Closing", MAX_STATUS_LENGTH) == 0) {
-        (void) strncpy(shm->status, "Opening", MAX_STATUS_LENGTH);
+    if (((dirty & (SHM_DIRTY_STATUS | SHM_DIRTY_DOOR_OBSTRUCTION)) != 0U)
+        && shm->door_obstruction == 1 && shm->state.status == (uint8_t) STATUS_CLOSING) {
+        shm_set_status(shm, STATUS_OPENING);
         change_occurred = 1;
     }
     // Check for emergency stop
-    if (shm->emergency_stop == 1 && shm->emergency_mode == 0) {
+    if (((dirty & (SHM_DIRTY_EMERGENCY_STOP | SHM_DIRTY_EMERGENCY_MODE)) != 0U)
+        && shm->emergency_stop == 1 && shm->emergency_mode == 0) {
         const char *msg = "The emergency stop button has been pressed!\n";
         (void) write(STDOUT_FILENO, msg, strlen(msg));
         shm->emergency_mode = 1;
         change_occurred = 1;
     }
     // Check for overload
-    if (shm->overload == 1 && shm->emergency_mode == 0) {
+    if (((dirty & (SHM_DIRTY_OVERLOAD | SHM_DIRTY_EMERGENCY_MODE)) != 0U)
+        && shm->overload == 1 && shm->emergency_mode == 0) {
         const char *msg = "The overload sensor has been tripped!\n";
         (void) write(STDOUT_FILENO, msg, strlen(msg));
         shm->emergency_mode = 1;
         change_occurred = 1;
     }
     // Validate data consistency
-    if (shm->emergency_mode != 1 && (
-        !validate_floor(shm->current_floor) ||
-        !validate_floor(shm->destination_floor) ||
-        !validate_status(shm->status) ||
-        !validate_bools(shm) ||
-        !validate_door_obstruction(shm))
-    ) {
+    if (shm->emergency_mode != 1 && !validate_dirty(shm, dirty)) {
         const char *msg = "Data consistency error!\n";
         (void) write(STDOUT_FILENO, msg, strlen(msg));
         shm->emergency_mode = 1;
@@ -181,18 +112,40 @@ int check_safety(car_shared_mem *shm) {
 
 /*
 * Monitors the shared memory for safety issues.
+* Only the fields changed since the change *seen_changes are checked. Changes made while not waiting are checked
+* right away, and if more than one change happened since the last check all fields are.
+* A field written without being marked changed would slip through, so all fields are also checked after
+* FULL_CHECK_INTERVAL_NS without a change and on every FULL_CHECK_WAKEUPS-th call, counted in *wakeups.
 */
-void monitor_safety(car_shared_mem *shm) {
-    if (pthread_mutex_lock(&shm->mutex) != 0) {
+void monitor_safety(car_shared_mem *shm, uint32_t *seen_changes, unsigned *wakeups) {
+    if (shm_lock(shm) != 0) {
         const char *msg = "Error locking mutex!\n";
         (void) write(STDOUT_FILENO, msg, strlen(msg));
     }
-    if (pthread_cond_wait(&shm->cond, &shm->mutex) != 0) {
-        const char *msg = "Error waiting on condition variable!\n";
-        (void) write(STDOUT_FILENO, msg, strlen(msg));
+    unsigned dirty = shm_changed_since(shm, seen_changes);
+    if (dirty == 0U) {
+        struct timespec timeout;
+        (void) clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += FULL_CHECK_INTERVAL_NS;
+        if (timeout.tv_nsec >= 1000000000L) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000L;
+        }
+        int result = shm_timedwait(shm, &timeout);
+        if (result == ETIMEDOUT) {
+            *wakeups = 0U;
+        } else if (result != 0) {
+            const char *msg = "Error waiting on condition variable!\n";
+            (void) write(STDOUT_FILENO, msg, strlen(msg));
+        }
+        dirty = shm_changed_since(shm, seen_changes);
+    }
+    if (*wakeups == 0U) {
+        dirty = SHM_DIRTY_ALL;
     }
+    *wakeups = (*wakeups + 1U) % FULL_CHECK_WAKEUPS;
 
-    int change_occurred = check_safety(shm);
+    int change_occurred = check_safety(shm, dirty);
     // There was a change in the shared memory -> broadcast the condition variable
     if (change_occurred) {
         if (pthread_cond_broadcast(&shm->cond) != 0) {
@@ -201,7 +154,7 @@ void monitor_safety(car_shared_mem *shm) {
         }
     }
 
-    if (pthread_mutex_unlock(&shm->mutex) != 0) {
+    if (shm_unlock(shm) != 0) {
         const char *msg = "Error unlocking mutex!\n";
         (void) write(STDOUT_FILENO, msg, strlen(msg));
     }
@@ -240,8 +193,11 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    // Checking starts with the next change
+    uint32_t seen_changes = atomic_load(&shm->state.changes);
+    unsigned wakeups = 0U;
     for ( ; ; ) {
-        monitor_safety(shm);
+        monitor_safety(shm, &seen_changes, &wakeups);
     }
 
     exit(EXIT_SUCCESS);
@@ -0,0 +1,861 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "scheduler.h"
+#include "histogram.h"
+
+static scheduler_hooks_t hooks;
+static dispatch_mode dispatch = DISPATCH_QUEUE_LENGTH;
+
+static const char *DISPATCH_NAMES[] = { "queue", "eta", "group", "auto" };
+
+// The strategy DISPATCH_AUTO uses per traffic pattern, grouping calls saves stops whenever many share floors
+static const dispatch_mode PATTERN_DISPATCH[TRAFFIC_PATTERN_COUNT] = {
+    [TRAFFIC_INTERFLOOR] = DISPATCH_ETA,
+    [TRAFFIC_UPPEAK] = DISPATCH_GROUP,
+    [TRAFFIC_DOWNPEAK] = DISPATCH_GROUP,
+    [TRAFFIC_LUNCH] = DISPATCH_GROUP
+};
+
+/**
+ * Scratch space of a thread for trying out where a call would be scheduled.
+ */
+typedef struct trial_space {
+    QueueNode *nodes;       // Copies of the queued nodes
+    uint64_t *etas;         // Arrival times at the copies before and after the trial, 2 * capacity
+    size_t capacity;        // The number of nodes that fit into nodes
+    object_pool_t pool;     // The nodes inserted by the trial
+} trial_space_t;
+
+static pthread_key_t trial_key;
+static pthread_once_t trial_key_once = PTHREAD_ONCE_INIT;
+
+#define GROUP_SLOTS 256
+
+/**
+ * The car recently chosen for calls from a source to a destination floor in DISPATCH_GROUP.
+ */
+typedef struct call_group {
+    floor_t source_floor;
+    floor_t destination_floor;
+    Car *car;                   // Only compared with the cars of a snapshot, it may be gone already
+    uint64_t chosen_ns;         // When the car was chosen for the last call of the group
+    unsigned calls;             // Calls in the group
+} call_group_t;
+
+// The groups are hashed by floors, a group simply replaces an older one of the same slot
+static call_group_t groups[GROUP_SLOTS];
+static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define DEMAND_SLOT_NS (DEMAND_SLOT_MINUTES * 60 * 1000000000ULL)
+
+// Calls per source floor and slot of the day, counted without locks: a lost count only skews parking a little
+static _Atomic uint32_t demand[DEMAND_SLOTS][FLOOR_COUNT];
+static _Atomic uint32_t demand_calls[DEMAND_SLOTS];
+
+// Idle cars parked per floor, guarded by parking_mutex like the cars' parking_floor
+static uint16_t parked[FLOOR_COUNT];
+static pthread_mutex_t parking_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void scheduler_init(const scheduler_hooks_t *scheduler_hooks, dispatch_mode mode) {
+    hooks = *scheduler_hooks;
+    dispatch = mode;
+}
+
+int dispatch_mode_parse(const char *name, dispatch_mode *mode) {
+    for (size_t i = 0; i < sizeof(DISPATCH_NAMES) / sizeof(DISPATCH_NAMES[0]); i++) {
+        if (strcmp(name, DISPATCH_NAMES[i]) == 0) {
+            *mode = (dispatch_mode) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char * dispatch_mode_name(dispatch_mode mode) {
+    return DISPATCH_NAMES[mode];
+}
+
+/**
+ * Locks the car's mutex, recording the time spent waiting if it was contended.
+ */
+void lock_car(Car *car) {
+    if (pthread_mutex_trylock(&car->mutex) == 0) {
+        return;
+    }
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&car->mutex);
+    if (hooks.lock_wait != NULL) {
+        hooks.lock_wait(now_ns() - start);
+    }
+}
+
+static void queue_stats_init(Car *car) {
+    memset(&car->stats, 0, sizeof(car->stats));
+    car->stats.farthest_up = NO_FLOOR;
+    car->stats.farthest_down = NO_FLOOR;
+}
+
+void car_state_init(Car *car, floor_t lowest_floor, floor_t highest_floor) {
+    car->lowest_floor = lowest_floor;
+    car->highest_floor = highest_floor;
+    car->status = STATUS_CLOSED;
+    car->current_floor = lowest_floor;
+    car->destination_floor = lowest_floor;
+    car->delay_ns = 0;
+    car->moved_ns = 0;
+    car->queue = NULL;
+    car->trial = 0;
+    car->parking_floor = NO_FLOOR;
+    queue_stats_init(car);
+    car->floor_nodes = calloc(2 * (highest_floor - lowest_floor + 1), sizeof(uint16_t));
+    if (car->floor_nodes == NULL) {
+        perror("calloc()");
+    }
+}
+
+/**
+ * Returns the counter of the car's queued nodes for the floor and direction.
+ */
+static uint16_t * floor_nodes_at(Car *car, floor_t floor, char direction) {
+    size_t range = car->highest_floor - car->lowest_floor + 1;
+    return &car->floor_nodes[DIRECTION_INDEX(direction) * range + (floor - car->lowest_floor)];
+}
+
+/**
+ * Accounts for a node which was just linked into the queue after pred (NULL if the node is the new head).
+ */
+static void queue_stats_add(Car *car, QueueNode *pred, QueueNode *node) {
+    queue_stats_t *stats = &car->stats;
+    QueueNode *next = node->next;
+
+    stats->nodes++;
+    stats->direction_nodes[DIRECTION_INDEX(node->direction)]++;
+
+    // The node splits the leg pred -> next into pred -> node -> next
+    if (pred != NULL) {
+        stats->route_floors += floor_distance(pred->floor, node->floor);
+    }
+    if (next != NULL) {
+        stats->route_floors += floor_distance(node->floor, next->floor);
+    }
+    if (pred != NULL && next != NULL) {
+        stats->route_floors -= floor_distance(pred->floor, next->floor);
+    }
+    int node_stops = pred == NULL || pred->floor != node->floor;
+    int next_stopped = next != NULL && (pred == NULL || pred->floor != next->floor);
+    int next_stops = next != NULL && node->floor != next->floor;
+    stats->route_stops += node_stops + next_stops - next_stopped;
+
+    if (node->direction == UP && (stats->farthest_up == NO_FLOOR || node->floor > stats->farthest_up)) {
+        stats->farthest_up = node->floor;
+    }
+    if (node->direction == DOWN && (stats->farthest_down == NO_FLOOR || node->floor < stats->farthest_down)) {
+        stats->farthest_down = node->floor;
+    }
+    if (car->floor_nodes != NULL) {
+        (*floor_nodes_at(car, node->floor, node->direction))++;
+    }
+}
+
+/**
+ * Accounts for the head of the queue, which is about to be unlinked.
+ */
+static void queue_stats_remove_head(Car *car) {
+    queue_stats_t *stats = &car->stats;
+    QueueNode *head = car->queue;
+    QueueNode *next = head->next;
+    char direction = head->direction;
+
+    stats->nodes--;
+    stats->direction_nodes[DIRECTION_INDEX(direction)]--;
+
+    stats->route_stops--;
+    if (next != NULL) {
+        stats->route_floors -= floor_distance(head->floor, next->floor);
+        // The next node shared the head's stop, now it makes its own
+        if (next->floor == head->floor) {
+            stats->route_stops++;
+        }
+    }
+
+    if (car->floor_nodes == NULL) {
+        return;
+    }
+    uint16_t *count = floor_nodes_at(car, head->floor, direction);
+    (*count)--;
+    floor_t *farthest = direction == UP ? &stats->farthest_up : &stats->farthest_down;
+    if (*count > 0 || *farthest != head->floor) {
+        return;
+    }
+    // The farthest node of the direction is gone -> find the next farthest one
+    if (stats->direction_nodes[DIRECTION_INDEX(direction)] == 0) {
+        *farthest = NO_FLOOR;
+        return;
+    }
+    char towards = direction == UP ? DOWN : UP;
+    floor_t floor = head->floor;
+    do {
+        floor = floor_next(floor, towards);
+    } while (*floor_nodes_at(car, floor, direction) == 0);
+    *farthest = floor;
+}
+
+/**
+ * Adds a new node to the car's queue right after the given node.
+ * The node is taken from the car's node pool, so the car's mutex must be held.
+ * The given node may also be the virtual node of schedule_floors, the node then becomes the head of the queue.
+ * Returns the new node, or the neighbour already stopping at the floor in the direction.
+ */
+static QueueNode * queue_add(Car *car, QueueNode *after, floor_t floor, char direction) {
+    // Only the virtual node precedes the head of the queue
+    int after_virtual = after->next == car->queue;
+    // Do not add the same floor+direction twice in a row, one stop serves both
+    if (after->next != NULL && after->next->floor == floor && after->next->direction == direction) {
+        return after->next;
+    }
+    if (!after_virtual && after->floor == floor && after->direction == direction) {
+        return after;
+    }
+    
+    QueueNode *new_node = pool_alloc(&car->node_pool);
+    if (new_node == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    new_node->floor = floor;
+    new_node->direction = direction;
+    new_node->called_ns = 0;
+    new_node->queued_ns = hooks.now();
+    new_node->next = after->next;
+    after->next = new_node;
+    if (after_virtual) {
+        car->queue = new_node;
+    }
+    queue_stats_add(car, after_virtual ? NULL : after, new_node);
+    if (hooks.node_added != NULL && !car->trial) {
+        hooks.node_added(car, new_node);
+    }
+    return new_node;
+}
+
+/*
+* Removes the first node from the car's queue.
+*/
+static void queue_pop(Car *car) {
+    if (car->queue == NULL) {
+        return;
+    }
+    if (hooks.picked_up != NULL && car->queue->called_ns != 0 && !car->trial) {
+        hooks.picked_up(car, hooks.now() - car->queue->called_ns);
+    }
+    if (hooks.head_removed != NULL && !car->trial) {
+        hooks.head_removed(car);
+    }
+    queue_stats_remove_head(car);
+    QueueNode *temp = car->queue;
+    car->queue = car->queue->next;
+    pool_free(&car->node_pool, temp);
+}
+
+/*
+* Removes the first node from the car's queue if the floor matches.
+*/
+static void queue_pop_single(Car *car, floor_t floor) {
+    if (car->queue == NULL) {
+        return;
+    }
+    if (car->queue->floor == floor) {
+        queue_pop(car);
+    }
+}
+
+/*
+* Removes the first two nodes from the car's queue if the floors match.
+* The need for removing two nodes is because the same floor can be added twice with different directions.
+*/
+static void queue_pop_double(Car *car, floor_t floor) {
+    queue_pop_single(car, floor);
+    queue_pop_single(car, floor);
+}
+
+/**
+ * Fills virtual_node with the car's current floor and links it in front of the queue.
+ * The node lives on the caller's stack, only car->queue is left pointing past it.
+ * Returns 1 if the node should be used, 0 otherwise (car is 'BETWEEN' and current floor is already at the front of the queue).
+ */
+static int add_virtual_node(Car *car, char direction, QueueNode *virtual_node) {
+    virtual_node->next = car->queue;
+
+    // If the car's status is Between we consider the current floor to be the next floor the elevator would go to
+    if (car->status == STATUS_BETWEEN) {
+        direction = car->current_floor <= car->destination_floor ? UP : DOWN;
+
+        // Increment or decrement the floor based on the direction
+        floor_t next_floor = floor_next(car->current_floor, direction);
+        // If the next floor is the destination floor (and in the queue), we don't need to add it to the queue
+        if (next_floor == car->destination_floor && car->queue != NULL) {
+            return 0;
+        }
+
+        virtual_node->floor = next_floor;
+        virtual_node->direction = direction;
+        return 1;
+    }
+    // If the car's status is anything else, the current floor is current floor...
+    // Now we need to determine the direction
+    // If the queue is empty, set the direction to the direction being requested by the call (in parameter)
+    if (car->queue != NULL) {
+        // If the first real entry in the queue is the same floor as the current floor, just take that entry's direction
+        if (car->current_floor == car->queue->floor) {
+            direction = car->queue->direction;
+        }
+        // Otherwise, base the direction by looking whether the car would have to go up or down to get to the first real entry in the queue
+        else {
+            direction = car->current_floor <= car->queue->floor ? UP : DOWN;
+        }
+    }
+
+    virtual_node->floor = car->current_floor;
+    virtual_node->direction = direction;
+    return 1;
+}
+
+/**
+ * Checks if the order of the source and destination floors is valid in respect to the given direction.
+ * Returns 1 if the order is valid, 0 otherwise. If the floors are the same, the order is always valid.
+ */
+static int is_valid_order(floor_t source_floor, floor_t destination_floor, char direction) {
+    // Same floor -> valid order
+    if (source_floor == destination_floor) {
+        return 1;
+    }
+    if (direction == UP && source_floor <= destination_floor) {
+        return 1;
+    }
+    if (direction == DOWN && destination_floor <= source_floor) {
+        return 1;
+    }
+    return 0;
+}
+
+void schedule_floors(Car * car, floor_t source_floor, floor_t destination_floor) {
+    char direction = source_floor <= destination_floor ? UP : DOWN;
+    // The car has work again -> it leaves its parking floor
+    if (!car->trial && car->parking_floor != NO_FLOOR) {
+        parking_release(car);
+    }
+
+    QueueNode virtual_node;
+    int virtual_added = add_virtual_node(car, direction, &virtual_node);
+    QueueNode *head = virtual_added ? &virtual_node : car->queue;
+    // Find the suitable position to insert the source and destination floors
+    QueueNode *current = head->next;
+    QueueNode *prev = head;
+    QueueNode *suitable_pos = NULL;
+
+    // A special case is when the from floor is equal to the current floor (the virtual first item in the queue) and in the same direction.
+    // If the status is Closing - it's too late, so the from and to floors will need to be inserted into the 3rd block.
+    if (head->floor == source_floor
+        && head->direction == direction
+        && car->status == STATUS_CLOSING
+        && current != NULL) {
+        prev = current;
+        current = current->next;
+    }
+
+    while (current != NULL) {
+        // We moved to another block -> reset previously found suitable position
+        if (prev->direction != current->direction) {
+            suitable_pos = NULL;
+        }
+
+        // We are in the block with different direction -> there is no suitable position
+        if (prev->direction == current->direction && prev->direction != direction) {
+            prev = current;
+            current = current->next;
+            continue;
+        }
+
+        if ((prev->direction != direction || is_valid_order(prev->floor, source_floor, direction))
+        && (current->direction != direction || is_valid_order(source_floor, current->floor, direction))) {
+            suitable_pos = prev;
+        }
+        if (suitable_pos != NULL
+        && (prev->direction != direction || is_valid_order(prev->floor, destination_floor, direction))
+        && (current->direction != direction || is_valid_order(destination_floor, current->floor, direction))) {
+            break;
+        }
+
+        prev = current;
+        current = current->next;
+    }
+    // No suitable position found -> add to the end
+    QueueNode *source_node;
+    if (!suitable_pos) {
+        source_node = queue_add(car, prev, source_floor, direction);
+        queue_add(car, source_node, destination_floor, direction);
+    }
+    // Suitable position found -> add at the suitable position
+    else {
+        source_node = queue_add(car, suitable_pos, source_floor, direction);
+        prev = (suitable_pos == prev) ? source_node : prev;
+        queue_add(car, prev, destination_floor, direction);
+    }
+    // The passenger waits from now on, unless an earlier one already waits at the node
+    if (!car->trial && source_node->called_ns == 0) {
+        source_node->called_ns = hooks.now();
+    }
+    // Nodes inserted right after the virtual node already became the head of the queue in queue_add
+}
+
+void send_queue_head(Car *car) {
+    // The car's destination floor differs from the first floor in the queue
+    // or the car's current floor is equal to the first floor in the queue
+    // -> message the car
+    if (car->destination_floor != car->queue->floor || car->current_floor == car->queue->floor) {
+        hooks.send_floor(car, car->queue->floor);
+    }
+}
+
+void queue_restore(Car *car, const QueueNode *nodes, size_t count) {
+    // Appending after the tail, or after a virtual node preceding the empty queue
+    QueueNode virtual_node = { .next = NULL };
+    QueueNode *tail = &virtual_node;
+    for (QueueNode *node = car->queue; node != NULL; node = node->next) {
+        tail = node;
+    }
+    for (size_t i = 0; i < count; i++) {
+        // Nodes replicated before the car's floor range changed would not fit its per-floor counters
+        if (nodes[i].floor < car->lowest_floor || nodes[i].floor > car->highest_floor
+            || (nodes[i].direction != UP && nodes[i].direction != DOWN)) {
+            continue;
+        }
+        tail = queue_add(car, tail, nodes[i].floor, nodes[i].direction);
+    }
+}
+
+uint64_t car_delay_ns(Car *car) {
+    return car->delay_ns != 0 ? car->delay_ns : DEFAULT_CAR_DELAY_NS;
+}
+
+/**
+ * Returns a consistent copy of the car's queue aggregates, including the projected time to serve the whole queue.
+ */
+queue_stats_t queue_stats_snapshot(Car *car) {
+    lock_car(car);
+    queue_stats_t stats = car->stats;
+    floor_t first_floor = car->queue != NULL ? car->queue->floor : car->current_floor;
+    floor_t current_floor = car->current_floor;
+    uint64_t delay = car_delay_ns(car);
+    pthread_mutex_unlock(&car->mutex);
+
+    stats.completion_ns = (floor_distance(current_floor, first_floor) + stats.route_floors) * delay
+        + stats.route_stops * DOOR_CYCLE_DELAYS * delay;
+    return stats;
+}
+
+/**
+ * Walks the queue the way the car is going to serve it and estimates when it arrives at every stop.
+ * Returns the sum of the arrival times of the nodes stored in existing[0..nexisting), or of all nodes if existing is NULL.
+ * If pickup_eta is not NULL, it is set to the arrival time at the first node matching the floor and direction.
+ * If etas is not NULL, the arrival time at existing[i] is stored in etas[i].
+ */
+static uint64_t queue_eta_sum(Car *car, QueueNode *queue, const QueueNode *existing, size_t nexisting,
+                       floor_t floor, char direction, uint64_t *pickup_eta, uint64_t *etas) {
+    uint64_t delay = car_delay_ns(car);
+    uint64_t time = 0;
+    uint64_t sum = 0;
+    floor_t position = car->current_floor;
+    // The doors are already open at the current floor -> nodes for it need no extra door cycle
+    int stopped = car->status == STATUS_OPENING || car->status == STATUS_OPEN;
+
+    // Finish the door cycle in progress
+    if (car->status == STATUS_OPENING || car->status == STATUS_OPEN || car->status == STATUS_CLOSING) {
+        int phase = car->status == STATUS_OPENING ? 0 : car->status == STATUS_OPEN ? 1 : 2;
+        time += (DOOR_CYCLE_DELAYS - phase) * delay;
+    }
+
+    for (QueueNode *node = queue; node != NULL; node = node->next) {
+        if (node->floor != position) {
+            time += floor_distance(position, node->floor) * delay;
+            position = node->floor;
+            stopped = 0;
+        }
+        if (existing == NULL || (node >= existing && node < existing + nexisting)) {
+            sum += time;
+            if (etas != NULL) {
+                etas[node - existing] = time;
+            }
+        }
+        if (pickup_eta != NULL && node->floor == floor && node->direction == direction) {
+            *pickup_eta = time;
+            pickup_eta = NULL;
+        }
+        // Consecutive nodes for the same floor are served by a single stop
+        if (!stopped) {
+            time += DOOR_CYCLE_DELAYS * delay;
+            stopped = 1;
+        }
+    }
+    return sum;
+}
+
+static void free_trial_space(void *arg) {
+    trial_space_t *space = arg;
+    pool_destroy(&space->pool);
+    free(space->nodes);
+    free(space->etas);
+    free(space);
+}
+
+static void create_trial_key(void) {
+    pthread_key_create(&trial_key, free_trial_space);
+}
+
+/**
+ * Returns the calling thread's trial space, creating it on first use. Returns NULL on failure.
+ */
+static trial_space_t * get_trial_space(void) {
+    pthread_once(&trial_key_once, create_trial_key);
+    trial_space_t *space = pthread_getspecific(trial_key);
+    if (space == NULL) {
+        space = calloc(1, sizeof(trial_space_t));
+        if (space == NULL) {
+            perror("calloc()");
+            return NULL;
+        }
+        pool_init(&space->pool, sizeof(QueueNode), NODE_POOL_SLAB_SIZE);
+        pthread_setspecific(trial_key, space);
+    }
+    return space;
+}
+
+/**
+ * Estimates the cost of the car serving the call: the time until it picks up the passenger
+ * plus the delay the call adds to all stops already in the car's queue.
+ * The call is scheduled into a copy of the queue with schedule_floors, the car's mutex must be held.
+ * With DISPATCH_GROUP, every stop the call adds to the queue costs another GROUP_STOP_PENALTY door cycles,
+ * and delaying a stop queued more than GROUP_MAX_STOP_AGE_DELAYS ago costs GROUP_HOLD_UP_WEIGHT times the delay.
+ */
+static uint64_t dispatch_cost(Car *car, floor_t source_floor, floor_t destination_floor, dispatch_mode mode) {
+    trial_space_t *space = get_trial_space();
+    if (space == NULL) {
+        return UINT64_MAX;
+    }
+
+    size_t length = car->stats.nodes;
+    if (length > space->capacity) {
+        QueueNode *nodes = realloc(space->nodes, length * sizeof(QueueNode));
+        if (nodes == NULL) {
+            perror("realloc()");
+            return UINT64_MAX;
+        }
+        space->nodes = nodes;
+        uint64_t *etas = realloc(space->etas, 2 * length * sizeof(uint64_t));
+        if (etas == NULL) {
+            perror("realloc()");
+            return UINT64_MAX;
+        }
+        space->etas = etas;
+        space->capacity = length;
+    }
+    QueueNode *trial_nodes = space->nodes;
+
+    // Copy the queue, the copies keep their order in trial_nodes
+    Car trial;
+    trial.status = car->status;
+    trial.current_floor = car->current_floor;
+    trial.destination_floor = car->destination_floor;
+    trial.delay_ns = car->delay_ns;
+    trial.node_pool = space->pool;
+    trial.stats = car->stats;
+    trial.floor_nodes = NULL;
+    trial.trial = 1;
+    trial.queue = length > 0 ? trial_nodes : NULL;
+    size_t i = 0;
+    for (QueueNode *node = car->queue; node != NULL; node = node->next, i++) {
+        trial_nodes[i] = *node;
+        trial_nodes[i].next = i + 1 < length ? &trial_nodes[i + 1] : NULL;
+    }
+
+    // With DISPATCH_GROUP the arrival times at every stop are compared, else only their sums
+    uint64_t *before_etas = mode == DISPATCH_GROUP ? space->etas : NULL;
+    uint64_t *after_etas = mode == DISPATCH_GROUP ? space->etas + length : NULL;
+    char direction = source_floor <= destination_floor ? UP : DOWN;
+    uint64_t before = queue_eta_sum(&trial, trial.queue, trial_nodes, length, source_floor, direction, NULL,
+                                    before_etas);
+
+    schedule_floors(&trial, source_floor, destination_floor);
+
+    uint64_t pickup_eta = UINT64_MAX;
+    uint64_t after = queue_eta_sum(&trial, trial.queue, trial_nodes, length, source_floor, direction, &pickup_eta,
+                                   after_etas);
+
+    // Return the nodes inserted by schedule_floors to the pool
+    for (QueueNode *node = trial.queue; node != NULL; ) {
+        QueueNode *next = node->next;
+        if (node < trial_nodes || node >= trial_nodes + length) {
+            pool_free(&trial.node_pool, node);
+        }
+        node = next;
+    }
+    space->pool = trial.node_pool;
+
+    if (pickup_eta == UINT64_MAX) {
+        return UINT64_MAX;
+    }
+    uint64_t cost = pickup_eta + (after > before ? after - before : 0);
+    if (mode == DISPATCH_GROUP && trial.stats.route_stops > car->stats.route_stops) {
+        cost += (trial.stats.route_stops - car->stats.route_stops) * GROUP_STOP_PENALTY * DOOR_CYCLE_DELAYS
+            * car_delay_ns(car);
+    }
+    // Reusing a car's stops must not keep its oldest riders and callers waiting forever
+    if (mode == DISPATCH_GROUP) {
+        uint64_t now = hooks.now();
+        uint64_t max_age = GROUP_MAX_STOP_AGE_DELAYS * car_delay_ns(car);
+        for (size_t j = 0; j < length; j++) {
+            if (after_etas[j] > before_etas[j] && now - trial_nodes[j].queued_ns > max_age) {
+                cost += (after_etas[j] - before_etas[j]) * GROUP_HOLD_UP_WEIGHT;
+            }
+        }
+    }
+    return cost;
+}
+
+static call_group_t * group_slot(floor_t source_floor, floor_t destination_floor) {
+    unsigned hash = (uint16_t) source_floor * 31u + (uint16_t) destination_floor;
+    return &groups[hash % GROUP_SLOTS];
+}
+
+/**
+ * Returns the group of the calls from the source to the destination floor, or a copy of an unused one.
+ */
+static call_group_t group_lookup(floor_t source_floor, floor_t destination_floor) {
+    call_group_t none = { .source_floor = source_floor, .destination_floor = destination_floor, .car = NULL };
+    pthread_mutex_lock(&groups_mutex);
+    call_group_t group = *group_slot(source_floor, destination_floor);
+    pthread_mutex_unlock(&groups_mutex);
+    if (group.source_floor != source_floor || group.destination_floor != destination_floor) {
+        return none;
+    }
+    return group;
+}
+
+/**
+ * Returns 1 if the call can join the group's car: the car still has to pick the group up, the last call of the group
+ * was less than GROUP_WINDOW_DELAYS ago, the group is not full and none of the car's stops was queued more than
+ * GROUP_MAX_STOP_AGE_DELAYS ago. The car must be in the caller's snapshot.
+ */
+static int group_joinable(const call_group_t *group, Car *car) {
+    if (group->calls >= GROUP_MAX_CALLS) {
+        return 0;
+    }
+    char direction = group->source_floor <= group->destination_floor ? UP : DOWN;
+    uint64_t now = hooks.now();
+    lock_car(car);
+    int pending = car->floor_nodes != NULL && *floor_nodes_at(car, group->source_floor, direction) > 0;
+    uint64_t window = GROUP_WINDOW_DELAYS * car_delay_ns(car);
+    uint64_t max_age = GROUP_MAX_STOP_AGE_DELAYS * car_delay_ns(car);
+    // Joining adds another door cycle at the stop, which the car's long queued stops should not wait for
+    for (QueueNode *node = car->queue; pending && node != NULL; node = node->next) {
+        pending = now - node->queued_ns <= max_age;
+    }
+    pthread_mutex_unlock(&car->mutex);
+    return pending && now - group->chosen_ns < window;
+}
+
+/**
+ * Remembers the car chosen for a call from the source to the destination floor.
+ */
+static void group_remember(floor_t source_floor, floor_t destination_floor, Car *car, int joined) {
+    pthread_mutex_lock(&groups_mutex);
+    call_group_t *group = group_slot(source_floor, destination_floor);
+    if (!joined || group->source_floor != source_floor || group->destination_floor != destination_floor) {
+        group->source_floor = source_floor;
+        group->destination_floor = destination_floor;
+        group->calls = 0;
+    }
+    group->car = car;
+    group->chosen_ns = hooks.now();
+    group->calls++;
+    pthread_mutex_unlock(&groups_mutex);
+}
+
+static size_t demand_slot(void) {
+    return hooks.time_of_day() / DEMAND_SLOT_NS % DEMAND_SLOTS;
+}
+
+/**
+ * Counts a call from the floor in the current slot of the demand histogram.
+ * Every DEMAND_HALVING_CALLS calls the slot's counters are halved, so that the demand follows changes over the days.
+ */
+static void demand_record(floor_t floor) {
+    size_t slot = demand_slot();
+    atomic_fetch_add_explicit(&demand[slot][floor - MIN_FLOOR], 1, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&demand_calls[slot], 1, memory_order_relaxed) + 1 < DEMAND_HALVING_CALLS) {
+        return;
+    }
+    atomic_store_explicit(&demand_calls[slot], DEMAND_HALVING_CALLS / 2, memory_order_relaxed);
+    for (size_t i = 0; i < FLOOR_COUNT; i++) {
+        uint32_t count = atomic_load_explicit(&demand[slot][i], memory_order_relaxed);
+        atomic_store_explicit(&demand[slot][i], count / 2, memory_order_relaxed);
+    }
+}
+
+void parking_release(Car *car) {
+    if (car->parking_floor == NO_FLOOR) {
+        return;
+    }
+    pthread_mutex_lock(&parking_mutex);
+    parked[car->parking_floor - MIN_FLOOR]--;
+    car->parking_floor = NO_FLOOR;
+    pthread_mutex_unlock(&parking_mutex);
+}
+
+/**
+ * Parks the idle car at the floor in its range with the highest demand in the current and the next slot,
+ * halved for every car already parked there. Ties go to the floor closest to the car, and without any demand
+ * the car stays where it is. The car's mutex must be held.
+ */
+static void park_car(Car *car) {
+    size_t slot = demand_slot();
+    size_t next_slot = (slot + 1) % DEMAND_SLOTS;
+
+    pthread_mutex_lock(&parking_mutex);
+    if (car->parking_floor != NO_FLOOR) {
+        parked[car->parking_floor - MIN_FLOOR]--;
+        car->parking_floor = NO_FLOOR;
+    }
+    floor_t best_floor = NO_FLOOR;
+    uint64_t best_score = 0;
+    for (floor_t floor = car->lowest_floor; ; floor = floor_next(floor, UP)) {
+        size_t i = floor - MIN_FLOOR;
+        uint64_t calls = atomic_load_explicit(&demand[slot][i], memory_order_relaxed)
+            + atomic_load_explicit(&demand[next_slot][i], memory_order_relaxed);
+        uint64_t score = parked[i] < 64 ? calls >> parked[i] : 0;
+        if (score > best_score || (score == best_score && score > 0
+            && floor_distance(car->current_floor, floor) < floor_distance(car->current_floor, best_floor))) {
+            best_floor = floor;
+            best_score = score;
+        }
+        if (floor == car->highest_floor) {
+            break;
+        }
+    }
+    if (best_floor != NO_FLOOR) {
+        parked[best_floor - MIN_FLOOR]++;
+        car->parking_floor = best_floor;
+    }
+    pthread_mutex_unlock(&parking_mutex);
+
+    if (best_floor != NO_FLOOR && best_floor != car->current_floor) {
+        hooks.send_floor(car, best_floor);
+    }
+}
+
+/**
+ * Returns the car of the snapshot that is the most suitable for the call.
+ * With DISPATCH_QUEUE_LENGTH the most suitable car is the least busy one - the one with the least entries in the queue.
+ * With DISPATCH_ETA it is the one with the lowest dispatch_cost().
+ * With DISPATCH_GROUP it is the car the previous calls between the same floors were assigned to, as long as they can
+ * still be picked up together (see group_joinable()), otherwise the one with the lowest dispatch_cost().
+ * With DISPATCH_AUTO it is the car of the strategy PATTERN_DISPATCH maps the detected traffic pattern to.
+ * If no car is suitable, returns NULL.
+ */
+Car * choose_car(const cv_snapshot_t *snapshot, floor_t source_floor, floor_t destination_floor) {
+    Car * car = NULL;
+    uint64_t min_cost = UINT64_MAX;
+    call_group_t group = { .car = NULL };
+    int joined = 0;
+    if (hooks.time_of_day != NULL) {
+        demand_record(source_floor);
+    }
+    dispatch_mode mode = dispatch;
+    if (mode == DISPATCH_AUTO) {
+        traffic_pattern from;
+        traffic_pattern pattern = traffic_record(source_floor, destination_floor, &from);
+        mode = PATTERN_DISPATCH[pattern];
+        if (pattern != from && hooks.traffic_changed != NULL) {
+            hooks.traffic_changed(from, pattern, mode);
+        }
+    }
+    if (mode == DISPATCH_GROUP) {
+        group = group_lookup(source_floor, destination_floor);
+    }
+
+    // Only the cars that can go to the source and destination floors are candidates
+    const uint64_t *source_cars = cv_floor_cars(snapshot, source_floor);
+    const uint64_t *destination_cars = cv_floor_cars(snapshot, destination_floor);
+    for (size_t word = 0; word < snapshot->words && !joined; word++) {
+        for (uint64_t candidates = source_cars[word] & destination_cars[word]; candidates != 0; candidates &= candidates - 1) {
+            Car *current_car = snapshot->data[word * 64 + __builtin_ctzll(candidates)];
+            // The group's car is still registered -> ride along if it has not picked the group up yet
+            if (current_car == group.car && group_joinable(&group, current_car)) {
+                car = current_car;
+                joined = 1;
+                break;
+            }
+            uint64_t cost;
+            if (mode == DISPATCH_ETA || mode == DISPATCH_GROUP) {
+                lock_car(current_car);
+                cost = dispatch_cost(current_car, source_floor, destination_floor, mode);
+                pthread_mutex_unlock(&current_car->mutex);
+            } else {
+                cost = queue_stats_snapshot(current_car).nodes;
+            }
+            // Cheaper car found -> new ideal car
+            if (car == NULL || cost < min_cost) {
+                min_cost = cost;
+                car = current_car;
+            }
+        }
+    }
+
+    if (mode == DISPATCH_GROUP && car != NULL) {
+        group_remember(source_floor, destination_floor, car, joined);
+    }
+    return car;
+}
+
+/**
+ * Updates the car's state based on the received status, current floor and destination floor.
+ * If the car has arrived at the destination floor, the floor is removed from the queue.
+ * If there are more floors in the queue, the next floor is scheduled.
+ */
+void update_car_state(Car *car, car_status status, floor_t current_floor, floor_t destination_floor) {
+    // The call handlers estimate arrival times from the state and the delay with the mutex held
+    lock_car(car);
+    // Every floor passed takes one delay -> measure it for estimating arrival times
+    if (status == STATUS_BETWEEN) {
+        uint64_t now = hooks.now();
+        if (car->status == STATUS_BETWEEN && car->current_floor != current_floor && car->moved_ns != 0) {
+            uint64_t sample = now - car->moved_ns;
+            car->delay_ns = car->delay_ns == 0 ? sample : (car->delay_ns * (DELAY_SMOOTHING - 1) + sample) / DELAY_SMOOTHING;
+        }
+        if (car->status != STATUS_BETWEEN || car->current_floor != current_floor) {
+            car->moved_ns = now;
+        }
+    }
+
+    car->status = status;
+    car->current_floor = current_floor;
+    car->destination_floor = destination_floor;
+
+    // The car did not arrive at the destination floor yet -> no further action required
+    if (status != STATUS_OPENING || current_floor != destination_floor) {
+        pthread_mutex_unlock(&car->mutex);
+        return;
+    }
+    // Remove the current/destination floor from the queue
+    queue_pop_double(car, current_floor);
+    // Schedule the next floor if there is one, otherwise wait where the next call is likely to come from
+    if (car->queue != NULL) {
+        hooks.send_floor(car, car->queue->floor);
+    } else if (hooks.time_of_day != NULL) {
+        park_car(car);
+    }
+    pthread_mutex_unlock(&car->mutex);
+}
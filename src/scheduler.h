@@ -0,0 +1,146 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "shared.h"
+#include "car_vector.h"
+#include "traffic.h"
+
+/*
+ * The controller's scheduling logic: the cars' queues, the choice of the car serving a call and
+ * the reaction to the cars' status updates.
+ * It does not talk to sockets or read the clock itself but goes through scheduler_hooks_t,
+ * so that the simulator can run the very same code against virtual cars in virtual time.
+ */
+
+#define DOOR_CYCLE_DELAYS 3                     // Opening, Open and Closing take one car delay each
+#define DEFAULT_CAR_DELAY_NS 1000000000ULL      // Assumed car delay until it has been measured
+#define DELAY_SMOOTHING 4                       // Weight of the previous estimate in the car delay average
+#define GROUP_WINDOW_DELAYS 10                  // Calls this many car delays apart are not grouped anymore
+#define GROUP_MAX_CALLS 8                       // Calls grouped into one pickup, about what fits into a car
+#define GROUP_STOP_PENALTY 3                    // Door cycles a stop added by a call costs on top of its delays
+#define GROUP_MAX_STOP_AGE_DELAYS 10            // Stops queued this many car delays ago are not held up for grouping
+#define GROUP_HOLD_UP_WEIGHT 100                // How much more holding up such a stop costs than its delay
+#define DEMAND_SLOT_MINUTES 30                  // Time of day covered by a slot of the call demand histogram
+#define DEMAND_SLOTS (24 * 60 / DEMAND_SLOT_MINUTES)
+#define DEMAND_HALVING_CALLS 1024               // A slot halves its counters after this many calls, forgetting old demand
+
+/**
+ * Strategies for choosing the car serving a call.
+ */
+typedef enum {
+    DISPATCH_QUEUE_LENGTH,  // The car with the fewest queued stops
+    DISPATCH_ETA,           // The car with the lowest estimated pickup time plus delay caused to the queued stops
+    DISPATCH_GROUP,         // Like DISPATCH_ETA, but calls sharing source and destination ride together
+                            // and stops the queue does not make yet cost extra
+    DISPATCH_AUTO           // The strategy suiting the traffic pattern traffic.c detects
+} dispatch_mode;
+
+/**
+ * What the scheduler needs from its environment.
+ */
+typedef struct scheduler_hooks {
+    /// Returns the current time in nanoseconds
+    uint64_t (*now)( void );
+
+    /// Sends the car to the floor, called with the car's mutex held
+    void (*send_floor)( Car *car, floor_t floor );
+
+    /// Called with the nanoseconds spent waiting for a contended car->mutex, may be NULL
+    void (*lock_wait)( uint64_t ns );
+
+    /// Called with the car's mutex held after the node was linked into the car's queue, may be NULL
+    void (*node_added)( Car *car, const QueueNode *node );
+
+    /// Called with the car's mutex held before the head of the car's queue is unlinked, may be NULL
+    void (*head_removed)( Car *car );
+
+    /// Called with the car's mutex held with how long the passengers picked up at its floor waited, may be NULL
+    void (*picked_up)( Car *car, uint64_t wait_ns );
+
+    /// Returns the nanoseconds since midnight, may be NULL, which disables parking idle cars
+    uint64_t (*time_of_day)( void );
+
+    /// Called by DISPATCH_AUTO after the traffic pattern changed and calls are dispatched with mode now, may be NULL
+    void (*traffic_changed)( traffic_pattern from, traffic_pattern to, dispatch_mode mode );
+} scheduler_hooks_t;
+
+/**
+ * Sets the hooks and the dispatch strategy, must be called before any other function of the scheduler.
+ */
+void scheduler_init( const scheduler_hooks_t *hooks, dispatch_mode mode );
+
+/**
+ * Parses the name of a dispatch strategy ("queue", "eta", "group" or "auto"). Returns 0 on success, -1 if the name is unknown.
+ */
+int dispatch_mode_parse( const char *name, dispatch_mode *mode );
+
+/**
+ * Returns the name of a dispatch strategy as parsed by dispatch_mode_parse().
+ */
+const char *dispatch_mode_name( dispatch_mode mode );
+
+/**
+ * Initializes the scheduling state of a car resting at its lowest floor with an empty queue.
+ */
+void car_state_init( Car *car, floor_t lowest_floor, floor_t highest_floor );
+
+/**
+ * Locks the car's mutex, reporting the time spent waiting if it was contended.
+ */
+void lock_car( Car *car );
+
+/**
+ * Returns the car's measured delay, or DEFAULT_CAR_DELAY_NS if it was not measured yet.
+ */
+uint64_t car_delay_ns( Car *car );
+
+/**
+ * Returns a consistent copy of the car's queue aggregates, including the projected time to serve the whole queue.
+ * The copy is taken under the car's mutex, which also guards the position and delay the projection uses.
+ */
+queue_stats_t queue_stats_snapshot( Car *car );
+
+/**
+ * Inserts the source and destination floors of a call into the car's queue. The car's mutex must be held.
+ */
+void schedule_floors( Car *car, floor_t source_floor, floor_t destination_floor );
+
+/**
+ * Sends the car to the head of its queue, unless it is already on its way there.
+ * Called after schedule_floors with the car's mutex still held.
+ */
+void send_queue_head( Car *car );
+
+/**
+ * Appends count nodes (their floor and direction) to the car's queue, e.g. to restore a queue replicated from
+ * another controller. Nodes outside the car's floor range or going neither UP nor DOWN are skipped.
+ * The car's mutex must be held.
+ */
+void queue_restore( Car *car, const QueueNode *nodes, size_t count );
+
+/**
+ * Returns the car of the snapshot that is the most suitable for the call, or NULL if no car is suitable.
+ * With DISPATCH_AUTO, the call is counted into the traffic pattern detector first, whose pattern picks
+ * the strategy: DISPATCH_GROUP for up-peak, down-peak and lunch traffic and DISPATCH_ETA for interfloor traffic.
+ */
+Car * choose_car( const cv_snapshot_t *snapshot, floor_t source_floor, floor_t destination_floor );
+
+/**
+ * Updates the car's state based on the received status, current floor and destination floor.
+ * If the car has arrived at the destination floor, the floor is removed from the queue.
+ * If there are more floors in the queue, the next floor is scheduled, otherwise the car is parked.
+ *
+ * Parking (only with the time_of_day hook): choose_car counts the source floor of every call in a histogram
+ * by time of day. A car whose queue ran empty is sent to the floor with the most calls in the current and
+ * the next DEMAND_SLOT_MINUTES, every car already parked at a floor halving its demand for the next car.
+ * The next call for the car simply replaces the parking move.
+ */
+void update_car_state( Car *car, car_status status, floor_t current_floor, floor_t destination_floor );
+
+/**
+ * Gives up the floor the car was parked at, e.g. before the car is removed. The car's mutex must be held.
+ */
+void parking_release( Car *car );
+
+#endif
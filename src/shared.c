@@ -4,7 +4,18 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "shared.h"
 
 int recv_looped(int fd, void *buf, size_t sz)
@@ -14,7 +25,8 @@ int recv_looped(int fd, void *buf, size_t sz)
 
     while (remain > 0) {
         ssize_t received = read(fd, ptr, remain);
-        if (received == -1) {
+        // Reading failed or the peer closed the connection before the whole message arrived
+        if (received <= 0) {
             return -1;
         }
         ptr += received;
@@ -23,23 +35,147 @@ int recv_looped(int fd, void *buf, size_t sz)
     return 0;
 }
 
-char *receive_msg(int fd)
+static atomic_ulong receive_allocations;    // Buffers allocated to receive messages into
+
+uint64_t receive_allocation_count(void)
+{
+    return atomic_load_explicit(&receive_allocations, memory_order_relaxed);
+}
+
+char *receive_frame(int fd, uint32_t *len)
 {
     uint32_t nlen;
     if (recv_looped(fd, &nlen, sizeof(nlen)) == - 1) {
         return NULL;
     }
-    uint32_t len = ntohl(nlen);
+    *len = ntohl(nlen);
     
-    char *buf = malloc(len + 1);
-    buf[len] = '\0';
-    if (recv_looped(fd, buf, len) == -1) {
+    atomic_fetch_add_explicit(&receive_allocations, 1, memory_order_relaxed);
+    char *buf = malloc(*len + 1);
+    buf[*len] = '\0';
+    if (recv_looped(fd, buf, *len) == -1) {
         free(buf);
         return NULL;
     }
     return buf;
 }
 
+void msg_buffer_init(msg_buffer_t *buf)
+{
+    buf->data = NULL;
+    buf->start = 0;
+    buf->len = 0;
+    buf->capacity = 0;
+    buf->borrowed = 0;
+}
+
+void msg_buffer_destroy(msg_buffer_t *buf)
+{
+    free(buf->data);
+    msg_buffer_init(buf);
+}
+
+char *receive_buffered(int fd, msg_buffer_t *buf, uint32_t *len)
+{
+    // Give the byte borrowed for the NUL terminator of the previous message back to the next one
+    if (buf->borrowed) {
+        buf->data[buf->start] = buf->saved;
+        buf->borrowed = 0;
+    }
+
+    while (1) {
+        size_t available = buf->len - buf->start;
+        size_t needed = sizeof(uint32_t);
+        if (available >= sizeof(uint32_t)) {
+            uint32_t nlen;
+            memcpy(&nlen, buf->data + buf->start, sizeof(nlen));
+            *len = ntohl(nlen);
+            if (*len > MAX_MESSAGE_LENGTH) {
+                return NULL;
+            }
+            needed += *len;
+            if (available >= needed) {
+                char *msg = buf->data + buf->start + sizeof(nlen);
+                buf->start += needed;
+                // The buffer always has a byte after the received data, see below
+                buf->saved = buf->data[buf->start];
+                buf->data[buf->start] = '\0';
+                buf->borrowed = 1;
+                return msg;
+            }
+        }
+
+        // Move the incomplete message to the front, make room for all of it plus the NUL terminator
+        if (available > 0) {
+            memmove(buf->data, buf->data + buf->start, available);
+        }
+        buf->start = 0;
+        buf->len = available;
+        if (buf->capacity < needed + 1) {
+            size_t capacity = needed + 1 > MSG_BUFFER_SIZE ? needed + 1 : MSG_BUFFER_SIZE;
+            char *data = realloc(buf->data, capacity);
+            if (data == NULL) {
+                perror("realloc()");
+                return NULL;
+            }
+            atomic_fetch_add_explicit(&receive_allocations, 1, memory_order_relaxed);
+            buf->data = data;
+            buf->capacity = capacity;
+        }
+
+        // Read whatever arrived, possibly several messages at once
+        ssize_t received = read(fd, buf->data + buf->len, buf->capacity - buf->len - 1);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        // Reading failed or the peer closed the connection
+        if (received <= 0) {
+            return NULL;
+        }
+        buf->len += received;
+    }
+}
+
+int msg_buffer_has_message(const msg_buffer_t *buf)
+{
+    size_t available = buf->len - buf->start;
+    if (available < sizeof(uint32_t)) {
+        return 0;
+    }
+    // The first byte of the length prefix may be lent to the previous message as its NUL terminator
+    unsigned char prefix[sizeof(uint32_t)];
+    memcpy(prefix, buf->data + buf->start, sizeof(prefix));
+    if (buf->borrowed) {
+        prefix[0] = buf->saved;
+    }
+    uint32_t nlen;
+    memcpy(&nlen, prefix, sizeof(nlen));
+    uint32_t len = ntohl(nlen);
+    return len > MAX_MESSAGE_LENGTH || available >= sizeof(uint32_t) + len;
+}
+
+char *receive_msg(int fd)
+{
+    uint32_t len;
+    return receive_frame(fd, &len);
+}
+
+/**
+ * Waits until the full send buffer of a non-blocking socket drains, at most SEND_STALL_TIMEOUT_MS.
+ * Returns 0 if the socket is writable (or the wait was interrupted), -1 with errno ETIMEDOUT if the peer stopped
+ * reading, so that a thread serving many connections is never parked by one of them.
+ */
+static int wait_writable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int ready = poll(&pfd, 1, SEND_STALL_TIMEOUT_MS);
+    if (ready == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ready == -1 && errno != EINTR ? -1 : 0;
+}
+
 int send_looped(int fd, const void *msg, size_t sz)
 {
     const char *ptr = msg;
@@ -47,6 +183,16 @@ int send_looped(int fd, const void *msg, size_t sz)
 
     while (remain > 0) {
         ssize_t sent = write(fd, ptr, remain);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        // Non-blocking socket with a full send buffer -> wait a little for it to drain
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(fd) == -1) {
+                return -1;
+            }
+            continue;
+        }
         if (sent == -1) {
             return -1;
         }
@@ -57,82 +203,275 @@ int send_looped(int fd, const void *msg, size_t sz)
     return 0;
 }
 
+/**
+ * Writes all iovcnt buffers, continuing after partial writes. Returns 0 on success, -1 on failure.
+ * The iovecs are modified.
+ */
+static int writev_looped(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t sent = writev(fd, iov, iovcnt);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        // Non-blocking socket with a full send buffer -> wait a little for it to drain
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(fd) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (sent == -1) {
+            return -1;
+        }
+        // Skip what was written, the rest of a partially written buffer goes with the next write
+        while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+int send_frame(int fd, const void *msg, uint32_t len)
+{
+    uint32_t nlen = htonl(len);
+    struct iovec iov[2] = {
+        { .iov_base = &nlen, .iov_len = sizeof(nlen) },
+        { .iov_base = (void *) msg, .iov_len = len }
+    };
+    return writev_looped(fd, iov, 2);
+}
+
 int send_message(int fd, const char *msg)
 {
-    uint32_t len = htonl(strlen(msg));
+    return send_frame(fd, msg, strlen(msg));
+}
+
+int send_frame_nowait(int fd, const void *msg, uint32_t len)
+{
+    uint32_t nlen = htonl(len);
+    struct iovec iov[2] = {
+        { .iov_base = &nlen, .iov_len = sizeof(nlen) },
+        { .iov_base = (void *) msg, .iov_len = len }
+    };
+    struct msghdr hdr = { .msg_iov = iov, .msg_iovlen = 2 };
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent == (ssize_t) (sizeof(nlen) + len) ? 0 : -1;
+}
+
+void frame_batch_init(frame_batch_t *batch)
+{
+    batch->count = 0;
+}
 
-    if (send_looped(fd, &len, sizeof(len)) == -1) {
+int frame_batch_add(frame_batch_t *batch, const void *msg, uint32_t len)
+{
+    if (batch->count == MAX_BATCH_FRAMES) {
         return -1;
     }
+    size_t i = batch->count++;
+    batch->lens[i] = htonl(len);
+    batch->iov[2 * i].iov_base = &batch->lens[i];
+    batch->iov[2 * i].iov_len = sizeof(batch->lens[i]);
+    batch->iov[2 * i + 1].iov_base = (void *) msg;
+    batch->iov[2 * i + 1].iov_len = len;
+    return 0;
+}
+
+int frame_batch_send(frame_batch_t *batch, int fd)
+{
+    int result = writev_looped(fd, batch->iov, 2 * batch->count);
+    batch->count = 0;
+    return result;
+}
 
-    if (send_looped(fd, msg, strlen(msg)) == -1) {
+int set_low_latency(int fd)
+{
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+        perror("setsockopt(TCP_NODELAY)");
         return -1;
     }
-
     return 0;
 }
 
-int is_valid_floor(const char *floor) {
-    int len = strlen(floor);
+/**
+ * Connects to a single host:port endpoint. Returns the connected socket, or -1 on failure.
+ */
+static int connect_endpoint(const char *endpoint, size_t len)
+{
+    char host[INET_ADDRSTRLEN] = {0};
+    const char *colon = memchr(endpoint, ':', len);
+    if (colon == NULL || (size_t) (colon - endpoint) >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, endpoint, colon - endpoint);
 
-    // Check for format: B##
-    if (floor[0] == 'B') {
-        // Floor number can't start with 0
-        if (floor[1] == '0') {
-            return 0;
+    long port = 0;
+    for (const char *p = colon + 1; p < endpoint + len; p++) {
+        if (*p < '0' || *p > '9' || (port = port * 10 + (*p - '0')) > 65535) {
+            return -1;
         }
-        // Ensure it's 'B' followed by 1 to 2 digits
-        if (len < 2 || len > 3) {
-            return 0;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (port == 0 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid controller endpoint: %.*s\n", (int) len, endpoint);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    set_low_latency(fd);
+    return fd;
+}
+
+int connect_controller(const char *endpoints)
+{
+    const char *endpoint = endpoints;
+    while (*endpoint != '\0') {
+        size_t len = strcspn(endpoint, ",");
+        int fd = connect_endpoint(endpoint, len);
+        if (fd != -1) {
+            return fd;
         }
-        for (int i = 1; i < len; i++) {
-            if (!isdigit(floor[i])) {
-                return 0;
-            }
+        endpoint += len;
+        if (*endpoint == ',') {
+            endpoint++;
         }
     }
-    // Check for format: ###
-    else {
-        // Floor number can't start with 0
-        if (floor[0] == '0') {
-            return 0;
-        }
-        // Ensure it's 1 to 3 digits
-        if (len < 1 || len > 3) {
-            return 0;
+    return -1;
+}
+
+static char FLOOR_NAMES[FLOOR_COUNT][MAX_FLOOR_LENGTH]; // Lookup table of floor strings, indexed by floor - MIN_FLOOR
+static pthread_once_t floor_names_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Writes the string of a valid floor number into out.
+ */
+static void format_floor(floor_t floor, char out[MAX_FLOOR_LENGTH]) {
+    int value = floor < 0 ? -floor : floor;
+    char digits[MAX_FLOOR_LENGTH];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    if (floor < 0) {
+        *out++ = 'B';
+    }
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    *out = '\0';
+}
+
+static void init_floor_names(void) {
+    for (int floor = MIN_FLOOR; floor <= MAX_FLOOR; floor++) {
+        if (floor != NO_FLOOR) {
+            format_floor(floor, FLOOR_NAMES[floor - MIN_FLOOR]);
         }
-        for (int i = 0; i < len; i++) {
-            if (!isdigit(floor[i])) {
-                return 0;
-            }
+    }
+}
+
+floor_t floor_parse(const char *floor) {
+    int sign = 1;
+    size_t max_digits = 3;
+
+    // Format: B## (at most 2 digits)
+    if (floor[0] == 'B') {
+        sign = -1;
+        max_digits = 2;
+        floor++;
+    }
+    // Floor number can't be empty or start with 0
+    if (floor[0] < '1' || floor[0] > '9') {
+        return NO_FLOOR;
+    }
+
+    int value = 0;
+    for (size_t i = 0; floor[i] != '\0'; i++) {
+        if (i == max_digits || floor[i] < '0' || floor[i] > '9') {
+            return NO_FLOOR;
         }
+        value = value * 10 + (floor[i] - '0');
     }
-    return 1;
+    return sign * value;
 }
 
-int are_consecutive_floors(const char *before, const char *after) {
-    if (before[0] == 'B' && after[0] == 'B') {
-        return atoi(before + 1) >= atoi(after + 1);
-    } else if (before[0] == 'B') {
-        return 1;
-    } else if (after[0] == 'B') {
-        return 0;
-    } else {
-        return atoi(before) <= atoi(after);
+const char *floor_name(floor_t floor) {
+    if (!floor_is_valid(floor)) {
+        return NULL;
+    }
+    pthread_once(&floor_names_once, init_floor_names);
+    return FLOOR_NAMES[floor - MIN_FLOOR];
+}
+
+int floor_is_valid(int floor) {
+    return floor >= MIN_FLOOR && floor <= MAX_FLOOR && floor != NO_FLOOR;
+}
+
+floor_t floor_next(floor_t floor, char direction) {
+    if (direction == UP) {
+        // Max limit or move from the basement to the normal floors
+        return floor == MAX_FLOOR ? MAX_FLOOR : floor == -1 ? 1 : floor + 1;
+    }
+    // Min limit or move from the normal floors to the basement
+    return floor == MIN_FLOOR ? MIN_FLOOR : floor == 1 ? -1 : floor - 1;
+}
+
+int floor_distance(floor_t from, floor_t to) {
+    int distance = from < to ? to - from : from - to;
+    // There is no floor 0 between B1 and 1
+    if ((from < 0) != (to < 0)) {
+        distance--;
     }
+    return distance;
+}
+
+int is_valid_floor(const char *floor) {
+    return floor_parse(floor) != NO_FLOOR;
+}
+
+int are_consecutive_floors(const char *before, const char *after) {
+    return floor_parse(before) <= floor_parse(after);
 }
 
 int is_floor_within_bounds(const char *floor, const char *lowest_floor, const char *highest_floor) {
-    return are_consecutive_floors(lowest_floor, floor) && are_consecutive_floors(floor, highest_floor);
+    floor_t value = floor_parse(floor);
+    return floor_parse(lowest_floor) <= value && value <= floor_parse(highest_floor);
 }
 
 void tokenize_message(char *msg, char *tokens[], int max_tokens) {
     int count = 0;
-    char *token = strtok(msg, " ");
+    char *saveptr = NULL;
+    char *token = strtok_r(msg, " ", &saveptr);
 
     while (token != NULL && count < max_tokens) {
         tokens[count++] = token;
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &saveptr);
     }
 
     // Fill remaining tokens with NULL for safety
@@ -141,58 +480,295 @@ void tokenize_message(char *msg, char *tokens[], int max_tokens) {
     }
 }
 
-void increment_floor(char *floor) {
-    if (floor[0] == 'B') {
-        int floor_num = atoi(floor + 1);
-        // Move to normal floor
-        if (floor_num == 1) {
-            strcpy(floor, "1");
-        }
-        // Increment basement floor
-        else {
-            snprintf(floor, 4, "B%d", floor_num - 1);
-        }
-    } else {
-        int floor_num = atoi(floor);
-        // Max limit, return "999"
-        if (floor_num == 999) {
-            strcpy(floor, "999");
-        }
-        // Increment normal floor
-        else {
-            snprintf(floor, 4, "%d", floor_num + 1);
-        }
+void set_next_floor(char *floor, char direction) {
+    floor_t value = floor_parse(floor);
+    if (value != NO_FLOOR) {
+        strcpy(floor, floor_name(floor_next(value, direction)));
     }
 }
 
+void increment_floor(char *floor) {
+    set_next_floor(floor, UP);
+}
+
 void decrement_floor(char *floor) {
-    if (floor[0] == 'B') {
-        int floor_num = atoi(floor + 1);
-        // Max limit, return "B99"
-        if (floor_num == 99) {
-            strcpy(floor, "B99");
-        }
-        // Decrement basement floor
-        else {
-            snprintf(floor, 4, "B%d", floor_num + 1);
-        }
-    } else {
-        int floor_num = atoi(floor);
-        // Move to basement floor
-        if (floor_num == 1) {
-            strcpy(floor, "B1");
+    set_next_floor(floor, DOWN);
+}
+
+static const char *STATUS_NAMES[STATUS_COUNT] = { "Open", "Opening", "Closed", "Closing", "Between" };
+
+int status_from_string(const char *status) {
+    for (int i = 0; i < STATUS_COUNT; i++) {
+        if (strncmp(status, STATUS_NAMES[i], MAX_STATUS_LENGTH) == 0) {
+            return i;
         }
-        // Decrement normal floor
-        else {
-            snprintf(floor, 4, "%d", floor_num - 1);
+    }
+    return -1;
+}
+
+const char *status_to_string(car_status status) {
+    return STATUS_NAMES[status];
+}
+
+_Static_assert(offsetof(car_shared_mem, destination_floor) == offsetof(car_shared_mem, current_floor) + MAX_FLOOR_LENGTH
+    && offsetof(car_shared_mem, status) == offsetof(car_shared_mem, destination_floor) + MAX_FLOOR_LENGTH,
+    "The v1 strings must be contiguous");
+
+/**
+ * The v1 strings of the segment, V1_STRINGS_SIZE bytes from current_floor to the end of status.
+ */
+static char * v1_strings(car_shared_mem *shm) {
+    return (char *) shm + offsetof(car_shared_mem, current_floor);
+}
+
+/**
+ * Parses a v1 floor string, which a v1 writer may have left without a NUL terminator.
+ */
+static floor_t parse_v1_floor(const char *field) {
+    char floor[MAX_FLOOR_LENGTH + 1];
+    memcpy(floor, field, MAX_FLOOR_LENGTH);
+    floor[MAX_FLOOR_LENGTH] = '\0';
+    return floor_parse(floor);
+}
+
+/**
+ * Takes over the v1 strings into the state if a v1 writer changed them since a v2 process last wrote them.
+ */
+static void shm_adopt_v1(car_shared_mem *shm) {
+    if (memcmp(v1_strings(shm), shm->v1_strings, V1_STRINGS_SIZE) == 0) {
+        return;
+    }
+    // The strings are left as the v1 writer stored them, for v1 readers and for safety to find them invalid
+    floor_t current_floor = parse_v1_floor(shm->current_floor);
+    floor_t destination_floor = parse_v1_floor(shm->destination_floor);
+    int status = status_from_string(shm->status);
+    uint8_t state_status = status == -1 ? STATUS_INVALID : status;
+    shm->state.pending |= (current_floor != shm->state.current_floor ? SHM_DIRTY_CURRENT_FLOOR : 0)
+        | (destination_floor != shm->state.destination_floor ? SHM_DIRTY_DESTINATION_FLOOR : 0)
+        | (state_status != shm->state.status ? SHM_DIRTY_STATUS : 0);
+    shm->state.current_floor = current_floor;
+    shm->state.destination_floor = destination_floor;
+    shm->state.status = state_status;
+    memcpy(shm->v1_strings, v1_strings(shm), V1_STRINGS_SIZE);
+}
+
+/**
+ * Adds the flags written since the last change to the pending bits. The flags have no setters, v1 and v2 writers
+ * alike store them directly.
+ */
+static void shm_find_flag_changes(car_shared_mem *shm) {
+    const uint8_t *flags = &shm->open_button;
+    for (int i = 0; i < SHM_FLAG_COUNT; i++) {
+        if (flags[i] != shm->state.flags[i]) {
+            shm->state.pending |= SHM_DIRTY_OPEN_BUTTON << i;
+            shm->state.flags[i] = flags[i];
         }
     }
 }
 
-void set_next_floor(char *floor, char direction) {
-    if (direction == UP) {
-        increment_floor(floor);
-    } else {
-        decrement_floor(floor);
+/**
+ * Counts the pending bits as a change of their own.
+ */
+static void shm_publish_change(car_shared_mem *shm) {
+    if (shm->state.pending == 0) {
+        return;
+    }
+    uint32_t changes = atomic_load_explicit(&shm->state.changes, memory_order_relaxed);
+    atomic_store_explicit(&shm->state.changes, changes + 1, memory_order_release);
+    shm->state.dirty = shm->state.pending;
+    shm->state.pending = 0;
+}
+
+void shm_init(car_shared_mem *shm, floor_t floor) {
+    // Initialize mutex and condition variable
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&shm->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&shm->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    // Initialize other fields
+    memset(v1_strings(shm), 0, V1_STRINGS_SIZE);
+    shm->open_button = 0;
+    shm->close_button = 0;
+    shm->door_obstruction = 0;
+    shm->overload = 0;
+    shm->emergency_stop = 0;
+    shm->individual_service_mode = 0;
+    shm->emergency_mode = 0;
+    shm->magic = CAR_SHM_MAGIC;
+    shm->version = CAR_SHM_VERSION;
+    atomic_store(&shm->state.seq, 0);
+    shm->state.current_floor = NO_FLOOR;
+    shm->state.destination_floor = NO_FLOOR;
+    shm_set_current_floor(shm, floor);
+    shm_set_destination_floor(shm, floor);
+    shm_set_status(shm, STATUS_CLOSED);
+    // The initial contents are no change
+    atomic_store(&shm->state.changes, 0);
+    shm->state.dirty = 0;
+    shm->state.pending = 0;
+    memset(shm->state.flags, 0, SHM_FLAG_COUNT);
+}
+
+car_shared_mem * open_shared_memory(const char *share_name) {
+    int fd = shm_open(share_name, O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    // A segment of an older car is smaller, mapping it whole would fault beyond its end
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(car_shared_mem)) {
+        close(fd);
+        return NULL;
+    }
+
+    car_shared_mem *shm = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+    if (shm->magic != CAR_SHM_MAGIC || shm->version != CAR_SHM_VERSION) {
+        munmap(shm, sizeof(car_shared_mem));
+        return NULL;
+    }
+    return shm;
+}
+
+/**
+ * Makes seq odd, the contents may change from now on. What v1 writers changed since the last change is counted as
+ * a change of its own, so that the holder of the mutex sees it in shm_changed_since().
+ */
+static void shm_write_begin(car_shared_mem *shm) {
+    uint32_t seq = atomic_load_explicit(&shm->state.seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->state.seq, seq + 1, memory_order_relaxed);
+    // Orders the increment before the changes to the contents
+    atomic_thread_fence(memory_order_release);
+    shm_adopt_v1(shm);
+    shm_find_flag_changes(shm);
+    shm_publish_change(shm);
+}
+
+/**
+ * Counts what the holder of the mutex changed as one change and makes seq even again, publishing the changes.
+ */
+static void shm_write_end(car_shared_mem *shm) {
+    shm_find_flag_changes(shm);
+    shm_publish_change(shm);
+    uint32_t seq = atomic_load_explicit(&shm->state.seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->state.seq, seq + 1, memory_order_release);
+}
+
+int shm_lock(car_shared_mem *shm) {
+    int result = pthread_mutex_lock(&shm->mutex);
+    shm_write_begin(shm);
+    return result;
+}
+
+int shm_unlock(car_shared_mem *shm) {
+    shm_write_end(shm);
+    return pthread_mutex_unlock(&shm->mutex);
+}
+
+int shm_wait(car_shared_mem *shm) {
+    shm_write_end(shm);
+    int result = pthread_cond_wait(&shm->cond, &shm->mutex);
+    shm_write_begin(shm);
+    return result;
+}
+
+int shm_timedwait(car_shared_mem *shm, const struct timespec *timeout) {
+    shm_write_end(shm);
+    int result = pthread_cond_timedwait(&shm->cond, &shm->mutex, timeout);
+    shm_write_begin(shm);
+    return result;
+}
+
+void shm_set_status(car_shared_mem *shm, car_status status) {
+    shm->state.pending |= shm->state.status != status ? SHM_DIRTY_STATUS : 0;
+    shm->state.status = status;
+    strcpy(shm->status, status_to_string(status));
+    memcpy(shm->v1_strings, v1_strings(shm), V1_STRINGS_SIZE);
+}
+
+/**
+ * The v1 string of a floor, empty for NO_FLOOR.
+ */
+static const char * v1_floor_name(floor_t floor) {
+    const char *name = floor_name(floor);
+    return name != NULL ? name : "";
+}
+
+void shm_set_current_floor(car_shared_mem *shm, floor_t floor) {
+    shm->state.pending |= shm->state.current_floor != floor ? SHM_DIRTY_CURRENT_FLOOR : 0;
+    shm->state.current_floor = floor;
+    strcpy(shm->current_floor, v1_floor_name(floor));
+    memcpy(shm->v1_strings, v1_strings(shm), V1_STRINGS_SIZE);
+}
+
+void shm_set_destination_floor(car_shared_mem *shm, floor_t floor) {
+    shm->state.pending |= shm->state.destination_floor != floor ? SHM_DIRTY_DESTINATION_FLOOR : 0;
+    shm->state.destination_floor = floor;
+    strcpy(shm->destination_floor, v1_floor_name(floor));
+    memcpy(shm->v1_strings, v1_strings(shm), V1_STRINGS_SIZE);
+}
+
+unsigned shm_changed_since(car_shared_mem *shm, uint32_t *seen) {
+    uint32_t changes = atomic_load_explicit(&shm->state.changes, memory_order_relaxed);
+    unsigned dirty = changes == *seen ? 0 : changes - *seen == 1 ? shm->state.dirty : SHM_DIRTY_ALL;
+    *seen = changes;
+    return dirty;
+}
+
+int shm_may_have_changed(car_shared_mem *shm, uint32_t seen) {
+    // Racing with writers is fine here, a torn read at worst takes the caller to the mutex for nothing
+    return atomic_load_explicit(&shm->state.changes, memory_order_acquire) != seen
+        || memcmp(v1_strings(shm), shm->v1_strings, V1_STRINGS_SIZE) != 0
+        || memcmp(&shm->open_button, shm->state.flags, SHM_FLAG_COUNT) != 0;
+}
+
+int shm_broadcast(car_shared_mem *shm) {
+    shm_find_flag_changes(shm);
+    if (shm->state.pending == 0) {
+        return 0;
+    }
+    return pthread_cond_broadcast(&shm->cond);
+}
+
+/**
+ * Copies the state and buttons, the buttons are contiguous in both.
+ */
+static void copy_snapshot(car_shared_mem *shm, car_snapshot_t *snapshot) {
+    snapshot->current_floor = shm->state.current_floor;
+    snapshot->destination_floor = shm->state.destination_floor;
+    snapshot->status = shm->state.status;
+    memcpy(&snapshot->open_button, &shm->open_button,
+        offsetof(car_snapshot_t, emergency_mode) + 1 - offsetof(car_snapshot_t, open_button));
+}
+
+void shm_snapshot(car_shared_mem *shm, car_snapshot_t *snapshot) {
+    for (int attempt = 0; attempt < SHM_SNAPSHOT_RETRIES; attempt++) {
+        uint32_t before = atomic_load_explicit(&shm->state.seq, memory_order_acquire);
+        if (before & 1) {
+            // A writer holds the mutex, let it finish
+            sched_yield();
+            continue;
+        }
+        copy_snapshot(shm, snapshot);
+        // Orders the copy before the second read of seq
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shm->state.seq, memory_order_relaxed) == before) {
+            return;
+        }
     }
+    pthread_mutex_lock(&shm->mutex);
+    copy_snapshot(shm, snapshot);
+    pthread_mutex_unlock(&shm->mutex);
 }
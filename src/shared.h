@@ -1,6 +1,11 @@
+#ifndef SHARED_H
+#define SHARED_H
+
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #define MAX_CAR_NAME_LENGTH 255 // Limit for the length of shared memory name
 #define SHM_NAME_PREFIX "/car"
@@ -9,10 +14,165 @@
 #define UP 'U'
 #define DOWN 'D'
 
+#define MIN_FLOOR -99     // B99
+#define MAX_FLOOR 999
+#define NO_FLOOR 0        // Floor numbers skip 0, B1 is directly below 1
+#define FLOOR_COUNT (MAX_FLOOR - MIN_FLOOR + 1)
+
+#define DEFAULT_CONTROLLERS "127.0.0.1:3000"    // Where cars and call pads find the controller by default
+#define CONTROLLERS_ENV "ELEVATOR_CONTROLLERS"  // Environment variable overriding DEFAULT_CONTROLLERS for call pads
+#define MAX_BATCH_FRAMES 16                     // Frames a frame_batch_t can cork into one write
+#define MSG_BUFFER_SIZE 4096                    // Initial size of a msg_buffer_t
+#define MAX_MESSAGE_LENGTH 65536                // Longer messages break the connection of a msg_buffer_t
+#define SEND_STALL_TIMEOUT_MS 100               // How long a send waits for a non-blocking socket's peer to read
+
+/**
+ * Canonical floor number: B99-B1 map to -99 to -1, 1-999 stay 1 to 999.
+ * Floors are converted from/to strings only when they are exchanged with other components.
+ */
+typedef int16_t floor_t;
+
+/**
+ * The states of a car's doors and movement, in the order of their text representations in STATUS_NAMES.
+ */
+typedef enum {
+    STATUS_OPEN,
+    STATUS_OPENING,
+    STATUS_CLOSED,
+    STATUS_CLOSING,
+    STATUS_BETWEEN,
+    STATUS_COUNT
+} car_status;
+
+int recv_looped(int fd, void *buf, size_t sz);
+
+/**
+ * Sends all sz bytes. On a non-blocking socket whose peer stopped reading, gives up after SEND_STALL_TIMEOUT_MS.
+ * Returns 0 on success, -1 on failure.
+ */
+int send_looped(int fd, const void *msg, size_t sz);
+
 char *receive_msg(int fd);
 
+/**
+ * Receives a length-prefixed message which may contain binary data.
+ * The length of the message is stored into len, the returned buffer is NUL-terminated and must be freed by the caller.
+ */
+char *receive_frame(int fd, uint32_t *len);
+
+/**
+ * The reusable receive buffer of a connection, see receive_buffered().
+ */
+typedef struct msg_buffer {
+    char *data;
+    size_t start;               // Where the data not returned yet begins
+    size_t len;                 // Where the received data ends
+    size_t capacity;            // Always more than len, the byte after a message can hold its NUL terminator
+    char saved;                 // The byte at start, overwritten by the NUL terminator of the last message
+    int borrowed;               // 1 while saved must be put back
+} msg_buffer_t;
+
+void msg_buffer_init(msg_buffer_t *buf);
+
+void msg_buffer_destroy(msg_buffer_t *buf);
+
+/**
+ * Receives the next length-prefixed message of the connection through its buffer.
+ * Reads as much as is available, so one read may fetch several messages. The message is returned in place,
+ * NUL-terminated, and stays valid (and may be modified) until the next call. The buffer only allocates while
+ * it grows to the longest message. The length of the message is stored into len.
+ * Returns NULL if the connection broke or sent a message longer than MAX_MESSAGE_LENGTH.
+ */
+char *receive_buffered(int fd, msg_buffer_t *buf, uint32_t *len);
+
+/**
+ * Returns 1 if the buffer holds a complete message (or an overlong length), so that the next receive_buffered()
+ * returns without reading, 0 otherwise. Lets an event loop drain a buffer that a single read filled with
+ * several messages.
+ */
+int msg_buffer_has_message(const msg_buffer_t *buf);
+
+/**
+ * Returns the number of buffers allocated so far by receive_frame() and receive_buffered().
+ */
+uint64_t receive_allocation_count(void);
+
+/**
+ * Sends a length-prefixed message which may contain binary data, prefix and message in a single write.
+ * Returns 0 on success, -1 on failure.
+ */
+int send_frame(int fd, const void *msg, uint32_t len);
+
+/**
+ * Sends a length-prefixed text message, see send_frame().
+ */
 int send_message(int fd, const char *msg);
 
+/**
+ * Sends a length-prefixed message only if the socket's send buffer takes all of it right away, without waiting.
+ * Returns 0 on success, -1 otherwise. The frame may have been sent partially, the caller must then drop the
+ * connection.
+ */
+int send_frame_nowait(int fd, const void *msg, uint32_t len);
+
+/**
+ * Frames corked to be sent with a single write.
+ * The messages are not copied, they must stay valid until frame_batch_send().
+ */
+typedef struct frame_batch {
+    struct iovec iov[2 * MAX_BATCH_FRAMES];     // The length prefix and the message of every frame
+    uint32_t lens[MAX_BATCH_FRAMES];            // The length prefixes in network byte order
+    size_t count;
+} frame_batch_t;
+
+void frame_batch_init(frame_batch_t *batch);
+
+/**
+ * Corks a length-prefixed message. Returns 0 on success, -1 if the batch is full.
+ */
+int frame_batch_add(frame_batch_t *batch, const void *msg, uint32_t len);
+
+/**
+ * Sends all corked frames in a single write and empties the batch. Returns 0 on success, -1 on failure.
+ */
+int frame_batch_send(frame_batch_t *batch, int fd);
+
+/**
+ * Disables Nagle's algorithm on a TCP socket, so that small messages are sent right away instead of waiting for the
+ * peer's (possibly delayed) ACK of the previous one. Returns 0 on success, -1 on failure.
+ */
+int set_low_latency(int fd);
+
+/**
+ * Connects to the first reachable controller of a comma separated list of IPv4 endpoints ("host:port,host:port").
+ * Returns the connected socket with low latency options set, or -1 if none of the controllers could be reached.
+ */
+int connect_controller(const char *endpoints);
+
+/**
+ * Parses a floor string (B##/###, no leading zeros). Returns NO_FLOOR if the string is not a valid floor.
+ */
+floor_t floor_parse(const char *floor);
+
+/**
+ * Returns the string of a floor number from a precomputed table, or NULL if the number is not a valid floor.
+ */
+const char *floor_name(floor_t floor);
+
+int floor_is_valid(int floor);
+
+/**
+ * Returns the floor one above (UP) or below (DOWN) the given floor, staying at B99 and 999.
+ */
+floor_t floor_next(floor_t floor, char direction);
+
+/**
+ * Returns the number of floors between the two floors.
+ */
+int floor_distance(floor_t from, floor_t to);
+
+// String wrappers of the functions above
+
 int is_valid_floor(const char *arg);
 
 int are_consecutive_floors(const char *before, const char *after);
@@ -30,12 +190,60 @@ void decrement_floor(char *floor);
 
 void set_next_floor(char *floor, char direction);
 
+/**
+ * Returns the car_status for the status string or -1 if the string is not a valid status.
+ */
+int status_from_string(const char *status);
+
+const char *status_to_string(car_status status);
+
+#define CAR_SHM_MAGIC 0x43415253u  // "CARS", marks a segment with the v2 layout
+#define CAR_SHM_VERSION 2
+#define CACHE_LINE_SIZE 64
+#define STATUS_INVALID 0xFF         // car_state_t.status after a v1 writer stored an unknown status string
+#define V1_STRINGS_SIZE (2 * MAX_FLOOR_LENGTH + MAX_STATUS_LENGTH)
+
+#define SHM_FLAG_COUNT 7              // The uint8_t fields from open_button to emergency_mode
+
+// Bits of the fields of car_shared_mem in dirty masks
+#define SHM_DIRTY_STATUS (1u << 0)
+#define SHM_DIRTY_CURRENT_FLOOR (1u << 1)
+#define SHM_DIRTY_DESTINATION_FLOOR (1u << 2)
+#define SHM_DIRTY_OPEN_BUTTON (1u << 3)     // The flags follow in the order of their fields
+#define SHM_DIRTY_CLOSE_BUTTON (1u << 4)
+#define SHM_DIRTY_DOOR_OBSTRUCTION (1u << 5)
+#define SHM_DIRTY_OVERLOAD (1u << 6)
+#define SHM_DIRTY_EMERGENCY_STOP (1u << 7)
+#define SHM_DIRTY_INDIVIDUAL_SERVICE_MODE (1u << 8)
+#define SHM_DIRTY_EMERGENCY_MODE (1u << 9)
+#define SHM_DIRTY_ALL ((1u << 10) - 1)
+
+/**
+ * The state the car's state machine works on, on a cache line of its own. Only changed with the mutex held.
+ */
+typedef struct {
+    _Atomic uint32_t seq;           // Odd while a thread holds the mutex outside of a wait, see shm_snapshot()
+    floor_t current_floor;          // NO_FLOOR after a v1 writer stored an invalid floor string
+    floor_t destination_floor;
+    uint8_t status;                 // car_status or STATUS_INVALID
+    _Atomic uint32_t changes;       // Incremented by every change, see shm_changed_since()
+    uint16_t dirty;                 // SHM_DIRTY_* bits of the fields the last change changed
+    uint16_t pending;               // SHM_DIRTY_* bits the current holder of the mutex changed so far
+    uint8_t flags[SHM_FLAG_COUNT];  // The flags as of the last change, to find those a writer changed
+} car_state_t;
+
+/**
+ * The shared memory of a car, /car{name}.
+ * Version 1 consisted of the fields up to emergency_mode, with the floors and status as strings. They stay at the
+ * same offsets with the same contents, so v1 readers and writers keep working: the strings mirror the state and
+ * strings changed by a v1 writer are adopted into the state the next time a v2 process takes the mutex.
+ */
 typedef struct {
     pthread_mutex_t mutex;                      // Locked while accessing struct contents
     pthread_cond_t cond;                        // Signalled when the contents change
-    char current_floor[MAX_FLOOR_LENGTH];       // C string in the range B99-B1 and 1-999
-    char destination_floor[MAX_FLOOR_LENGTH];   // C string in the range B99-B1 and 1-999
-    char status[MAX_STATUS_LENGTH];             // C string indicating the elevator's status
+    char current_floor[MAX_FLOOR_LENGTH];       // v1: C string in the range B99-B1 and 1-999
+    char destination_floor[MAX_FLOOR_LENGTH];   // v1: C string in the range B99-B1 and 1-999
+    char status[MAX_STATUS_LENGTH];             // v1: C string indicating the elevator's status
     uint8_t open_button;                        // 1 if open doors button is pressed, else 0
     uint8_t close_button;                       // 1 if close doors button is pressed, else 0
     uint8_t door_obstruction;                   // 1 if obstruction detected, else 0
@@ -43,4 +251,98 @@ typedef struct {
     uint8_t emergency_stop;                     // 1 if stop button has been pressed, else 0
     uint8_t individual_service_mode;            // 1 if in individual service mode, else 0
     uint8_t emergency_mode;                     // 1 if in emergency mode, else 0
+    uint32_t magic;                             // CAR_SHM_MAGIC
+    uint16_t version;                           // CAR_SHM_VERSION
+    char v1_strings[V1_STRINGS_SIZE];           // The v1 strings as last written by a v2 process
+    _Alignas(CACHE_LINE_SIZE) car_state_t state;
 } car_shared_mem;
+
+/**
+ * A consistent copy of a car's state and buttons.
+ */
+typedef struct {
+    floor_t current_floor;
+    floor_t destination_floor;
+    uint8_t status;
+    uint8_t open_button;
+    uint8_t close_button;
+    uint8_t door_obstruction;
+    uint8_t overload;
+    uint8_t emergency_stop;
+    uint8_t individual_service_mode;
+    uint8_t emergency_mode;
+} car_snapshot_t;
+
+#define SHM_SNAPSHOT_RETRIES 64 // Attempts of shm_snapshot() before it falls back to the mutex
+
+/**
+ * Initializes a new segment with the v2 layout, the car at the given floor with closed doors.
+ */
+void shm_init(car_shared_mem *shm, floor_t floor);
+
+/**
+ * Maps the segment of a car created by a v2 car. Returns NULL if it does not exist or has an older layout.
+ */
+car_shared_mem * open_shared_memory(const char *share_name);
+
+/*
+ * Writers keep using the mutex and condition variable through these wrappers, which also maintain state.seq:
+ * it is incremented to an odd value after locking and when returning from a wait, and to an even value before
+ * unlocking and waiting. The contents can therefore only change while seq is odd.
+ */
+
+/**
+ * pthread_mutex_lock() on the shared memory's mutex, returns its result.
+ */
+int shm_lock(car_shared_mem *shm);
+
+/**
+ * pthread_mutex_unlock() on the shared memory's mutex, returns its result.
+ */
+int shm_unlock(car_shared_mem *shm);
+
+/**
+ * pthread_cond_wait() on the shared memory's condition variable, the mutex must be held with shm_lock().
+ */
+int shm_wait(car_shared_mem *shm);
+
+/**
+ * pthread_cond_timedwait() on the shared memory's condition variable, the mutex must be held with shm_lock().
+ */
+int shm_timedwait(car_shared_mem *shm, const struct timespec *timeout);
+
+// Setters of the state keeping the v1 strings in sync, the mutex must be held with shm_lock()
+
+void shm_set_status(car_shared_mem *shm, car_status status);
+
+void shm_set_current_floor(car_shared_mem *shm, floor_t floor);
+
+void shm_set_destination_floor(car_shared_mem *shm, floor_t floor);
+
+/**
+ * Returns the SHM_DIRTY_* bits of the fields that changed since the change *seen and sets *seen to the latest change.
+ * Only the last change is known in detail, if more than one happened since *seen all bits are returned.
+ * The mutex must be held with shm_lock().
+ */
+unsigned shm_changed_since(car_shared_mem *shm, uint32_t *seen);
+
+/**
+ * Returns 0 if nothing changed since the change seen, without taking the mutex. Unlike shm_changed_since(), this
+ * also notices what v1 writers changed since the last change.
+ */
+int shm_may_have_changed(car_shared_mem *shm, uint32_t seen);
+
+/**
+ * Broadcasts the condition variable if the holder of the mutex changed a field, e.g. not for pressing a button that
+ * was pressed already. Returns 0 without waking anybody otherwise, like pthread_cond_broadcast() on success.
+ */
+int shm_broadcast(car_shared_mem *shm);
+
+/**
+ * Copies the state and buttons without taking the mutex: the copy is retried until seq was even and unchanged
+ * across it. A reader that keeps seeing writers (or a writer that died holding the mutex) falls back to the mutex
+ * after SHM_SNAPSHOT_RETRIES attempts.
+ */
+void shm_snapshot(car_shared_mem *shm, car_snapshot_t *snapshot);
+
+#endif
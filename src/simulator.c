@@ -0,0 +1,744 @@
+/*
+ * Discrete-event simulator for comparing dispatch strategies offline.
+ * Runs the controller's scheduling code (scheduler.c) against virtual cars, which move like car.c does,
+ * and a day of passenger arrivals on a virtual clock. Nothing sleeps, so a simulated day takes seconds.
+ * The passengers either come from a trace file, from a synthetic office building day with
+ * morning up-peak, lunch and evening down-peak traffic, or from a single hour of up-peak or down-peak.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "shared.h"
+#include "car_vector.h"
+#include "histogram.h"
+#include "scheduler.h"
+
+#define NS_PER_SECOND 1000000000ULL
+#define DEFAULT_CARS 4
+#define DEFAULT_FLOORS 20
+#define DEFAULT_PASSENGERS 10000
+#define DEFAULT_DELAY_MS 1000
+#define LOBBY_FLOOR 1
+#define PEAK_PERCENT 90         // Share of the passengers going the way of a peak, the rest is split evenly
+#define DEFAULT_CAPACITY 16     // Passengers a car holds
+#define DOOR_CYCLE_STEPS 3      // Opening, open and closing each take one delay
+
+typedef enum {
+    EVENT_ARRIVAL,      // A passenger arrives at the call pad, index is the passenger
+    EVENT_FLOOR,        // A FLOOR message reaches the car, index is the car
+    EVENT_STEP          // The car finishes its current movement, index is the car
+} event_kind;
+
+typedef struct event {
+    uint64_t time;              // Virtual time the event happens at
+    uint64_t seq;               // Keeps events of the same time in the order they were scheduled
+    event_kind kind;
+    size_t index;               // The passenger or the car
+    floor_t floor;              // The floor of EVENT_FLOOR
+    uint64_t generation;        // EVENT_STEP is stale if the car's generation moved on
+} event_t;
+
+typedef enum {
+    PASSENGER_WAITING,
+    PASSENGER_RIDING,
+    PASSENGER_DELIVERED,
+    PASSENGER_UNAVAILABLE       // No car could take the call
+} passenger_state;
+
+typedef struct passenger {
+    uint64_t arrival_ns;
+    floor_t source_floor;
+    floor_t destination_floor;
+    passenger_state state;
+    uint64_t board_ns;
+} passenger_t;
+
+/**
+ * A growable list of passenger indexes, order does not matter.
+ */
+typedef struct passenger_list {
+    size_t *items;
+    size_t size;
+    size_t capacity;
+} passenger_list_t;
+
+/**
+ * A virtual car. Its own state plays the part of car.c's shared memory,
+ * the scheduler's view of it (car) is only updated through update_car_state as the controller's is.
+ */
+typedef struct sim_car {
+    Car *car;
+    car_status status;
+    floor_t current_floor;
+    floor_t destination_floor;
+    int open_requested;         // FLOOR for the current floor arrived while the doors were open
+    int stepping;               // 1 while an EVENT_STEP is pending
+    uint64_t generation;        // Incremented whenever the pending EVENT_STEP is replaced
+    uint64_t changed_ns;        // When the status last changed
+    uint64_t busy_ns;           // Time spent moving or with the doors not closed
+    size_t floors_travelled;
+    size_t stops;
+    size_t carried;
+    int round_trip;             // 1 from the doors opening at the lobby until the car comes to rest
+    uint64_t lobby_ns;          // When the doors last opened at the lobby
+    size_t lobby_stops;         // Stops up to then
+    size_t lobby_floors;        // Floors travelled up to then
+    passenger_list_t waiting;   // Passengers assigned to the car who were not picked up yet
+    passenger_list_t riding;    // Passengers in the car
+} sim_car_t;
+
+static uint64_t clock_ns;       // The virtual clock
+static uint64_t delay_ns;       // Time the cars take per floor or door movement
+
+static event_t *events;         // Min-heap of pending events
+static size_t nevents;
+static size_t events_capacity;
+static uint64_t next_seq;
+static size_t events_processed;
+
+static car_vector_t cars;
+static sim_car_t *sim_cars;
+static size_t ncars;
+
+static passenger_t *passengers;
+static size_t npassengers;
+
+static size_t capacity = DEFAULT_CAPACITY;
+static size_t calls_repeated;   // Calls made again by passengers the car at their floor did not take
+
+static histogram_t wait_time;
+static histogram_t ride_time;
+static histogram_t round_trip_time;
+static size_t round_trips;
+static size_t round_trip_stops;
+
+static void * xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        perror("realloc()");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static int event_before(const event_t *a, const event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void event_push(uint64_t time, event_kind kind, size_t index, floor_t floor, uint64_t generation) {
+    if (nevents == events_capacity) {
+        events_capacity = events_capacity == 0 ? 1024 : events_capacity * 2;
+        events = xrealloc(events, events_capacity * sizeof(event_t));
+    }
+    event_t event = { .time = time, .seq = next_seq++, .kind = kind, .index = index, .floor = floor, .generation = generation };
+    size_t i = nevents++;
+    while (i > 0 && event_before(&event, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = event;
+}
+
+static event_t event_pop(void) {
+    event_t top = events[0];
+    event_t last = events[--nevents];
+    size_t i = 0;
+    while (2 * i + 1 < nevents) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < nevents && event_before(&events[child + 1], &events[child])) {
+            child++;
+        }
+        if (!event_before(&events[child], &last)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+static void list_add(passenger_list_t *list, size_t item) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->items = xrealloc(list->items, list->capacity * sizeof(size_t));
+    }
+    list->items[list->size++] = item;
+}
+
+static void list_remove_at(passenger_list_t *list, size_t i) {
+    list->items[i] = list->items[--list->size];
+}
+
+static uint64_t virtual_now(void) {
+    return clock_ns;
+}
+
+static void log_traffic_change(traffic_pattern from, traffic_pattern to, dispatch_mode mode) {
+    printf("%5.2f h: traffic changed from %s to %s, dispatching with %s\n", clock_ns / 1e9 / 3600.0,
+        traffic_pattern_name(from), traffic_pattern_name(to), dispatch_mode_name(mode));
+}
+
+static uint64_t virtual_time_of_day(void) {
+    return clock_ns % (24 * 3600 * NS_PER_SECOND);
+}
+
+static size_t sim_car_index(Car *car) {
+    size_t i = 0;
+    while (sim_cars[i].car != car) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Delivers the FLOOR message to the virtual car as a separate event,
+ * the scheduler calls this with the car's mutex held just like the controller sends to a socket.
+ */
+static void virtual_send_floor(Car *car, floor_t floor) {
+    event_push(clock_ns, EVENT_FLOOR, sim_car_index(car), floor, 0);
+}
+
+/**
+ * Schedules the end of the car's current movement one delay from now, replacing a pending one.
+ */
+static void schedule_step(size_t index) {
+    sim_car_t *sc = &sim_cars[index];
+    sc->generation++;
+    sc->stepping = 1;
+    event_push(clock_ns + delay_ns, EVENT_STEP, index, NO_FLOOR, sc->generation);
+}
+
+/**
+ * Ends the car's round trip if the doors open at the lobby after having left it.
+ * The round trip time and the stops it took are what grouping calls saves during up-peak.
+ */
+static void count_round_trip(sim_car_t *sc) {
+    if (sc->current_floor != LOBBY_FLOOR) {
+        return;
+    }
+    if (sc->round_trip && sc->floors_travelled > sc->lobby_floors) {
+        hist_record(&round_trip_time, clock_ns - sc->lobby_ns);
+        round_trips++;
+        round_trip_stops += sc->stops - sc->lobby_stops;
+    }
+    sc->round_trip = 1;
+    sc->lobby_ns = clock_ns;
+    sc->lobby_stops = sc->stops;
+    sc->lobby_floors = sc->floors_travelled;
+}
+
+/**
+ * Returns 1 if the car's queue stops at the floor in the direction, 0 otherwise.
+ */
+static int queue_stops_at(Car *car, floor_t floor, char direction) {
+    for (QueueNode *node = car->queue; node != NULL; node = node->next) {
+        if (node->floor == floor && node->direction == direction) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns 1 if the passenger may board the car whose doors are open at their floor: the car has room, its next
+ * stop elsewhere is on a trip in the passenger's direction and it still stops at their destination.
+ */
+static int may_board(sim_car_t *sc, const passenger_t *p) {
+    char direction = p->source_floor <= p->destination_floor ? UP : DOWN;
+    if (sc->riding.size >= capacity) {
+        return 0;
+    }
+    lock_car(sc->car);
+    const QueueNode *next = sc->car->queue;
+    while (next != NULL && next->floor == sc->current_floor) {
+        next = next->next;
+    }
+    int result = next != NULL && next->direction == direction
+        && queue_stops_at(sc->car, p->destination_floor, direction);
+    pthread_mutex_unlock(&sc->car->mutex);
+    return result;
+}
+
+/**
+ * Lets passengers out and in while the doors open, after the scheduler removed the stop from the car's queue.
+ * Passengers left behind keep waiting if the car comes back for them, else they call again once the doors closed.
+ */
+static void doors_opening(sim_car_t *sc) {
+    sc->stops++;
+    count_round_trip(sc);
+    for (size_t i = 0; i < sc->riding.size; ) {
+        passenger_t *p = &passengers[sc->riding.items[i]];
+        if (p->destination_floor == sc->current_floor) {
+            hist_record(&ride_time, clock_ns - p->board_ns);
+            p->state = PASSENGER_DELIVERED;
+            sc->carried++;
+            list_remove_at(&sc->riding, i);
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < sc->waiting.size; ) {
+        size_t index = sc->waiting.items[i];
+        passenger_t *p = &passengers[index];
+        if (p->source_floor != sc->current_floor) {
+            i++;
+            continue;
+        }
+        if (may_board(sc, p)) {
+            hist_record(&wait_time, clock_ns - p->arrival_ns);
+            p->state = PASSENGER_RIDING;
+            p->board_ns = clock_ns;
+            list_add(&sc->riding, index);
+            list_remove_at(&sc->waiting, i);
+            continue;
+        }
+        char direction = p->source_floor <= p->destination_floor ? UP : DOWN;
+        lock_car(sc->car);
+        int comes_back = queue_stops_at(sc->car, p->source_floor, direction);
+        pthread_mutex_unlock(&sc->car->mutex);
+        if (comes_back) {
+            i++;
+            continue;
+        }
+        // Calling right away would only make the car open its doors once more
+        calls_repeated++;
+        event_push(clock_ns + DOOR_CYCLE_STEPS * delay_ns, EVENT_ARRIVAL, index, NO_FLOOR, 0);
+        list_remove_at(&sc->waiting, i);
+    }
+}
+
+/**
+ * Changes the virtual car's status and reports it to the scheduler like car.c's STATUS messages.
+ */
+static void set_status(sim_car_t *sc, car_status status) {
+    if (sc->status != STATUS_CLOSED) {
+        sc->busy_ns += clock_ns - sc->changed_ns;
+    }
+    sc->changed_ns = clock_ns;
+    sc->status = status;
+    update_car_state(sc->car, sc->status, sc->current_floor, sc->destination_floor);
+    if (status == STATUS_OPENING) {
+        doors_opening(sc);
+    }
+}
+
+/**
+ * Starts the next movement of a car whose doors just closed, like car.c's main loop.
+ */
+static void start_next_movement(size_t index) {
+    sim_car_t *sc = &sim_cars[index];
+    sc->stepping = 0;
+    if (sc->open_requested) {
+        sc->open_requested = 0;
+        set_status(sc, STATUS_OPENING);
+        schedule_step(index);
+    } else if (sc->destination_floor != sc->current_floor) {
+        set_status(sc, STATUS_BETWEEN);
+        schedule_step(index);
+    } else {
+        // Idle time is not part of a round trip
+        sc->round_trip = 0;
+    }
+}
+
+static void handle_step(size_t index) {
+    sim_car_t *sc = &sim_cars[index];
+    switch (sc->status) {
+    case STATUS_BETWEEN:
+        if (sc->current_floor != sc->destination_floor) {
+            char direction = sc->current_floor < sc->destination_floor ? UP : DOWN;
+            sc->current_floor = floor_next(sc->current_floor, direction);
+            sc->floors_travelled++;
+        }
+        if (sc->current_floor != sc->destination_floor) {
+            set_status(sc, STATUS_BETWEEN);
+            schedule_step(index);
+            break;
+        }
+        // Arrived -> the doors open right away
+        set_status(sc, STATUS_CLOSED);
+        set_status(sc, STATUS_OPENING);
+        schedule_step(index);
+        break;
+    case STATUS_OPENING:
+        set_status(sc, STATUS_OPEN);
+        schedule_step(index);
+        break;
+    case STATUS_OPEN:
+        set_status(sc, STATUS_CLOSING);
+        schedule_step(index);
+        break;
+    case STATUS_CLOSING:
+        set_status(sc, STATUS_CLOSED);
+        start_next_movement(index);
+        break;
+    default:
+        sc->stepping = 0;
+        break;
+    }
+}
+
+static void handle_floor(size_t index, floor_t floor) {
+    sim_car_t *sc = &sim_cars[index];
+    if (floor == sc->current_floor && sc->status != STATUS_BETWEEN) {
+        if (sc->status == STATUS_OPENING || sc->status == STATUS_OPEN) {
+            // The doors open once more after closing
+            sc->open_requested = 1;
+            return;
+        }
+        // Closed or closing doors open again right away
+        set_status(sc, STATUS_OPENING);
+        schedule_step(index);
+        return;
+    }
+
+    sc->destination_floor = floor;
+    set_status(sc, sc->status);
+    if (sc->status == STATUS_CLOSED && !sc->stepping) {
+        start_next_movement(index);
+    }
+}
+
+/**
+ * Dispatches the passenger's call the way the controller's handle_call does.
+ * Also used for the calls of passengers a car left behind, their wait still counts from their first call.
+ */
+static void handle_arrival(size_t index) {
+    passenger_t *p = &passengers[index];
+    const cv_snapshot_t *snapshot = cv_read_lock(&cars);
+    Car *car = choose_car(snapshot, p->source_floor, p->destination_floor);
+    if (car == NULL) {
+        cv_read_unlock(&cars);
+        p->state = PASSENGER_UNAVAILABLE;
+        return;
+    }
+    lock_car(car);
+    schedule_floors(car, p->source_floor, p->destination_floor);
+    send_queue_head(car);
+    pthread_mutex_unlock(&car->mutex);
+    cv_read_unlock(&cars);
+
+    sim_car_t *sc = &sim_cars[sim_car_index(car)];
+    p->state = PASSENGER_WAITING;
+    // The doors are open at the passenger's floor -> step right in if the car goes their way
+    if (sc->current_floor == p->source_floor && (sc->status == STATUS_OPENING || sc->status == STATUS_OPEN)
+        && may_board(sc, p)) {
+        hist_record(&wait_time, clock_ns - p->arrival_ns);
+        p->state = PASSENGER_RIDING;
+        p->board_ns = clock_ns;
+        list_add(&sc->riding, index);
+        return;
+    }
+    list_add(&sc->waiting, index);
+}
+
+static passenger_t * add_passenger(void) {
+    static size_t capacity;
+    if (npassengers == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        passengers = xrealloc(passengers, capacity * sizeof(passenger_t));
+    }
+    return &passengers[npassengers++];
+}
+
+/**
+ * Reads a trace of lines "{seconds} {source floor} {destination floor}", lines starting with # are skipped.
+ */
+static void load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("fopen()");
+        exit(EXIT_FAILURE);
+    }
+    char line[128];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        double seconds;
+        char source[MAX_FLOOR_LENGTH + 1];
+        char destination[MAX_FLOOR_LENGTH + 1];
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        floor_t source_floor = NO_FLOOR;
+        floor_t destination_floor = NO_FLOOR;
+        if (sscanf(line, "%lf %4s %4s", &seconds, source, destination) == 3) {
+            source_floor = floor_parse(source);
+            destination_floor = floor_parse(destination);
+        }
+        if (seconds < 0 || source_floor == NO_FLOOR || destination_floor == NO_FLOOR || source_floor == destination_floor) {
+            fprintf(stderr, "%s:%zu: invalid passenger, skipped\n", path, line_number);
+            continue;
+        }
+        passenger_t *p = add_passenger();
+        p->arrival_ns = (uint64_t) (seconds * NS_PER_SECOND);
+        p->source_floor = source_floor;
+        p->destination_floor = destination_floor;
+    }
+    fclose(file);
+}
+
+/**
+ * Traffic of an office building for every hour of the day:
+ * relative number of passengers, share going up from the lobby and share going down to the lobby.
+ * The rest travels between the upper floors.
+ */
+static const struct {
+    int weight;
+    int up_percent;
+    int down_percent;
+} DAY_PROFILE[24] = {
+    { 1, 30, 30 }, { 1, 30, 30 }, { 1, 30, 30 }, { 1, 30, 30 }, { 1, 30, 30 }, { 1, 30, 30 },
+    { 5, 80, 10 }, { 40, 85, 5 }, { 100, 85, 5 }, { 40, 80, 5 }, { 20, 30, 30 }, { 30, 30, 40 },
+    { 60, 40, 50 }, { 40, 60, 20 }, { 20, 30, 30 }, { 20, 30, 30 }, { 40, 10, 80 }, { 90, 5, 85 },
+    { 30, 5, 85 }, { 10, 10, 70 }, { 5, 30, 30 }, { 2, 30, 30 }, { 2, 30, 30 }, { 2, 30, 30 }
+};
+
+static floor_t random_upper_floor(int floors, floor_t except) {
+    floor_t floor;
+    do {
+        floor = LOBBY_FLOOR + 1 + rand() % (floors - 1);
+    } while (floor == except);
+    return floor;
+}
+
+/**
+ * Generates the passengers of an hour, arriving as a Poisson process.
+ * up_percent of them go up from the lobby, down_percent down to the lobby, the rest between upper floors.
+ */
+static void generate_hour(int hour, double per_second, int up_percent, int down_percent, int floors) {
+    double time = hour * 3600.0;
+    while (1) {
+        // Exponentially distributed time until the next arrival
+        time += -log((rand() + 1.0) / (RAND_MAX + 2.0)) / per_second;
+        if (time >= (hour + 1) * 3600.0) {
+            break;
+        }
+        passenger_t *p = add_passenger();
+        p->arrival_ns = (uint64_t) (time * NS_PER_SECOND);
+        int kind = rand() % 100;
+        if (kind < up_percent) {
+            p->source_floor = LOBBY_FLOOR;
+            p->destination_floor = random_upper_floor(floors, NO_FLOOR);
+        } else if (kind < up_percent + down_percent || floors == 2) {
+            // A building of two floors has no traffic between upper floors
+            p->source_floor = random_upper_floor(floors, NO_FLOOR);
+            p->destination_floor = LOBBY_FLOOR;
+        } else {
+            p->source_floor = random_upper_floor(floors, NO_FLOOR);
+            p->destination_floor = random_upper_floor(floors, p->source_floor);
+        }
+    }
+}
+
+/**
+ * Generates a day of passengers, arriving at a rate following DAY_PROFILE.
+ */
+static void generate_day(size_t count, int floors) {
+    int total_weight = 0;
+    for (int hour = 0; hour < 24; hour++) {
+        total_weight += DAY_PROFILE[hour].weight;
+    }
+    for (int hour = 0; hour < 24; hour++) {
+        double per_second = (double) count * DAY_PROFILE[hour].weight / total_weight / 3600.0;
+        generate_hour(hour, per_second, DAY_PROFILE[hour].up_percent, DAY_PROFILE[hour].down_percent, floors);
+    }
+}
+
+/**
+ * Generates an hour of morning up-peak (up is 1) or evening down-peak (up is 0) with count passengers.
+ */
+static void generate_peak(size_t count, int floors, int up) {
+    int other_percent = (100 - PEAK_PERCENT) / 2;
+    generate_hour(0, count / 3600.0, up ? PEAK_PERCENT : other_percent, up ? other_percent : PEAK_PERCENT, floors);
+}
+
+static void print_distribution(const char *name, histogram_t *hist) {
+    printf("%s (s): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", name,
+        hist_mean(hist) / 1e9,
+        hist_percentile(hist, 50.0) / 1e9,
+        hist_percentile(hist, 90.0) / 1e9,
+        hist_percentile(hist, 99.0) / 1e9,
+        hist_max(hist) / 1e9);
+}
+
+static void print_report(double wall_seconds) {
+    size_t delivered = 0;
+    size_t unavailable = 0;
+    for (size_t i = 0; i < npassengers; i++) {
+        delivered += passengers[i].state == PASSENGER_DELIVERED;
+        unavailable += passengers[i].state == PASSENGER_UNAVAILABLE;
+    }
+    printf("Simulated %.1f h in %.2f s (%zu events)\n", clock_ns / 1e9 / 3600.0, wall_seconds, events_processed);
+    printf("Passengers: %zu, delivered %zu, unavailable %zu, stranded %zu, calls repeated %zu\n",
+        npassengers, delivered, unavailable, npassengers - delivered - unavailable, calls_repeated);
+    print_distribution("Wait time", &wait_time);
+    print_distribution("Ride time", &ride_time);
+    print_distribution("Round trip time", &round_trip_time);
+    printf("Round trips: %zu, %.1f stops per round trip\n", round_trips,
+        round_trips > 0 ? (double) round_trip_stops / round_trips : 0.0);
+    for (size_t i = 0; i < ncars; i++) {
+        sim_car_t *sc = &sim_cars[i];
+        printf("Car %s: utilization %.1f%%, %zu floors travelled, %zu stops, %zu passengers\n",
+            sc->car->car_name, clock_ns > 0 ? 100.0 * sc->busy_ns / clock_ns : 0.0,
+            sc->floors_travelled, sc->stops, sc->carried);
+    }
+}
+
+static size_t parse_count(const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end != '\0' || value <= 0) {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    size_t floors = DEFAULT_FLOORS;
+    size_t count = DEFAULT_PASSENGERS;
+    size_t delay_ms = DEFAULT_DELAY_MS;
+    const char *trace = NULL;
+    const char *traffic = "day";
+    int parking = 0;
+    unsigned seed = 1;
+    dispatch_mode dispatch = DISPATCH_QUEUE_LENGTH;
+    ncars = DEFAULT_CARS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:C:d:D:f:p:Ps:t:T:")) != -1) {
+        switch (opt) {
+        case 'c':
+            ncars = parse_count(optarg);
+            break;
+        case 'C':
+            capacity = parse_count(optarg);
+            break;
+        case 'd':
+            if (dispatch_mode_parse(optarg, &dispatch) == -1) {
+                fprintf(stderr, "Unknown dispatch mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            delay_ms = parse_count(optarg);
+            break;
+        case 'f':
+            floors = parse_count(optarg);
+            break;
+        case 'p':
+            count = parse_count(optarg);
+            break;
+        case 'P':
+            parking = 1;
+            break;
+        case 's':
+            seed = parse_count(optarg);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'T':
+            if (strcmp(optarg, "day") != 0 && strcmp(optarg, "uppeak") != 0 && strcmp(optarg, "downpeak") != 0) {
+                fprintf(stderr, "Unknown traffic: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            traffic = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c cars] [-C car capacity] [-f floors] [-d queue|eta|group|auto] [-D car delay ms] "
+                "[-P] [-T day|uppeak|downpeak] [-p passengers | -t trace file] [-s seed]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (capacity == 0) {
+        fprintf(stderr, "A car needs room for at least one passenger\n");
+        exit(EXIT_FAILURE);
+    }
+    if (floors < 2 || floors > MAX_FLOOR) {
+        fprintf(stderr, "The building needs 2 to %d floors\n", MAX_FLOOR);
+        exit(EXIT_FAILURE);
+    }
+    delay_ns = delay_ms * 1000000ULL;
+
+    srand(seed);
+    if (trace != NULL) {
+        load_trace(trace);
+    } else if (strcmp(traffic, "day") != 0) {
+        generate_peak(count, floors, strcmp(traffic, "uppeak") == 0);
+    } else {
+        generate_day(count, floors);
+    }
+
+    scheduler_hooks_t hooks = {
+        .now = virtual_now, .send_floor = virtual_send_floor, .lock_wait = NULL,
+        .time_of_day = parking ? virtual_time_of_day : NULL, .traffic_changed = log_traffic_change
+    };
+    scheduler_init(&hooks, dispatch);
+    cv_init(&cars);
+    sim_cars = calloc(ncars, sizeof(sim_car_t));
+    if (sim_cars == NULL) {
+        perror("calloc()");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < ncars; i++) {
+        Car *car = cv_alloc_car(&cars);
+        if (car == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        snprintf(car->car_name, MAX_CAR_NAME_LENGTH, "S%zu", i + 1);
+        car_state_init(car, LOBBY_FLOOR, floors);
+        car->clientfd = -1;
+        car->binary = 0;
+        cv_push(&cars, car);
+
+        sim_cars[i].car = car;
+        sim_cars[i].status = STATUS_CLOSED;
+        sim_cars[i].current_floor = LOBBY_FLOOR;
+        sim_cars[i].destination_floor = LOBBY_FLOOR;
+    }
+
+    hist_init(&wait_time);
+    hist_init(&ride_time);
+    hist_init(&round_trip_time);
+    for (size_t i = 0; i < npassengers; i++) {
+        event_push(passengers[i].arrival_ns, EVENT_ARRIVAL, i, NO_FLOOR, 0);
+    }
+
+    // Run until every car has come to rest after the last passenger
+    uint64_t start = now_ns();
+    while (nevents > 0) {
+        event_t event = event_pop();
+        clock_ns = event.time;
+        events_processed++;
+        switch (event.kind) {
+        case EVENT_ARRIVAL:
+            handle_arrival(event.index);
+            break;
+        case EVENT_FLOOR:
+            handle_floor(event.index, event.floor);
+            break;
+        case EVENT_STEP:
+            if (event.generation == sim_cars[event.index].generation) {
+                handle_step(event.index);
+            }
+            break;
+        }
+    }
+    print_report((now_ns() - start) / 1e9);
+
+    for (size_t i = 0; i < ncars; i++) {
+        free(sim_cars[i].waiting.items);
+        free(sim_cars[i].riding.items);
+    }
+    free(sim_cars);
+    free(passengers);
+    free(events);
+    cv_destroy(&cars);
+    return 0;
+}
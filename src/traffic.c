@@ -0,0 +1,113 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include "traffic.h"
+
+typedef enum {
+    CALL_NONE,              // A slot of the window no call was recorded into yet
+    CALL_INCOMING,
+    CALL_OUTGOING,
+    CALL_INTERFLOOR,
+    CALL_KIND_COUNT
+} call_kind;
+
+static const char *PATTERN_NAMES[TRAFFIC_PATTERN_COUNT] = { "interfloor", "uppeak", "downpeak", "lunch" };
+
+// The kinds of the last calls, a ring overwritten from window_next on
+static _Atomic uint8_t window[TRAFFIC_WINDOW_CALLS];
+static _Atomic uint32_t window_next;
+// Slots of the window per kind, always adding up to TRAFFIC_WINDOW_CALLS once the recording calls finished
+static _Atomic uint32_t kind_counts[CALL_KIND_COUNT] = { TRAFFIC_WINDOW_CALLS };
+
+static _Atomic int current = TRAFFIC_INTERFLOOR;
+// The pattern the window was classified as differing from the current one and for how many calls in a row,
+// only updated by the thread holding state_mutex
+static traffic_pattern candidate = TRAFFIC_INTERFLOOR;
+static uint32_t candidate_calls;
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static call_kind classify_call(floor_t source_floor, floor_t destination_floor) {
+    int source_entrance = source_floor <= TRAFFIC_LOBBY_FLOOR;
+    int destination_entrance = destination_floor <= TRAFFIC_LOBBY_FLOOR;
+    if (source_entrance && !destination_entrance) {
+        return CALL_INCOMING;
+    }
+    if (!source_entrance && destination_entrance) {
+        return CALL_OUTGOING;
+    }
+    return CALL_INTERFLOOR;
+}
+
+traffic_shares_t traffic_shares(void) {
+    traffic_shares_t shares = {
+        .incoming = atomic_load_explicit(&kind_counts[CALL_INCOMING], memory_order_relaxed),
+        .outgoing = atomic_load_explicit(&kind_counts[CALL_OUTGOING], memory_order_relaxed),
+        .interfloor = atomic_load_explicit(&kind_counts[CALL_INTERFLOOR], memory_order_relaxed)
+    };
+    return shares;
+}
+
+/**
+ * Classifies the window. The thresholds for staying in the current pattern are lower than those for entering it,
+ * so that a share hovering around a threshold does not flip the pattern back and forth.
+ */
+static traffic_pattern classify_window(traffic_pattern pattern) {
+    traffic_shares_t shares = traffic_shares();
+    uint32_t total = shares.incoming + shares.outgoing + shares.interfloor;
+    if (total == 0) {
+        return pattern;
+    }
+    uint32_t incoming = shares.incoming * 100 / total;
+    uint32_t outgoing = shares.outgoing * 100 / total;
+
+    uint32_t uppeak = pattern == TRAFFIC_UPPEAK ? TRAFFIC_PEAK_LEAVE_PERCENT : TRAFFIC_PEAK_ENTER_PERCENT;
+    uint32_t downpeak = pattern == TRAFFIC_DOWNPEAK ? TRAFFIC_PEAK_LEAVE_PERCENT : TRAFFIC_PEAK_ENTER_PERCENT;
+    uint32_t lunch = pattern == TRAFFIC_LUNCH ? TRAFFIC_LUNCH_LEAVE_PERCENT : TRAFFIC_LUNCH_ENTER_PERCENT;
+    if (incoming >= uppeak) {
+        return TRAFFIC_UPPEAK;
+    }
+    if (outgoing >= downpeak) {
+        return TRAFFIC_DOWNPEAK;
+    }
+    if (incoming >= lunch && outgoing >= lunch) {
+        return TRAFFIC_LUNCH;
+    }
+    return TRAFFIC_INTERFLOOR;
+}
+
+traffic_pattern traffic_record(floor_t source_floor, floor_t destination_floor, traffic_pattern *from) {
+    call_kind kind = classify_call(source_floor, destination_floor);
+    uint32_t slot = atomic_fetch_add_explicit(&window_next, 1, memory_order_relaxed) % TRAFFIC_WINDOW_CALLS;
+    call_kind replaced = atomic_exchange_explicit(&window[slot], kind, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&kind_counts[replaced], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&kind_counts[kind], 1, memory_order_relaxed);
+
+    traffic_pattern pattern = atomic_load_explicit(&current, memory_order_relaxed);
+    *from = pattern;
+    // Another dispatching thread is classifying the window already, it will see this call too
+    if (pthread_mutex_trylock(&state_mutex) != 0) {
+        return pattern;
+    }
+    pattern = atomic_load_explicit(&current, memory_order_relaxed);
+    *from = pattern;
+    traffic_pattern classified = classify_window(pattern);
+    if (classified == pattern) {
+        candidate_calls = 0;
+    } else if (classified != candidate || candidate_calls == 0) {
+        candidate = classified;
+        candidate_calls = 1;
+    } else if (++candidate_calls >= TRAFFIC_HOLD_CALLS) {
+        candidate_calls = 0;
+        pattern = classified;
+        atomic_store_explicit(&current, pattern, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return pattern;
+}
+
+traffic_pattern traffic_current(void) {
+    return atomic_load_explicit(&current, memory_order_relaxed);
+}
+
+const char * traffic_pattern_name(traffic_pattern pattern) {
+    return PATTERN_NAMES[pattern];
+}
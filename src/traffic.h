@@ -0,0 +1,60 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include <stdint.h>
+#include "shared.h"
+
+/*
+ * Detector of the building's traffic pattern, from the source and destination floors of the last
+ * TRAFFIC_WINDOW_CALLS calls. A call is incoming if it goes up from an entrance floor (the lobby or a car park below it),
+ * outgoing if it goes down to one, otherwise it is interfloor.
+ * Recording a call takes constant time and no lock that could make a dispatching thread wait.
+ */
+
+#define TRAFFIC_WINDOW_CALLS 128        // Calls the pattern is classified from
+#define TRAFFIC_HOLD_CALLS 32           // Calls in a row a new pattern must be classified for before it takes effect
+#define TRAFFIC_LOBBY_FLOOR 1           // The highest entrance floor, floors below it are car parks
+#define TRAFFIC_PEAK_ENTER_PERCENT 60   // Share of incoming (outgoing) calls starting an up-peak (down-peak)
+#define TRAFFIC_PEAK_LEAVE_PERCENT 45   // Share of incoming (outgoing) calls below which an up-peak (down-peak) ends
+#define TRAFFIC_LUNCH_ENTER_PERCENT 30  // Share of incoming and of outgoing calls starting lunch traffic
+#define TRAFFIC_LUNCH_LEAVE_PERCENT 20  // Share of incoming or of outgoing calls below which lunch traffic ends
+
+typedef enum {
+    TRAFFIC_INTERFLOOR,     // Mostly calls between upper floors, also the pattern before any call
+    TRAFFIC_UPPEAK,         // Mostly incoming calls, e.g. in the morning
+    TRAFFIC_DOWNPEAK,       // Mostly outgoing calls, e.g. in the evening
+    TRAFFIC_LUNCH,          // Many incoming and outgoing calls at once
+    TRAFFIC_PATTERN_COUNT
+} traffic_pattern;
+
+/**
+ * The calls of the window by kind.
+ */
+typedef struct traffic_shares {
+    uint32_t incoming;
+    uint32_t outgoing;
+    uint32_t interfloor;
+} traffic_shares_t;
+
+/**
+ * Counts the call into the window and returns the pattern in effect after it.
+ * *from is set to the pattern before the call, which differs from the returned one if the call completed a switch.
+ */
+traffic_pattern traffic_record( floor_t source_floor, floor_t destination_floor, traffic_pattern *from );
+
+/**
+ * Returns the pattern in effect.
+ */
+traffic_pattern traffic_current( void );
+
+/**
+ * Returns the calls of the window by kind.
+ */
+traffic_shares_t traffic_shares( void );
+
+/**
+ * Returns the name of the pattern ("interfloor", "uppeak", "downpeak" or "lunch").
+ */
+const char *traffic_pattern_name( traffic_pattern pattern );
+
+#endif
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "worker_pool.h"
+
+static void * wp_worker( void *arg ) {
+    worker_pool_t *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+        // Stopping and nothing left to do -> exit the worker
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        wp_task_t task = pool->tasks[pool->head];
+        pool->head = (pool->head + 1) % WP_QUEUE_CAPACITY;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+
+        task.fn(task.arg);
+    }
+
+    return NULL;
+}
+
+int wp_init( worker_pool_t *pool, size_t nthreads ) {
+    pool->nthreads = 0;
+    pool->head = 0;
+    pool->count = 0;
+    pool->stopping = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        perror("malloc()");
+        return -1;
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        int result = pthread_create(&pool->threads[i], NULL, wp_worker, pool);
+        if (result != 0) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(result));
+            wp_destroy(pool);
+            return -1;
+        }
+        pool->nthreads++;
+    }
+    return 0;
+}
+
+void wp_destroy( worker_pool_t *pool ) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nthreads = 0;
+
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+int wp_pin( worker_pool_t *pool, int cpu ) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    for (size_t i = 0; i < pool->nthreads; i++) {
+        int result = pthread_setaffinity_np(pool->threads[i], sizeof(cpus), &cpus);
+        if (result != 0) {
+            fprintf(stderr, "pthread_setaffinity_np() failed: %s\n", strerror(result));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void wp_submit( worker_pool_t *pool, wp_task_fn fn, void *arg ) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->count == WP_QUEUE_CAPACITY) {
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+    }
+    size_t tail = (pool->head + pool->count) % WP_QUEUE_CAPACITY;
+    pool->tasks[tail].fn = fn;
+    pool->tasks[tail].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,58 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define WP_QUEUE_CAPACITY 4096
+
+typedef void (*wp_task_fn)(void *arg);
+
+typedef struct wp_task {
+    wp_task_fn fn;
+    void *arg;
+} wp_task_t;
+
+/**
+ * A fixed-size pool of threads consuming tasks from a bounded ring buffer.
+ * Submitting into a full queue blocks until a worker frees a slot.
+ */
+typedef struct worker_pool {
+	/// The worker threads
+	pthread_t *threads;
+
+	/// The number of worker threads
+	size_t nthreads;
+
+	/// Ring buffer of pending tasks
+	wp_task_t tasks[WP_QUEUE_CAPACITY];
+
+	/// Index of the oldest pending task
+	size_t head;
+
+	/// The number of pending tasks
+	size_t count;
+
+	/// 1 once the pool is being destroyed
+	int stopping;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} worker_pool_t;
+
+int wp_init( worker_pool_t *pool, size_t nthreads );
+
+/**
+ * Finishes all pending tasks and joins the worker threads.
+ */
+void wp_destroy( worker_pool_t *pool );
+
+/**
+ * Restricts all worker threads of the pool to the given CPU. Returns 0 on success, -1 otherwise.
+ */
+int wp_pin( worker_pool_t *pool, int cpu );
+
+void wp_submit( worker_pool_t *pool, wp_task_fn fn, void *arg );
+
+#endif